@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "domain.h"
@@ -10,7 +11,7 @@ Account* createAccount(float mainAccountBalance, const char* tag, const char* fi
         return NULL;
     }
 
-    Account* account = (Account*)malloc(sizeof(Account));
+    Account* account = (Account*)allocateCacheAligned(sizeof(Account));
     if (account == NULL) return NULL;
 
     account->mainAccountBalance = mainAccountBalance;
@@ -31,35 +32,51 @@ Account* createAccount(float mainAccountBalance, const char* tag, const char* fi
         free(account->password);
         free(account->iban);
         free(account->phoneNumber);
-        free(account);
+        freeCacheAligned(account);
         return NULL;
     }
 
     account->transactionsCapacity = 512;
     account->affiliatesCapacity = 128;
     account->userAccountsCapacity = 8;
+    account->aggregatesCapacity = 32;
+    account->segmentsCapacity = 16;
 
     account->affiliates = malloc(account->affiliatesCapacity * sizeof(Affiliate*));
     account->transactions = malloc(account->transactionsCapacity * sizeof(Transaction *));
     account->userAccounts = malloc(account->userAccountsCapacity * sizeof(UserAccounts *));
+    account->aggregates = malloc(account->aggregatesCapacity * sizeof(MonthlyAggregate *));
+    account->segments = malloc(account->segmentsCapacity * sizeof(TransactionSegment *));
 
-    if (account->affiliates == NULL || account->transactions == NULL || account->userAccounts == NULL) {
+    if (account->affiliates == NULL || account->transactions == NULL || account->userAccounts == NULL ||
+        account->aggregates == NULL || account->segments == NULL) {
         free(account->affiliates);
         free(account->transactions);
         free(account->userAccounts);
+        free(account->aggregates);
+        free(account->segments);
         free(account->tag);
         free(account->firstName);
         free(account->secondName);
         free(account->password);
         free(account->iban);
         free(account->phoneNumber);
-        free(account);
+        freeCacheAligned(account);
         return NULL;
     }
 
     account->transactionsNumber = 0;
     account->affiliatesNumber = 0;
     account->userAccountsNumber = 0;
+    account->aggregatesNumber = 0;
+    account->aggregatesOutdated = 0;
+    account->segmentsNumber = 0;
+    account->archivedTransactionsNumber = 0;
+    account->segmentCache = (TransactionSegmentCache){NULL, NULL, 0};
+    account->velocityCounters = NULL;
+    account->references = 1; // Held by the creator, which usually hands it over to the repository
+    account->closed = 0;
+    g_mutex_init(&account->lock);
 
     return account;
 }
@@ -79,7 +96,7 @@ void destroyAccount(Account* account) {
     }
     free(account->affiliates);
 
-    for (int i = 0; i < account->transactionsNumber; i++) {
+    for (int i = 0; i < account->transactionsNumber - account->archivedTransactionsNumber; i++) {
         destroyTransaction(account->transactions[i]);
     }
     free(account->transactions);
@@ -89,7 +106,22 @@ void destroyAccount(Account* account) {
     }
     free(account->userAccounts);
 
-    free(account);
+    for (int i = 0; i < account->aggregatesNumber; i++) {
+        destroyMonthlyAggregate(account->aggregates[i]);
+    }
+    free(account->aggregates);
+
+    // Nothing else references the spilled history of the account, so its segment file goes away too
+    for (int i = 0; i < account->segmentsNumber; i++) {
+        if (isTransactionSegmentSpilled(account->segments[i]))
+            remove(getTransactionSegmentFilePath(account->segments[i]));
+        destroyTransactionSegment(account->segments[i]);
+    }
+    free(account->segments);
+    free(account->velocityCounters);
+
+    g_mutex_clear(&account->lock);
+    freeCacheAligned(account);
 }
 
 
@@ -165,6 +197,49 @@ int getAccountUserAccountsCapacity(const Account* account) {
     return account->userAccountsCapacity;
 }
 
+int getAccountAggregatesNumber(const Account* account) {
+    if (account == NULL) return 0;
+    return account->aggregatesNumber;
+}
+
+int getAccountSegmentsNumber(const Account* account) {
+    if (account == NULL) return 0;
+    return account->segmentsNumber;
+}
+
+int getAccountArchivedTransactionsNumber(const Account* account) {
+    if (account == NULL) return 0;
+    return account->archivedTransactionsNumber;
+}
+
+// Archived transactions are decompressed on access through the bounded cache of the account, so the returned
+// pointer is only valid until the next call on the same account that may page in another segment. Reaching into
+// archived history expects the caller to hold the account lock, which guards the cache.
+Transaction* getAccountTransaction(const Account* account, int index) {
+    if (account == NULL) return NULL;
+    if (index < 0 || index >= account->transactionsNumber) return NULL;
+    if (index >= account->archivedTransactionsNumber) return account->transactions[index - account->archivedTransactionsNumber];
+
+    int low = 0;
+    int high = account->segmentsNumber - 1;
+    while (low < high) {
+        int middle = low + (high - low + 1) / 2;
+        if (getTransactionSegmentFirstIndex(account->segments[middle]) <= index)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+
+    return getSegmentTransaction(account->segments[low], index);
+}
+
+// Pages out every archived segment of the account, for jobs that read a closed period once. Expects the caller to
+// hold the account lock.
+void releaseAccountArchivedHistory(Account* account) {
+    if (account == NULL) return;
+    releaseTransactionSegmentCache(&account->segmentCache);
+}
+
 
 // Setters
 void setAccountBalance(Account* account, float balance) {
@@ -224,3 +299,76 @@ void setAccountBirthday(Account* account, Date birthday) {
     if (account == NULL) return;
     account->birthday = birthday;
 }
+
+
+// Lifetime
+// Pointers to an account live outside the repository in sessions, queued requests and running jobs. Each of them
+// holds a reference, so deleting the account only unlinks and closes it and the memory goes with the last holder.
+Account* retainAccount(Account* account) {
+    if (account != NULL)
+        g_atomic_int_inc(&account->references);
+    return account;
+}
+
+void releaseAccount(Account* account) {
+    if (account != NULL && g_atomic_int_dec_and_test(&account->references))
+        destroyAccount(account);
+}
+
+// Waits for the current holder of the lock, so once this returns nobody works on the account anymore and
+// everyone locking it later sees it closed
+void closeAccount(Account* account) {
+    if (account == NULL) return;
+    g_mutex_lock(&account->lock);
+    g_atomic_int_set(&account->closed, 1);
+    g_mutex_unlock(&account->lock);
+}
+
+short isAccountClosed(const Account* account) {
+    if (account == NULL) return 1;
+    return g_atomic_int_get(&account->closed) ? 1 : 0;
+}
+
+// Locks
+void lockAccount(Account* account) {
+    if (account == NULL) return;
+    g_mutex_lock(&account->lock);
+}
+
+void unlockAccount(Account* account) {
+    if (account == NULL) return;
+    g_mutex_unlock(&account->lock);
+}
+
+// Takes the lock only when nobody holds it, for jobs that would rather come back later than wait
+short tryLockAccount(Account* account) {
+    if (account == NULL) return 0;
+    return g_mutex_trylock(&account->lock) ? 1 : 0;
+}
+
+// Two accounts are always locked in address order, so threads locking the same pair from opposite sides
+// can't wait on each other forever
+void lockAccountPair(Account* firstAccount, Account* secondAccount) {
+    if (firstAccount == NULL || secondAccount == NULL || firstAccount == secondAccount) {
+        lockAccount(firstAccount != NULL ? firstAccount : secondAccount);
+        return;
+    }
+
+    if ((guintptr)firstAccount < (guintptr)secondAccount) {
+        g_mutex_lock(&firstAccount->lock);
+        g_mutex_lock(&secondAccount->lock);
+    } else {
+        g_mutex_lock(&secondAccount->lock);
+        g_mutex_lock(&firstAccount->lock);
+    }
+}
+
+void unlockAccountPair(Account* firstAccount, Account* secondAccount) {
+    if (firstAccount == NULL || secondAccount == NULL || firstAccount == secondAccount) {
+        unlockAccount(firstAccount != NULL ? firstAccount : secondAccount);
+        return;
+    }
+
+    g_mutex_unlock(&firstAccount->lock);
+    g_mutex_unlock(&secondAccount->lock);
+}
\ No newline at end of file
@@ -0,0 +1,28 @@
+#include <stdlib.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+#include "domain.h"
+
+// The UCRT runtime of the Windows build has no aligned_alloc, blocks from _aligned_malloc have to be given back
+// with _aligned_free, so both sides go through these two functions.
+void* allocateCacheAligned(size_t size) {
+    // aligned_alloc wants a size that is a multiple of the alignment
+    size_t alignedSize = (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    if (alignedSize == 0)
+        alignedSize = CACHE_LINE_SIZE;
+
+#ifdef _WIN32
+    return _aligned_malloc(alignedSize, CACHE_LINE_SIZE);
+#else
+    return aligned_alloc(CACHE_LINE_SIZE, alignedSize);
+#endif
+}
+
+void freeCacheAligned(void* memory) {
+#ifdef _WIN32
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+}
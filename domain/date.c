@@ -40,3 +40,34 @@ void setYear(Date* received_date, short received_year){
     if (received_date == NULL) return;
     received_date->year = received_year;
 }
+
+// Returns a negative value, zero or a positive value if first_date is before, equal or after second_date
+int compareDates(Date first_date, Date second_date){
+    if (first_date.year != second_date.year)
+        return first_date.year - second_date.year;
+    if (first_date.month != second_date.month)
+        return first_date.month - second_date.month;
+    return first_date.day - second_date.day;
+}
+
+// Gregorian rule: every fourth year, except the centuries that aren't divisible by 400
+short isLeapYear(short year){
+    return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+// Returns 0 for a month outside 1..12
+short getDaysInMonth(short month, short year){
+    static const short daysInMonth[13] = {0, 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+
+    if (month < 1 || month > 12) return 0;
+    if (month == 2 && isLeapYear(year)) return 29;
+    return daysInMonth[month];
+}
+
+PackedDate packDate(Date date){
+    return ((guint32)date.year << 9) | ((guint32)date.month << 5) | (guint32)date.day;
+}
+
+Date unpackDate(PackedDate packedDate){
+    return createDate((short)(packedDate & 0x1f), (short)((packedDate >> 5) & 0x0f), (short)(packedDate >> 9));
+}
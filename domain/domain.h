@@ -1,6 +1,9 @@
 #ifndef GENTLIX_BANK_DOMAIN_H
 #define GENTLIX_BANK_DOMAIN_H
 
+#include <stddef.h>
+#include <glib.h>
+
 typedef struct {
     short day, month, year;
 } Date;
@@ -12,10 +15,19 @@ short getYear(Date* received_date);
 void setDay(Date* received_date, short received_day);
 void setMonth(Date* received_date, short received_month);
 void setYear(Date* received_date, short received_year);
+int compareDates(Date first_date, Date second_date);
+short isLeapYear(short year);
+short getDaysInMonth(short month, short year);
+
+// Date packed in one integer as year << 9 | month << 5 | day, packed dates compare in calendar order
+typedef guint32 PackedDate;
+PackedDate packDate(Date date);
+Date unpackDate(PackedDate packedDate);
 
 
 
 typedef struct {
+    guint64 id;           // Unique across the bank, later transactions get larger ids
     float amount;
     char* userAccount;
     char* type;
@@ -23,11 +35,15 @@ typedef struct {
     char* category;
     char* description;
     Date date;
+    float runningBalance; // Main account balance right after this transaction was applied
 } Transaction;
 
 Transaction* createTransaction(float amount, const char* userAccount, const char* type, const char* receiverIBAN,
                                const char* category, const char* description, Date date);
+Transaction* restoreTransaction(guint64 id, float amount, const char* userAccount, const char* type, const char* receiverIBAN,
+                                const char* category, const char* description, Date date);
 void destroyTransaction(Transaction* transaction);
+guint64 getTransactionId(const Transaction* transaction);
 float getTransactionAmount(const Transaction* transaction);
 const char* getTransactionUserAccount(const Transaction* transaction);
 const char* getTransactionType(const Transaction* transaction);
@@ -35,6 +51,8 @@ const char* getTransactionReceiverIban(const Transaction* transaction);
 const char* getTransactionCategory(const Transaction* transaction);
 const char* getTransactionDescription(const Transaction* transaction);
 Date getTransactionDate(const Transaction* transaction);
+float getTransactionRunningBalance(const Transaction* transaction);
+float getTransactionSignedAmount(const Transaction* transaction);
 void setTransactionAmount(Transaction* transaction, float amount);
 void setTransactionUserAccount(Transaction* transaction, const char* userAccount);
 void setTransactionType(Transaction* transaction, const char* type);
@@ -42,6 +60,7 @@ void setTransactionReceiverIban(Transaction* transaction, const char* receiverIB
 void setTransactionCategory(Transaction* transaction, const char* category);
 void setTransactionDescription(Transaction* transaction, const char* description);
 void setTransactionDate(Transaction* transaction, Date date);
+void setTransactionRunningBalance(Transaction* transaction, float runningBalance);
 
 
 
@@ -75,6 +94,8 @@ void setAffiliatesPhone(Affiliate* affiliates, const char* phone);
 typedef struct {
     float accountBalance;
     char* type;
+    PackedDate interestPostedOn; // Posting date of the latest monthly interest booked, guarded by the account lock
+    PackedDate feeChargedOn;     // Same for the monthly fee, also set when the balance couldn't pay it
 } UserAccounts;
 
 UserAccounts* createUserAccount(float balance, const char* type);
@@ -86,8 +107,76 @@ void setUserAccountType(UserAccounts* account, const char* type);
 
 
 
+// Decompressed segments of one account, most recently used first. Kept inside the account and guarded by its lock,
+// so a segment is only paged out by whoever holds the lock of the account it belongs to.
+typedef struct {
+    struct TransactionSegment* head; // Most recently used
+    struct TransactionSegment* tail; // Next one to be released
+    int number;
+} TransactionSegmentCache;
+
+typedef struct TransactionSegment {
+    int firstIndex;                // Position of the first archived transaction inside the account history
+    int transactionsNumber;
+    Date firstDate, lastDate;
+    unsigned char* data;           // Compressed transactions, NULL once the segment was spilled to disk
+    size_t dataSize;
+    size_t rawSize;                // Memory used by the transactions before they were archived
+    char* filePath;                // Segment file holding the compressed bytes after a spill
+    long fileOffset;
+    Transaction** transactions;    // Decompressed copy while the segment is paged in, NULL otherwise
+    TransactionSegmentCache* cache; // Cache of the account owning the segment
+    struct TransactionSegment* previousLoaded; // Neighbours inside the list of paged in segments
+    struct TransactionSegment* nextLoaded;
+} TransactionSegment;
+
+TransactionSegment* createTransactionSegment(Transaction** transactions, int transactionsNumber, int firstIndex,
+                                             TransactionSegmentCache* cache);
+void destroyTransactionSegment(TransactionSegment* segment);
+int loadTransactionSegment(TransactionSegment* segment);
+void releaseTransactionSegment(TransactionSegment* segment);
+Transaction* getSegmentTransaction(TransactionSegment* segment, int index);
+int getTransactionSegmentFirstIndex(const TransactionSegment* segment);
+int getTransactionSegmentTransactionsNumber(const TransactionSegment* segment);
+size_t getTransactionSegmentDataSize(const TransactionSegment* segment);
+size_t getTransactionSegmentRawSize(const TransactionSegment* segment);
+const char* getTransactionSegmentFilePath(const TransactionSegment* segment);
+int isTransactionSegmentSpilled(const TransactionSegment* segment);
+int spillTransactionSegment(TransactionSegment* segment, const char* filePath);
+void releaseTransactionSegmentCache(TransactionSegmentCache* cache);
+void setTransactionSegmentCacheCapacity(int capacity);
+int getTransactionSegmentCacheCapacity();
+
+
+
+typedef struct {
+    short year, month;
+    char* category;
+    int count;
+    float sum, min, max;
+} MonthlyAggregate;
+
+MonthlyAggregate* createMonthlyAggregate(short year, short month, const char* category);
+void destroyMonthlyAggregate(MonthlyAggregate* aggregate);
+short getMonthlyAggregateYear(const MonthlyAggregate* aggregate);
+short getMonthlyAggregateMonth(const MonthlyAggregate* aggregate);
+const char* getMonthlyAggregateCategory(const MonthlyAggregate* aggregate);
+int getMonthlyAggregateCount(const MonthlyAggregate* aggregate);
+float getMonthlyAggregateSum(const MonthlyAggregate* aggregate);
+float getMonthlyAggregateMin(const MonthlyAggregate* aggregate);
+float getMonthlyAggregateMax(const MonthlyAggregate* aggregate);
+void addAmountToMonthlyAggregate(MonthlyAggregate* aggregate, float amount);
+
+
+
+// Size of a cache line on the targeted CPUs, used to keep data written by different threads apart
+#define CACHE_LINE_SIZE 64
+
+// Blocks starting on a cache line, freed with freeCacheAligned and never with free (alignedMemory.c)
+void* allocateCacheAligned(size_t size);
+void freeCacheAligned(void* memory);
+
 typedef struct{
-    float mainAccountBalance;
     char* tag;
     char* firstName;
     char* secondName;
@@ -96,14 +185,30 @@ typedef struct{
     char* phoneNumber;
     Date birthday;
     Affiliate** affiliates;
-    Transaction** transactions;
+    Transaction** transactions; // Only the resident part of the history, starting after the archived transactions
     UserAccounts** userAccounts;
+    MonthlyAggregate** aggregates; // Sorted by (year, month), one entry per category used in that month
+    TransactionSegment** segments; // Compressed closed periods, covering the first archivedTransactionsNumber transactions
+    TransactionSegmentCache segmentCache; // Segments of this account currently paged in
     int transactionsNumber;
     int affiliatesNumber;
     int userAccountsNumber;
+    int aggregatesNumber;
+    int segmentsNumber;
+    int archivedTransactionsNumber;
     int transactionsCapacity;
     int affiliatesCapacity;
     int userAccountsCapacity;
+    int aggregatesCapacity;
+    int segmentsCapacity;
+    short aggregatesOutdated; // Set when an update failed, the table is rebuilt from history on the next read
+    gint references; // One for the repository and one for every holder outside it, the last release frees the account
+    gint closed;     // Set under the lock when the account is deleted, holders that lock it afterwards give up
+    // Written by every transaction, so they get a cache line of their own: busy accounts handled by
+    // different threads never share a line. Accounts are allocated aligned to it (see createAccount).
+    _Alignas(CACHE_LINE_SIZE) GMutex lock; // Guards balance and history when several threads work on the same account
+    float mainAccountBalance;
+    void* velocityCounters; // Debits of the last hour and day kept by the services, one flat block allocated on first use
 } Account;
 
 Account* createAccount(float mainAccountBalance, const char* tag, const char* firstName,
@@ -124,6 +229,11 @@ int getAccountUserAccountsNumber(const Account* account);
 int getAccountTransactionsCapacity(const Account* account);
 int getAccountAffiliatesCapacity(const Account* account);
 int getAccountUserAccountsCapacity(const Account* account);
+int getAccountAggregatesNumber(const Account* account);
+int getAccountSegmentsNumber(const Account* account);
+int getAccountArchivedTransactionsNumber(const Account* account);
+Transaction* getAccountTransaction(const Account* account, int index);
+void releaseAccountArchivedHistory(Account* account);
 
 void setAccountBalance(Account* account, float balance);
 void setAccountTag(Account* account, const char* tag);
@@ -134,4 +244,15 @@ void setAccountIban(Account* account, const char* iban);
 void setAccountPhoneNumber(Account* account, const char* phone_number);
 void setAccountBirthday(Account* account, Date birthday);
 
+Account* retainAccount(Account* account);
+void releaseAccount(Account* account);
+void closeAccount(Account* account);
+short isAccountClosed(const Account* account);
+
+void lockAccount(Account* account);
+void unlockAccount(Account* account);
+short tryLockAccount(Account* account);
+void lockAccountPair(Account* firstAccount, Account* secondAccount);
+void unlockAccountPair(Account* firstAccount, Account* secondAccount);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <string.h>
+#include "domain.h"
+
+MonthlyAggregate* createMonthlyAggregate(short year, short month, const char* category) {
+    if (category == NULL) return NULL;
+
+    MonthlyAggregate* aggregate = (MonthlyAggregate*)malloc(sizeof(MonthlyAggregate));
+    if (aggregate == NULL) return NULL;
+
+    aggregate->year = year;
+    aggregate->month = month;
+    aggregate->category = strdup(category);
+    aggregate->count = 0;
+    aggregate->sum = 0.0f;
+    aggregate->min = 0.0f;
+    aggregate->max = 0.0f;
+
+    // Check if strdup failed
+    if (aggregate->category == NULL) {
+        free(aggregate);
+        return NULL;
+    }
+
+    return aggregate;
+}
+
+void destroyMonthlyAggregate(MonthlyAggregate* aggregate) {
+    if (aggregate == NULL) return;
+    free(aggregate->category);
+    free(aggregate);
+}
+
+short getMonthlyAggregateYear(const MonthlyAggregate* aggregate) {
+    if (aggregate == NULL) return 0;
+    return aggregate->year;
+}
+
+short getMonthlyAggregateMonth(const MonthlyAggregate* aggregate) {
+    if (aggregate == NULL) return 0;
+    return aggregate->month;
+}
+
+const char* getMonthlyAggregateCategory(const MonthlyAggregate* aggregate) {
+    if (aggregate == NULL) return NULL;
+    return aggregate->category;
+}
+
+int getMonthlyAggregateCount(const MonthlyAggregate* aggregate) {
+    if (aggregate == NULL) return 0;
+    return aggregate->count;
+}
+
+float getMonthlyAggregateSum(const MonthlyAggregate* aggregate) {
+    if (aggregate == NULL) return 0.0f;
+    return aggregate->sum;
+}
+
+float getMonthlyAggregateMin(const MonthlyAggregate* aggregate) {
+    if (aggregate == NULL) return 0.0f;
+    return aggregate->min;
+}
+
+float getMonthlyAggregateMax(const MonthlyAggregate* aggregate) {
+    if (aggregate == NULL) return 0.0f;
+    return aggregate->max;
+}
+
+void addAmountToMonthlyAggregate(MonthlyAggregate* aggregate, float amount) {
+    if (aggregate == NULL) return;
+
+    if (aggregate->count == 0 || amount < aggregate->min)
+        aggregate->min = amount;
+    if (aggregate->count == 0 || amount > aggregate->max)
+        aggregate->max = amount;
+
+    aggregate->sum += amount;
+    aggregate->count++;
+}
@@ -1,9 +1,33 @@
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include "domain.h"
 
+// Ids come from one counter shared by every thread. It starts from the wall clock in microseconds, with room
+// for 1024 ids per microsecond, so the ids of a later run are still larger than the ones handed out before.
+static _Atomic guint64 lastTransactionId = 0;
+
+static guint64 nextTransactionId(void) {
+    guint64 lastId = atomic_load(&lastTransactionId);
+    if (lastId == 0) {
+        guint64 firstId = (guint64)g_get_real_time() << 10;
+        atomic_compare_exchange_strong(&lastTransactionId, &lastId, firstId); // Only the first caller sets it
+    }
+    return atomic_fetch_add(&lastTransactionId, 1) + 1;
+}
+
 Transaction* createTransaction(float amount, const char* userAccount, const char* type, const char* receiver_iban,
                                const char* category, const char* description, Date date) {
+    if (userAccount == NULL || type == NULL || receiver_iban == NULL || category == NULL || description == NULL)
+        return NULL;
+
+    return restoreTransaction(nextTransactionId(), amount, userAccount, type, receiver_iban, category, description, date);
+}
+
+// Only meant for transactions read back from an archive, which keep the id they were created with and don't take
+// a new one from the counter
+Transaction* restoreTransaction(guint64 id, float amount, const char* userAccount, const char* type, const char* receiver_iban,
+                                const char* category, const char* description, Date date) {
     if (userAccount == NULL || type == NULL || receiver_iban == NULL || 
         category == NULL || description == NULL) {
         return NULL;
@@ -12,6 +36,7 @@ Transaction* createTransaction(float amount, const char* userAccount, const char
     Transaction* transaction = (Transaction*)malloc(sizeof(Transaction));
     if (transaction == NULL) return NULL;
 
+    transaction->id = id;
     transaction->amount = amount;
     transaction->userAccount = strdup(userAccount);
     transaction->type = strdup(type);
@@ -19,6 +44,7 @@ Transaction* createTransaction(float amount, const char* userAccount, const char
     transaction->category = strdup(category);
     transaction->description = strdup(description);
     transaction->date = date;
+    transaction->runningBalance = 0.0f;
 
 
     if (transaction->userAccount == NULL || transaction->type == NULL || 
@@ -47,6 +73,11 @@ void destroyTransaction(Transaction* transaction) {
     free(transaction);
 }
 
+guint64 getTransactionId(const Transaction* transaction) {
+    if (transaction == NULL) return 0;
+    return transaction->id;
+}
+
 float getTransactionAmount(const Transaction* transaction) {
     if (transaction == NULL) return 0.0f;
     return transaction->amount;
@@ -83,6 +114,20 @@ Date getTransactionDate(const Transaction* transaction) {
     return transaction->date;
 }
 
+float getTransactionRunningBalance(const Transaction* transaction) {
+    if (transaction == NULL) return 0.0f;
+    return transaction->runningBalance;
+}
+
+// Deposits, incoming transfers, refunds and interest add money to the account, every other transaction type takes it out
+float getTransactionSignedAmount(const Transaction* transaction) {
+    if (transaction == NULL) return 0.0f;
+    if (transaction->type != NULL && (strcmp(transaction->type, "deposit") == 0 || strcmp(transaction->type, "incoming") == 0 ||
+                                      strcmp(transaction->type, "refund") == 0 || strcmp(transaction->type, "interest") == 0))
+        return transaction->amount;
+    return -transaction->amount;
+}
+
 void setTransactionAmount(Transaction* transaction, float amount) {
     if (transaction == NULL) return;
     transaction->amount = amount;
@@ -132,3 +177,8 @@ void setTransactionDate(Transaction* transaction, Date date) {
     if (transaction == NULL) return;
     transaction->date = date;
 }
+
+void setTransactionRunningBalance(Transaction* transaction, float runningBalance) {
+    if (transaction == NULL) return;
+    transaction->runningBalance = runningBalance;
+}
\ No newline at end of file
@@ -0,0 +1,482 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "domain.h"
+
+// Archived transactions are encoded in a compact byte format:
+//   varint transactionsNumber, varint stringsNumber, stringsNumber NUL terminated strings (the segment dictionary)
+//   then for every transaction:
+//     zigzag varint  id delta from the previous transaction
+//     zigzag varint  date key delta (year * 372 + (month - 1) * 31 + day - 1, history is ordered so it's small)
+//     money          amount
+//     money          running balance
+//     varint x 5     dictionary index of user account, type, receiver IBAN, category and description
+// A money value is a zigzag varint of the delta in cents from the previous value shifted left by one when the
+// value has an exact cents representation, otherwise the escape code 1 followed by the 4 raw float bytes.
+
+// Decompressed segments of every account form a least recently used list inside the account, so only a bounded
+// number of them stay in memory per account. The list is guarded by the lock of the account, the capacity is set
+// when the program starts and only read afterwards.
+static int loadedSegmentsCapacity = 8;
+
+typedef struct {
+    unsigned char* bytes;
+    size_t size, capacity;
+    short failed;
+} SegmentWriter;
+
+typedef struct {
+    const unsigned char* bytes;
+    size_t size, position;
+    short failed;
+} SegmentReader;
+
+static void writeBytes(SegmentWriter* writer, const void* bytes, size_t size) {
+    if (writer->failed) return;
+    if (writer->size + size > writer->capacity) {
+        size_t newCapacity = writer->capacity * 2 + size + 64;
+        unsigned char* newBytes = realloc(writer->bytes, newCapacity);
+        if (newBytes == NULL) {
+            writer->failed = 1;
+            return;
+        }
+        writer->bytes = newBytes;
+        writer->capacity = newCapacity;
+    }
+    memcpy(writer->bytes + writer->size, bytes, size);
+    writer->size += size;
+}
+
+static void writeVarint(SegmentWriter* writer, unsigned long long value) {
+    unsigned char encoded[10];
+    size_t length = 0;
+    while (value >= 0x80) {
+        encoded[length++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    encoded[length++] = (unsigned char)value;
+    writeBytes(writer, encoded, length);
+}
+
+static unsigned long long readVarint(SegmentReader* reader) {
+    unsigned long long value = 0;
+    for (int shift = 0; shift < 64 && reader->position < reader->size; shift += 7) {
+        unsigned char byte = reader->bytes[reader->position++];
+        value |= (unsigned long long)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return value;
+    }
+    reader->failed = 1;
+    return 0;
+}
+
+static unsigned long long zigzagEncode(long long value) {
+    return ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63);
+}
+
+static long long zigzagDecode(unsigned long long value) {
+    return (long long)(value >> 1) ^ -(long long)(value & 1);
+}
+
+static int dateKey(Date date) {
+    return date.year * 372 + (date.month - 1) * 31 + (date.day - 1);
+}
+
+static Date dateFromKey(int key) {
+    return createDate((short)(key % 372 % 31 + 1), (short)(key % 372 / 31 + 1), (short)(key / 372));
+}
+
+static void writeMoney(SegmentWriter* writer, float value, long long* previousCents) {
+    if (value > -1e13f && value < 1e13f) {
+        double scaled = (double)value * 100.0;
+        long long cents = (long long)(scaled < 0 ? scaled - 0.5 : scaled + 0.5);
+        if ((float)(cents / 100.0) == value) {
+            writeVarint(writer, zigzagEncode(cents - *previousCents) << 1);
+            *previousCents = cents;
+            return;
+        }
+    }
+
+    unsigned char raw[4];
+    memcpy(raw, &value, sizeof(raw));
+    writeVarint(writer, 1);
+    writeBytes(writer, raw, sizeof(raw));
+}
+
+static float readMoney(SegmentReader* reader, long long* previousCents) {
+    unsigned long long code = readVarint(reader);
+    if (code & 1) {
+        float value = 0.0f;
+        if (reader->position + sizeof(value) > reader->size) {
+            reader->failed = 1;
+            return 0.0f;
+        }
+        memcpy(&value, reader->bytes + reader->position, sizeof(value));
+        reader->position += sizeof(value);
+        return value;
+    }
+
+    *previousCents += zigzagDecode(code >> 1);
+    return (float)(*previousCents / 100.0);
+}
+
+// Open addressing table used to give every distinct string of the segment one dictionary index
+typedef struct {
+    const char** strings;
+    int* slots;
+    int stringsNumber, slotsNumber;
+} SegmentDictionary;
+
+static unsigned int hashString(const char* string) {
+    unsigned int hash = 2166136261u;
+    for (; *string != '\0'; string++) {
+        hash ^= (unsigned char)*string;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int dictionaryIndex(SegmentDictionary* dictionary, const char* string) {
+    unsigned int slot = hashString(string) & (dictionary->slotsNumber - 1);
+    while (dictionary->slots[slot] != -1) {
+        if (strcmp(dictionary->strings[dictionary->slots[slot]], string) == 0)
+            return dictionary->slots[slot];
+        slot = (slot + 1) & (dictionary->slotsNumber - 1);
+    }
+
+    dictionary->slots[slot] = dictionary->stringsNumber;
+    dictionary->strings[dictionary->stringsNumber] = string;
+    return dictionary->stringsNumber++;
+}
+
+static size_t transactionMemorySize(const Transaction* transaction) {
+    return sizeof(Transaction*) + sizeof(Transaction) +
+           strlen(transaction->userAccount) + strlen(transaction->type) + strlen(transaction->receiverIBAN) +
+           strlen(transaction->category) + strlen(transaction->description) + 5;
+}
+
+TransactionSegment* createTransactionSegment(Transaction** transactions, int transactionsNumber, int firstIndex,
+                                             TransactionSegmentCache* cache) {
+    if (transactions == NULL || transactionsNumber <= 0 || cache == NULL) return NULL;
+
+    TransactionSegment* segment = (TransactionSegment*)malloc(sizeof(TransactionSegment));
+    if (segment == NULL) return NULL;
+
+    int fieldsNumber = transactionsNumber * 5;
+    SegmentDictionary dictionary;
+    dictionary.stringsNumber = 0;
+    dictionary.slotsNumber = 16;
+    while (dictionary.slotsNumber < fieldsNumber * 2)
+        dictionary.slotsNumber *= 2;
+    dictionary.strings = malloc(fieldsNumber * sizeof(const char*));
+    dictionary.slots = malloc(dictionary.slotsNumber * sizeof(int));
+    int* fieldIndexes = malloc(fieldsNumber * sizeof(int));
+
+    if (dictionary.strings == NULL || dictionary.slots == NULL || fieldIndexes == NULL) {
+        free(dictionary.strings);
+        free(dictionary.slots);
+        free(fieldIndexes);
+        free(segment);
+        return NULL;
+    }
+    memset(dictionary.slots, -1, dictionary.slotsNumber * sizeof(int));
+
+    size_t rawSize = 0;
+    for (int i = 0; i < transactionsNumber; i++) {
+        const Transaction* transaction = transactions[i];
+        fieldIndexes[i * 5] = dictionaryIndex(&dictionary, transaction->userAccount);
+        fieldIndexes[i * 5 + 1] = dictionaryIndex(&dictionary, transaction->type);
+        fieldIndexes[i * 5 + 2] = dictionaryIndex(&dictionary, transaction->receiverIBAN);
+        fieldIndexes[i * 5 + 3] = dictionaryIndex(&dictionary, transaction->category);
+        fieldIndexes[i * 5 + 4] = dictionaryIndex(&dictionary, transaction->description);
+        rawSize += transactionMemorySize(transaction);
+    }
+
+    SegmentWriter writer = {NULL, 0, 0, 0};
+    writeVarint(&writer, (unsigned long long)transactionsNumber);
+    writeVarint(&writer, (unsigned long long)dictionary.stringsNumber);
+    for (int i = 0; i < dictionary.stringsNumber; i++)
+        writeBytes(&writer, dictionary.strings[i], strlen(dictionary.strings[i]) + 1);
+
+    guint64 previousId = 0;
+    int previousDateKey = 0;
+    long long previousAmountCents = 0;
+    long long previousBalanceCents = 0;
+    for (int i = 0; i < transactionsNumber; i++) {
+        const Transaction* transaction = transactions[i];
+        writeVarint(&writer, zigzagEncode((long long)(transaction->id - previousId)));
+        previousId = transaction->id;
+        int currentDateKey = dateKey(transaction->date);
+        writeVarint(&writer, zigzagEncode(currentDateKey - previousDateKey));
+        previousDateKey = currentDateKey;
+        writeMoney(&writer, transaction->amount, &previousAmountCents);
+        writeMoney(&writer, transaction->runningBalance, &previousBalanceCents);
+        for (int field = 0; field < 5; field++)
+            writeVarint(&writer, (unsigned long long)fieldIndexes[i * 5 + field]);
+    }
+
+    free(dictionary.strings);
+    free(dictionary.slots);
+    free(fieldIndexes);
+
+    if (writer.failed) {
+        free(writer.bytes);
+        free(segment);
+        return NULL;
+    }
+
+    // Give back the unused part of the output buffer
+    unsigned char* shrunkBytes = realloc(writer.bytes, writer.size);
+    segment->data = shrunkBytes != NULL ? shrunkBytes : writer.bytes;
+    segment->dataSize = writer.size;
+    segment->rawSize = rawSize;
+    segment->firstIndex = firstIndex;
+    segment->transactionsNumber = transactionsNumber;
+    segment->firstDate = transactions[0]->date;
+    segment->lastDate = transactions[transactionsNumber - 1]->date;
+    segment->transactions = NULL;
+    segment->cache = cache;
+    segment->filePath = NULL;
+    segment->fileOffset = 0;
+    segment->previousLoaded = NULL;
+    segment->nextLoaded = NULL;
+
+    return segment;
+}
+
+void destroyTransactionSegment(TransactionSegment* segment) {
+    if (segment == NULL) return;
+    releaseTransactionSegment(segment);
+    free(segment->data);
+    free(segment->filePath);
+    free(segment);
+}
+
+static void unlinkLoadedSegment(TransactionSegment* segment) {
+    TransactionSegmentCache* cache = segment->cache;
+    if (segment->previousLoaded != NULL)
+        segment->previousLoaded->nextLoaded = segment->nextLoaded;
+    else
+        cache->head = segment->nextLoaded;
+
+    if (segment->nextLoaded != NULL)
+        segment->nextLoaded->previousLoaded = segment->previousLoaded;
+    else
+        cache->tail = segment->previousLoaded;
+
+    segment->previousLoaded = NULL;
+    segment->nextLoaded = NULL;
+}
+
+static void linkLoadedSegment(TransactionSegment* segment) {
+    TransactionSegmentCache* cache = segment->cache;
+    segment->previousLoaded = NULL;
+    segment->nextLoaded = cache->head;
+    if (cache->head != NULL)
+        cache->head->previousLoaded = segment;
+    cache->head = segment;
+    if (cache->tail == NULL)
+        cache->tail = segment;
+}
+
+// Reads the compressed bytes back from the segment file when the segment was spilled to disk
+static unsigned char* readSpilledSegment(const TransactionSegment* segment) {
+    FILE* segmentFile = fopen(segment->filePath, "rb");
+    if (segmentFile == NULL) return NULL;
+
+    unsigned char* bytes = malloc(segment->dataSize);
+    if (bytes == NULL || fseek(segmentFile, segment->fileOffset, SEEK_SET) != 0 ||
+        fread(bytes, 1, segment->dataSize, segmentFile) != segment->dataSize) {
+        free(bytes);
+        fclose(segmentFile);
+        return NULL;
+    }
+
+    fclose(segmentFile);
+    return bytes;
+}
+
+int loadTransactionSegment(TransactionSegment* segment) {
+    if (segment == NULL) return 0;
+    if (segment->transactions != NULL) { // Already paged in, only mark it as the most recently used
+        unlinkLoadedSegment(segment);
+        linkLoadedSegment(segment);
+        return 1;
+    }
+
+    unsigned char* spilledBytes = NULL;
+    if (segment->data == NULL) {
+        if (segment->filePath == NULL) return 0;
+        spilledBytes = readSpilledSegment(segment);
+        if (spilledBytes == NULL) return 0;
+    }
+
+    SegmentReader reader = {spilledBytes != NULL ? spilledBytes : segment->data, segment->dataSize, 0, 0};
+    int transactionsNumber = (int)readVarint(&reader);
+    int stringsNumber = (int)readVarint(&reader);
+    if (reader.failed || transactionsNumber != segment->transactionsNumber || stringsNumber < 0) {
+        free(spilledBytes);
+        return 0;
+    }
+
+    const char** strings = malloc((stringsNumber + 1) * sizeof(const char*));
+    Transaction** transactions = calloc(transactionsNumber, sizeof(Transaction*));
+    if (strings == NULL || transactions == NULL) {
+        free(strings);
+        free(transactions);
+        free(spilledBytes);
+        return 0;
+    }
+
+    for (int i = 0; i < stringsNumber && !reader.failed; i++) {
+        const unsigned char* end = memchr(reader.bytes + reader.position, '\0', reader.size - reader.position);
+        if (end == NULL) {
+            reader.failed = 1;
+            break;
+        }
+        strings[i] = (const char*)reader.bytes + reader.position;
+        reader.position = end - reader.bytes + 1;
+    }
+
+    guint64 currentId = 0;
+    int currentDateKey = 0;
+    long long previousAmountCents = 0;
+    long long previousBalanceCents = 0;
+    for (int i = 0; i < transactionsNumber && !reader.failed; i++) {
+        currentId += (guint64)zigzagDecode(readVarint(&reader));
+        currentDateKey += (int)zigzagDecode(readVarint(&reader));
+        float amount = readMoney(&reader, &previousAmountCents);
+        float runningBalance = readMoney(&reader, &previousBalanceCents);
+        unsigned long long fields[5];
+        for (int field = 0; field < 5; field++) {
+            fields[field] = readVarint(&reader);
+            if (fields[field] >= (unsigned long long)stringsNumber)
+                reader.failed = 1;
+        }
+        if (reader.failed)
+            break;
+
+        transactions[i] = restoreTransaction(currentId, amount, strings[fields[0]], strings[fields[1]], strings[fields[2]],
+                                             strings[fields[3]], strings[fields[4]], dateFromKey(currentDateKey));
+        if (transactions[i] == NULL) {
+            reader.failed = 1;
+            break;
+        }
+        setTransactionRunningBalance(transactions[i], runningBalance);
+    }
+
+    free(strings);
+    free(spilledBytes);
+
+    if (reader.failed) {
+        for (int i = 0; i < transactionsNumber; i++)
+            destroyTransaction(transactions[i]);
+        free(transactions);
+        return 0;
+    }
+
+    // Make room in the cache of the account by releasing its least recently used segments
+    TransactionSegmentCache* cache = segment->cache;
+    while (cache->number >= loadedSegmentsCapacity && cache->tail != NULL)
+        releaseTransactionSegment(cache->tail);
+
+    segment->transactions = transactions;
+    linkLoadedSegment(segment);
+    cache->number++;
+    return 1;
+}
+
+void releaseTransactionSegment(TransactionSegment* segment) {
+    if (segment == NULL || segment->transactions == NULL) return;
+    for (int i = 0; i < segment->transactionsNumber; i++)
+        destroyTransaction(segment->transactions[i]);
+    free(segment->transactions);
+    segment->transactions = NULL;
+    unlinkLoadedSegment(segment);
+    segment->cache->number--;
+}
+
+void releaseTransactionSegmentCache(TransactionSegmentCache* cache) {
+    if (cache == NULL) return;
+    while (cache->tail != NULL)
+        releaseTransactionSegment(cache->tail);
+}
+
+int spillTransactionSegment(TransactionSegment* segment, const char* filePath) {
+    if (segment == NULL || filePath == NULL) return 0;
+    if (segment->data == NULL) return segment->filePath != NULL; // Already on disk
+
+    char* newFilePath = strdup(filePath);
+    if (newFilePath == NULL) return 0;
+
+    // Segments of the same account are appended one after the other to the same file
+    FILE* segmentFile = fopen(filePath, "ab");
+    if (segmentFile == NULL) {
+        free(newFilePath);
+        return 0;
+    }
+
+    fseek(segmentFile, 0, SEEK_END);
+    long fileOffset = ftell(segmentFile);
+    size_t written = fwrite(segment->data, 1, segment->dataSize, segmentFile);
+    if (fclose(segmentFile) != 0 || fileOffset < 0 || written != segment->dataSize) {
+        free(newFilePath);
+        return 0;
+    }
+
+    free(segment->filePath);
+    segment->filePath = newFilePath;
+    segment->fileOffset = fileOffset;
+    free(segment->data);
+    segment->data = NULL;
+    releaseTransactionSegment(segment);
+
+    return 1;
+}
+
+// Segments each account keeps paged in, caches already over it shrink on their next load
+void setTransactionSegmentCacheCapacity(int capacity) {
+    if (capacity < 1) return;
+    loadedSegmentsCapacity = capacity;
+}
+
+int getTransactionSegmentCacheCapacity() {
+    return loadedSegmentsCapacity;
+}
+
+Transaction* getSegmentTransaction(TransactionSegment* segment, int index) {
+    if (segment == NULL) return NULL;
+    if (index < segment->firstIndex || index >= segment->firstIndex + segment->transactionsNumber) return NULL;
+    if (!loadTransactionSegment(segment)) return NULL;
+    return segment->transactions[index - segment->firstIndex];
+}
+
+int getTransactionSegmentFirstIndex(const TransactionSegment* segment) {
+    if (segment == NULL) return 0;
+    return segment->firstIndex;
+}
+
+int getTransactionSegmentTransactionsNumber(const TransactionSegment* segment) {
+    if (segment == NULL) return 0;
+    return segment->transactionsNumber;
+}
+
+size_t getTransactionSegmentDataSize(const TransactionSegment* segment) {
+    if (segment == NULL) return 0;
+    return segment->dataSize;
+}
+
+size_t getTransactionSegmentRawSize(const TransactionSegment* segment) {
+    if (segment == NULL) return 0;
+    return segment->rawSize;
+}
+
+const char* getTransactionSegmentFilePath(const TransactionSegment* segment) {
+    if (segment == NULL) return NULL;
+    return segment->filePath;
+}
+
+int isTransactionSegmentSpilled(const TransactionSegment* segment) {
+    if (segment == NULL) return 0;
+    return segment->data == NULL && segment->filePath != NULL;
+}
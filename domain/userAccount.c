@@ -10,6 +10,8 @@ UserAccounts* createUserAccount(float balance, const char* type) {
 
     account->accountBalance = balance;
     account->type = strdup(type);
+    account->interestPostedOn = 0;
+    account->feeChargedOn = 0;
 
     // Check if strdup failed
     if (account->type == NULL) {
@@ -5,10 +5,72 @@
 #include "../repository/repository.h"
 #include "../services/services.h"
 
-Account* currentAccount = NULL;
+// Token of the session of the logged user, empty when nobody is logged in
+char currentSession[SESSION_TOKEN_SIZE] = "";
 GtkApplication* app = NULL;
 GtkWidget* main_menu = NULL;
 
+// Window of the logged account, cleared by GTK when it is destroyed
+GtkWidget* account_window = NULL;
+
+// Period shown by the transaction history window (whole history when the filter isn't active)
+short historyFilterActive = 0;
+Date historyStartDate;
+Date historyEndDate;
+
+// Transaction of the history window, copied while the account is locked
+typedef struct {
+    gchar *type;
+    float amount;
+    Date date;
+    gchar *description;
+} HistoryRow;
+
+// Return the account of the current session, NULL when logged out or after the session expired
+// Only the main loop opens and closes the session of the interface, so the session keeps the account alive until
+// the handler returns and the reference taken by the lookup is given back at once
+static Account* current_account() {
+    if (app == NULL || currentSession[0] == '\0')
+        return NULL;
+
+    Account* account = getSessionAccount(g_object_get_data(G_OBJECT(app), "sessions"), currentSession);
+    releaseAccount(account);
+    return account;
+}
+
+// Log the interface in with a new session for the account
+// Account *account - the account returned by the login or register service
+static short open_current_session(Account *account) {
+    int resultCode = openSession(g_object_get_data(G_OBJECT(app), "sessions"), account, currentSession);
+    if (resultCode != 1) {
+        currentSession[0] = '\0';
+        handleErrorCode(resultCode);
+        return 0;
+    }
+    return 1;
+}
+
+// Close the idle sessions, when the one of the interface is among them go back to the main menu
+// gpointer data - the session table
+gboolean expire_idle_sessions(gpointer data) {
+    SessionTable *sessions = data;
+
+    if (expireIdleSessions(sessions) > 0 && currentSession[0] != '\0' && !isSessionOpen(sessions, currentSession)) {
+        currentSession[0] = '\0';
+
+        if (account_window != NULL)
+            gtk_widget_destroy(account_window);
+
+        GtkWidget *main_window = app != NULL ? g_object_get_data(G_OBJECT(app), "main_window") : NULL;
+        if (main_window != NULL)
+            gtk_widget_show_all(main_window);
+
+        show_error("Your session expired, please log in again!");
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
 // Close the window get through gpointer data parameter
 void close_window(GtkWidget *widget, gpointer data) {
     if (data != NULL)
@@ -453,6 +515,52 @@ void handleErrorCode(int errorCode) {
         case -424:
             show_error("Missing receiver IBAN");
             break;
+        case -430:
+            show_error("You can't transfer money to your own account!");
+            break;
+        case -591:
+        case -593:
+            show_error("Too many payments in a short time, please try again later!");
+            break;
+        case -592:
+        case -594:
+            show_error("This payment goes over the limit of your account for now!");
+            break;
+        case -595:
+            show_error("Too many new receivers today, please try again tomorrow!");
+            break;
+        case -611:
+            show_error("Too many login attempts for this account, please wait a little!");
+            break;
+        case -612:
+        case -463:
+            show_error("The bank is busy right now, please try again!");
+            break;
+        case -461:
+        case -464:
+        case -465:
+            show_error("The request couldn't be sent, please try again!");
+            break;
+        case -471:
+        case -472:
+        case -473:
+            show_error("Couldn't open a session, please log in again!");
+            break;
+        case -251:
+            show_error("Invalid account");
+            break;
+        case -252:
+            show_error("Invalid transaction range");
+            break;
+        case -253:
+            show_error("The start of the period is after its end!");
+            break;
+        case -254:
+            show_error("Invalid account");
+            break;
+        case -255:
+            show_error("Invalid balance query");
+            break;
         case -307:
             show_error("Account tag can't be found or wrong password!");
             break;
@@ -462,6 +570,9 @@ void handleErrorCode(int errorCode) {
         case -352:
             show_error("Invalid account tag.");
             break;
+        case -353:
+            show_error("This account was deleted.");
+            break;
         case -340:
             show_error("Invalid account.");
             break;
@@ -522,11 +633,30 @@ void handleErrorCode(int errorCode) {
 //    }
 //}
 
+// Runs on a service worker, the request holds its own reference to the account
+static int archive_logged_out_account(gpointer data) {
+    return archiveClosedPeriods(data, 3);
+}
+
 void logout_from_an_account(){
-    currentAccount = NULL;
+    // Periods older than the last three months are rarely read again, keep them compressed. Compressing the
+    // history is left to the bulk workers, a full queue leaves it to the next logout.
+    if (app != NULL && currentSession[0] != '\0') {
+        Account* account = getSessionAccount(g_object_get_data(G_OBJECT(app), "sessions"), currentSession);
+        if (account != NULL &&
+            submitServiceRequest(g_object_get_data(G_OBJECT(app), "dispatcher"), SERVICE_PRIORITY_BULK, archive_logged_out_account,
+                                 account, (GDestroyNotify)releaseAccount, NULL, NULL) != 1)
+            releaseAccount(account);
+    }
+
+    if (app != NULL && currentSession[0] != '\0')
+        closeSession(g_object_get_data(G_OBJECT(app), "sessions"), currentSession);
+    currentSession[0] = '\0';
 }
 
 void delete_an_account(GtkWidget *widget, gpointer data){
+    Account* currentAccount = current_account();
+
     if (currentAccount == NULL || app == NULL) {
         show_error("No account logged in!");
         return;
@@ -544,10 +674,14 @@ void delete_an_account(GtkWidget *widget, gpointer data){
     // Get main window before deletion
     GtkWidget *main_window = g_object_get_data(G_OBJECT(app), "main_window");
     
+    // Standing orders can't outlive the account they pay from
+    cancelAccountSchedules(g_object_get_data(G_OBJECT(app), "scheduler"), currentAccount);
     int resultCode = deleteAccountService(database, &currentAccount);
     
     if (resultCode == 1) {
-        // Account deleted successfully - deleteAccountService already set currentAccount to NULL
+        // Account deleted successfully, its session goes with it
+        closeSession(g_object_get_data(G_OBJECT(app), "sessions"), currentSession);
+        currentSession[0] = '\0';
         
         // Close account window if it exists
         if (account_window != NULL) {
@@ -567,6 +701,7 @@ void delete_an_account(GtkWidget *widget, gpointer data){
 // GtkWidget *widget - isn't used inside the function but is required from previous gtk function call
 // gpointer data - provides the location inside the memory for inputs
 void edit_an_account(GtkWidget *widget, gpointer data){
+    Account* currentAccount = current_account();
 
     if (currentAccount == NULL || app == NULL) {
         show_error("No account logged in!");
@@ -633,17 +768,37 @@ void login_to_an_account(GtkWidget *widget, gpointer data){
     GtkWidget **entries = (GtkWidget **)data;
     const gchar *account_tag = gtk_entry_get_text(GTK_ENTRY(entries[0]));
     const gchar *account_password = gtk_entry_get_text(GTK_ENTRY(entries[1]));
-    g_free(entries);
 
     if (app == NULL) {
+        g_free(entries);
         show_error("Application not initialized!");
         return;
     }
 
     RepositoryFormat* database = g_object_get_data(G_OBJECT(app), "database");
-    Account* loggedAccount = NULL;
+    ServiceDispatcher* dispatcher = g_object_get_data(G_OBJECT(app), "dispatcher");
+    LoginLimiter* loginLimiter = g_object_get_data(G_OBJECT(app), "loginLimiter");
+
+    // The login runs on the service workers, finish_login picks up the result on the main loop. Every login has
+    // its own slot for the account, a second click while the first one runs can't take over its result.
+    Account** loggedAccount = g_new0(Account*, 1);
+    int resultCode = loginServiceAsync(dispatcher, loginLimiter, database, account_tag, account_password, loggedAccount, finish_login,
+                                       loggedAccount);
+    g_free(entries);
 
-    int resultCode = loginService(database, account_tag, account_password, &loggedAccount);
+    if (resultCode != 1) {
+        g_free(loggedAccount);
+        handleErrorCode(resultCode);
+    }
+}
+
+// Completion of the asynchronous login, runs on the GTK main loop
+// int resultCode - the code returned by loginService
+// gpointer data - the slot the login filled with the account, freed here
+void finish_login(int resultCode, gpointer data) {
+
+    Account* loggedAccount = *(Account**)data;
+    g_free(data);
 
     if(resultCode == 1 && loggedAccount != NULL) {
 
@@ -651,8 +806,11 @@ void login_to_an_account(GtkWidget *widget, gpointer data){
         if (last_window != NULL)
             gtk_widget_destroy(last_window);
 
-        currentAccount = loggedAccount;
-        show_account_interface();
+        // The session holds the account from now on
+        short opened = open_current_session(loggedAccount);
+        releaseAccount(loggedAccount);
+        if (opened)
+            show_account_interface();
 
     } else {
         handleErrorCode(resultCode);
@@ -822,8 +980,11 @@ void create_an_account(GtkWidget *widget, gpointer data){
         if (last_window != NULL)
             gtk_widget_destroy(last_window);
 
-        currentAccount = loggedAccount;
-        show_account_interface();
+        // The session holds the account from now on
+        short opened = open_current_session(loggedAccount);
+        releaseAccount(loggedAccount);
+        if (opened)
+            show_account_interface();
 
     } else {
         handleErrorCode(resultCode);
@@ -832,7 +993,28 @@ void create_an_account(GtkWidget *widget, gpointer data){
 
 
 // Transaction callback functions
+
+// Completion of the asynchronous transaction services, runs on the GTK main loop
+// int resultCode - the code returned by the service
+// gpointer data - isn't used inside the function but is required by the service callback
+void finish_transaction(int resultCode, gpointer data) {
+    // The user may have logged out while the transaction was running
+    if (current_account() == NULL)
+        return;
+
+    if (resultCode == 1) {
+        GtkWidget *last_window = g_object_get_data(G_OBJECT(app), "last_window");
+        if (last_window != NULL)
+            gtk_widget_destroy(last_window);
+        show_account_interface();
+    } else {
+        handleErrorCode(resultCode);
+    }
+}
+
 void add_to_balance(GtkWidget *widget, gpointer data) {
+    Account* currentAccount = current_account();
+
     if (currentAccount == NULL || app == NULL) {
         show_error("No account logged in!");
         return;
@@ -858,21 +1040,19 @@ void add_to_balance(GtkWidget *widget, gpointer data) {
     const gchar *month = gtk_entry_get_text(GTK_ENTRY(entries[3]));
     const gchar *year = gtk_entry_get_text(GTK_ENTRY(entries[4]));
 
-    int resultCode = depositService(currentAccount, amount, description, day, month, year);
+    ServiceDispatcher* dispatcher = g_object_get_data(G_OBJECT(app), "dispatcher");
+    int resultCode = depositServiceAsync(dispatcher, currentAccount, amount, description, day, month, year, finish_transaction, NULL);
     
-    if (resultCode == 1) {
-        GtkWidget *last_window = g_object_get_data(G_OBJECT(app), "last_window");
-        if (last_window != NULL)
-            gtk_widget_destroy(last_window);
-        show_account_interface();
-    } else {
+    // On success the result arrives later in finish_transaction
+    if (resultCode != 1)
         handleErrorCode(resultCode);
-    }
     
     // Don't free entries - they are GTK widgets that will be destroyed automatically
 }
 
 void withdraw_from_balance(GtkWidget *widget, gpointer data) {
+    Account* currentAccount = current_account();
+
     if (currentAccount == NULL || app == NULL) {
         show_error("No account logged in!");
         return;
@@ -898,21 +1078,19 @@ void withdraw_from_balance(GtkWidget *widget, gpointer data) {
     const gchar *month = gtk_entry_get_text(GTK_ENTRY(entries[3]));
     const gchar *year = gtk_entry_get_text(GTK_ENTRY(entries[4]));
 
-    int resultCode = withdrawService(currentAccount, amount, description, day, month, year);
+    ServiceDispatcher* dispatcher = g_object_get_data(G_OBJECT(app), "dispatcher");
+    int resultCode = withdrawServiceAsync(dispatcher, currentAccount, amount, description, day, month, year, finish_transaction, NULL);
     
-    if (resultCode == 1) {
-        GtkWidget *last_window = g_object_get_data(G_OBJECT(app), "last_window");
-        if (last_window != NULL)
-            gtk_widget_destroy(last_window);
-        show_account_interface();
-    } else {
+    // On success the result arrives later in finish_transaction
+    if (resultCode != 1)
         handleErrorCode(resultCode);
-    }
     
     // Don't free entries - they are GTK widgets that will be destroyed automatically
 }
 
 void make_a_payment(GtkWidget *widget, gpointer data) {
+    Account* currentAccount = current_account();
+
     if (currentAccount == NULL || app == NULL) {
         show_error("No account logged in!");
         return;
@@ -938,21 +1116,19 @@ void make_a_payment(GtkWidget *widget, gpointer data) {
     const gchar *month = gtk_entry_get_text(GTK_ENTRY(entries[3]));
     const gchar *year = gtk_entry_get_text(GTK_ENTRY(entries[4]));
 
-    int resultCode = paymentService(currentAccount, amount, description, day, month, year);
+    ServiceDispatcher* dispatcher = g_object_get_data(G_OBJECT(app), "dispatcher");
+    int resultCode = paymentServiceAsync(dispatcher, currentAccount, amount, description, day, month, year, finish_transaction, NULL);
     
-    if (resultCode == 1) {
-        GtkWidget *last_window = g_object_get_data(G_OBJECT(app), "last_window");
-        if (last_window != NULL)
-            gtk_widget_destroy(last_window);
-        show_account_interface();
-    } else {
+    // On success the result arrives later in finish_transaction
+    if (resultCode != 1)
         handleErrorCode(resultCode);
-    }
     
     // Don't free entries - they are GTK widgets that will be destroyed automatically
 }
 
 void make_a_transaction(GtkWidget *widget, gpointer data) {
+    Account* currentAccount = current_account();
+
     if (currentAccount == NULL || app == NULL) {
         show_error("No account logged in!");
         return;
@@ -979,26 +1155,70 @@ void make_a_transaction(GtkWidget *widget, gpointer data) {
     const gchar *month = gtk_entry_get_text(GTK_ENTRY(entries[3]));
     const gchar *year = gtk_entry_get_text(GTK_ENTRY(entries[4]));
 
-    int resultCode = transferService(currentAccount, amount, description, receiverIBAN, day, month, year);
+    RepositoryFormat* database = g_object_get_data(G_OBJECT(app), "database");
+    ServiceDispatcher* dispatcher = g_object_get_data(G_OBJECT(app), "dispatcher");
+    int resultCode = transferServiceAsync(dispatcher, database, currentAccount, amount, description, receiverIBAN, day, month, year,
+                                          finish_transaction, NULL);
     
-    if (resultCode == 1) {
-        GtkWidget *last_window = g_object_get_data(G_OBJECT(app), "last_window");
-        if (last_window != NULL)
-            gtk_widget_destroy(last_window);
-        show_account_interface();
-    } else {
+    // On success the result arrives later in finish_transaction
+    if (resultCode != 1)
         handleErrorCode(resultCode);
-    }
     
     // Don't free entries - they are GTK widgets that will be destroyed automatically
 }
 
+// Manage the inputs from the period filter of the transaction history and reopen it for the selected month or year.
+// An empty month and year remove the filter and the whole history is shown again.
+// GtkWidget *widget - isn't used inside the function but is required from previous gtk function call
+// gpointer data - provides the location inside the memory for inputs
+void filter_transactions_by_period(GtkWidget *widget, gpointer data) {
+    if (current_account() == NULL || app == NULL) {
+        show_error("No account logged in!");
+        return;
+    }
+
+    if (data == NULL) {
+        show_error("Invalid form data!");
+        return;
+    }
+
+    GtkWidget **entries = (GtkWidget **)data;
+    const gchar *month = gtk_entry_get_text(GTK_ENTRY(entries[0]));
+    const gchar *year = gtk_entry_get_text(GTK_ENTRY(entries[1]));
+
+    if (strlen(month) == 0 && strlen(year) == 0) {
+        historyFilterActive = 0;
+    } else {
+        // The first day of the period goes through the same parser as transaction dates
+        PackedDate startDate;
+        int result = parseTransactionDate("1", strlen(month) > 0 ? month : "1", year, &startDate);
+        if (result != 1) {
+            handleErrorCode(result);
+            return;
+        }
+
+        Date firstDay = unpackDate(startDate);
+        Date endDate = createDate(31, 12, firstDay.year);
+        if (strlen(month) > 0)
+            endDate = createDate(getDaysInMonth(firstDay.month, firstDay.year), firstDay.month, firstDay.year);
+
+        historyStartDate = firstDay;
+        historyEndDate = endDate;
+        historyFilterActive = 1;
+    }
+
+    GtkWidget *last_window = g_object_get_data(G_OBJECT(app), "last_window");
+    if (last_window != NULL)
+        gtk_widget_destroy(last_window);
+    show_all_transactions_interface(NULL, NULL);
+}
+
 // Create the new transaction interface with fields for informations and a menu which transaction types.
 // GtkWidget *widget - isn't used inside the function but is required from previous gtk function call
 // gpointer data - provides the window from which this menu was opened to hide it
 void show_new_transaction_interface(GtkWidget *widget, gpointer data) {
 
-    if (currentAccount == NULL) {
+    if (current_account() == NULL) {
         show_error("No account logged in!");
         return;
     }
@@ -1214,12 +1434,17 @@ void show_new_transaction_interface(GtkWidget *widget, gpointer data) {
 // GtkWidget *widget - isn't used inside the function but is required from previous gtk function call
 // gpointer data - provides the window from which this menu was opened to hide it
 void show_all_transactions_interface(GtkWidget *widget, gpointer data) {
+    Account* currentAccount = current_account();
 
     if (currentAccount == NULL) {
         show_error("No account logged in!");
         return;
     }
 
+    // Opened from the account window, so the previous period filter doesn't apply anymore
+    if (data != NULL)
+        historyFilterActive = 0;
+
     GtkWidget *all_transactions_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     g_object_set_data(G_OBJECT(app), "last_window", all_transactions_window);
 
@@ -1294,6 +1519,45 @@ void show_all_transactions_interface(GtkWidget *widget, gpointer data) {
     gtk_widget_set_sensitive(spacer_bottom, FALSE);
     gtk_box_pack_start(GTK_BOX(main_box), spacer_bottom, TRUE, TRUE, 0);
 
+    // Period filter (month and year) for the history
+    GtkWidget **filter_entries = (GtkWidget **)g_malloc(2 * sizeof(GtkWidget *));
+    g_object_set_data_full(G_OBJECT(all_transactions_window), "filter_entries", filter_entries, g_free);
+
+    GtkWidget *filter_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_widget_set_halign(filter_box, GTK_ALIGN_CENTER);
+
+    filter_entries[0] = gtk_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(filter_entries[0]), "MM");
+    gtk_entry_set_width_chars(GTK_ENTRY(filter_entries[0]), 3);
+    style_entry(filter_entries[0]);
+    gtk_box_pack_start(GTK_BOX(filter_box), filter_entries[0], FALSE, FALSE, 0);
+
+    filter_entries[1] = gtk_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(filter_entries[1]), "YYYY");
+    gtk_entry_set_width_chars(GTK_ENTRY(filter_entries[1]), 5);
+    style_entry(filter_entries[1]);
+    gtk_box_pack_start(GTK_BOX(filter_box), filter_entries[1], FALSE, FALSE, 0);
+
+    if (historyFilterActive) {
+        gchar *print_year_format = g_strdup_printf("%04d", historyStartDate.year);
+        gtk_entry_set_text(GTK_ENTRY(filter_entries[1]), print_year_format);
+        g_free(print_year_format);
+        if (historyStartDate.month == historyEndDate.month) {
+            gchar *print_month_format = g_strdup_printf("%02d", historyStartDate.month);
+            gtk_entry_set_text(GTK_ENTRY(filter_entries[0]), print_month_format);
+            g_free(print_month_format);
+        }
+    }
+
+    gtk_box_pack_start(GTK_BOX(form_card), filter_box, FALSE, FALSE, 0);
+
+    GtkWidget *filter_button = gtk_button_new_with_label("Show period");
+    gtk_widget_set_margin_bottom(filter_button, 10);
+    gtk_widget_set_halign(filter_button, GTK_ALIGN_CENTER);
+    style_secondary_button(filter_button);
+    g_signal_connect(G_OBJECT(filter_button), "clicked", G_CALLBACK(filter_transactions_by_period), filter_entries);
+    gtk_box_pack_start(GTK_BOX(form_card), filter_button, FALSE, FALSE, 0);
+
     GtkWidget *grid = gtk_grid_new();
     gtk_widget_set_size_request(grid, -1, -1);
     gtk_widget_set_halign(grid, GTK_ALIGN_CENTER);  // Center the grid
@@ -1344,11 +1608,58 @@ void show_all_transactions_interface(GtkWidget *widget, gpointer data) {
     
     g_object_unref(header_provider);
 
-    int transactionsNumber = getAccountTransactionsNumber(currentAccount);
+    // The services change the history on their workers, so what the window shows is copied under the lock of the
+    // account first and the widgets are built once it is released
+    lockAccount(currentAccount);
+
+    // Only the transactions from the selected period are shown, found by binary search over the ordered history
+    int firstIndex = 0;
+    int lastIndex = getAccountTransactionsNumber(currentAccount);
+    if (historyFilterActive && findTransactionsInDateRange(currentAccount, historyStartDate, historyEndDate, &firstIndex, &lastIndex) < 0) {
+        firstIndex = 0;
+        lastIndex = 0;
+    }
+    int transactionsNumber = lastIndex - firstIndex;
+
+    HistoryRow *history_rows = g_new0(HistoryRow, transactionsNumber + 1);
+    for (int index = firstIndex; index < lastIndex; index++) {
+        Transaction* transaction = getAccountTransaction(currentAccount, index);
+        if (transaction == NULL) continue;
+        HistoryRow *history_row = &history_rows[index - firstIndex];
+        history_row->type = g_strdup(getTransactionType(transaction) ? getTransactionType(transaction) : "");
+        history_row->amount = getTransactionAmount(transaction);
+        history_row->date = getTransactionDate(transaction);
+        history_row->description = g_strdup(getTransactionDescription(transaction) ? getTransactionDescription(transaction) : "");
+    }
+
+    // Opening and closing balance of the selected period, read from the running balances
+    float openingBalance = 0.0f, closingBalance = 0.0f;
+    short periodBalanceFound = historyFilterActive && getAccountBalanceAtDate(currentAccount, historyEndDate, &closingBalance) == 1;
+    // Totals by transaction type, read from the monthly aggregates instead of the raw history
+    float depositTotal = 0.0f, withdrawTotal = 0.0f, transferTotal = 0.0f, incomingTotal = 0.0f, paymentTotal = 0.0f;
+    if (periodBalanceFound) {
+        openingBalance = closingBalance;
+        if (firstIndex < lastIndex) {
+            Transaction* firstTransaction = getAccountTransaction(currentAccount, firstIndex);
+            openingBalance = getTransactionRunningBalance(firstTransaction) - getTransactionSignedAmount(firstTransaction);
+        }
+
+        for (short month = historyStartDate.month; month <= historyEndDate.month; month++) {
+            short year = historyStartDate.year;
+            depositTotal += getMonthlyAggregateSum(getMonthlyAggregate(currentAccount, year, month, "deposit"));
+            withdrawTotal += getMonthlyAggregateSum(getMonthlyAggregate(currentAccount, year, month, "withdraw"));
+            transferTotal += getMonthlyAggregateSum(getMonthlyAggregate(currentAccount, year, month, "transfer"));
+            incomingTotal += getMonthlyAggregateSum(getMonthlyAggregate(currentAccount, year, month, "incoming"));
+            paymentTotal += getMonthlyAggregateSum(getMonthlyAggregate(currentAccount, year, month, "payment"));
+        }
+    }
+
+    unlockAccount(currentAccount);
     
     // Show message if no transactions
     if (transactionsNumber == 0) {
-        GtkWidget *no_transactions_label = gtk_label_new("No transactions yet. Start by making your first transaction!");
+        GtkWidget *no_transactions_label = gtk_label_new(historyFilterActive ? "No transactions in the selected period."
+                                                                              : "No transactions yet. Start by making your first transaction!");
         GtkStyleContext *no_trans_context = gtk_widget_get_style_context(no_transactions_label);
         gtk_style_context_add_provider(no_trans_context, GTK_STYLE_PROVIDER(content_provider), GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
         gtk_widget_set_margin_top(no_transactions_label, 20);
@@ -1356,10 +1667,11 @@ void show_all_transactions_interface(GtkWidget *widget, gpointer data) {
         gtk_widget_set_halign(no_transactions_label, GTK_ALIGN_CENTER);
         gtk_box_pack_start(GTK_BOX(form_card), no_transactions_label, FALSE, FALSE, 0);
     } else {
-        for(int index = 0; index < transactionsNumber; index++)
+        for(int index = firstIndex; index < lastIndex; index++)
         {
-            Transaction* transaction = currentAccount->transactions[index];
-            if (transaction == NULL) continue;
+            const HistoryRow *history_row = &history_rows[index - firstIndex];
+            if (history_row->type == NULL) continue;
+            int row = index - firstIndex + 1;
 
             // Number column
             gchar *print_number_format = g_strdup_printf("%d", index + 1);
@@ -1367,51 +1679,74 @@ void show_all_transactions_interface(GtkWidget *widget, gpointer data) {
             GtkStyleContext *content_context1 = gtk_widget_get_style_context(number_text);
             gtk_style_context_add_provider(content_context1, GTK_STYLE_PROVIDER(content_provider), GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
             gtk_widget_set_margin_bottom(number_text, 6);
-            gtk_grid_attach(GTK_GRID(grid), number_text, 0, index + 1, 1, 1);
+            gtk_grid_attach(GTK_GRID(grid), number_text, 0, row, 1, 1);
             g_free(print_number_format);
 
             // Type column
-            const char* transactionType = getTransactionType(transaction);
-            gchar *print_type_format = g_strdup_printf("%s", transactionType ? transactionType : "");
+            gchar *print_type_format = g_strdup_printf("%s", history_row->type);
             GtkWidget *type_text = gtk_label_new(print_type_format);
             GtkStyleContext *content_context2 = gtk_widget_get_style_context(type_text);
             gtk_style_context_add_provider(content_context2, GTK_STYLE_PROVIDER(content_provider), GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
             gtk_widget_set_margin_bottom(type_text, 6);
-            gtk_grid_attach(GTK_GRID(grid), type_text, 1, index + 1, 1, 1);
+            gtk_grid_attach(GTK_GRID(grid), type_text, 1, row, 1, 1);
             g_free(print_type_format);
 
             // Amount column
-            float transactionAmount = getTransactionAmount(transaction);
-            gchar *print_amount_format = g_strdup_printf("%.2f$", transactionAmount);
+            gchar *print_amount_format = g_strdup_printf("%.2f$", history_row->amount);
             GtkWidget *amount_text = gtk_label_new(print_amount_format);
             GtkStyleContext *content_context3 = gtk_widget_get_style_context(amount_text);
             gtk_style_context_add_provider(content_context3, GTK_STYLE_PROVIDER(content_provider), GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
             gtk_widget_set_margin_bottom(amount_text, 6);
-            gtk_grid_attach(GTK_GRID(grid), amount_text, 2, index + 1, 1, 1);
+            gtk_grid_attach(GTK_GRID(grid), amount_text, 2, row, 1, 1);
             g_free(print_amount_format);
 
             // Date column (combined DD/MM/YYYY)
-            Date transactionDate = getTransactionDate(transaction);
+            Date transactionDate = history_row->date;
             gchar *print_date_format = g_strdup_printf("%02d/%02d/%04d", transactionDate.day, transactionDate.month, transactionDate.year);
             GtkWidget *date_text = gtk_label_new(print_date_format);
             GtkStyleContext *content_context4 = gtk_widget_get_style_context(date_text);
             gtk_style_context_add_provider(content_context4, GTK_STYLE_PROVIDER(content_provider), GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
             gtk_widget_set_margin_bottom(date_text, 6);
-            gtk_grid_attach(GTK_GRID(grid), date_text, 3, index + 1, 1, 1);
+            gtk_grid_attach(GTK_GRID(grid), date_text, 3, row, 1, 1);
             g_free(print_date_format);
 
             // Description column
-            const char* transactionDescription = getTransactionDescription(transaction);
-            gchar *print_description_format = g_strdup_printf("%s", transactionDescription ? transactionDescription : "");
+            gchar *print_description_format = g_strdup_printf("%s", history_row->description);
             GtkWidget *description_text = gtk_label_new(print_description_format);
             GtkStyleContext *content_context5 = gtk_widget_get_style_context(description_text);
             gtk_style_context_add_provider(content_context5, GTK_STYLE_PROVIDER(content_provider), GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
             gtk_widget_set_margin_bottom(description_text, 6);
-            gtk_grid_attach(GTK_GRID(grid), description_text, 4, index + 1, 1, 1);
+            gtk_grid_attach(GTK_GRID(grid), description_text, 4, row, 1, 1);
             g_free(print_description_format);
         }
     }
     
+    for (int index = 0; index < transactionsNumber; index++) {
+        g_free(history_rows[index].type);
+        g_free(history_rows[index].description);
+    }
+    g_free(history_rows);
+
+    if (periodBalanceFound) {
+        gchar *print_balance_format = g_strdup_printf("Opening balance: %.2f$    Closing balance: %.2f$", openingBalance, closingBalance);
+        GtkWidget *balance_text = gtk_label_new(print_balance_format);
+        GtkStyleContext *balance_context = gtk_widget_get_style_context(balance_text);
+        gtk_style_context_add_provider(balance_context, GTK_STYLE_PROVIDER(content_provider), GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
+        gtk_widget_set_margin_top(balance_text, 10);
+        gtk_widget_set_halign(balance_text, GTK_ALIGN_CENTER);
+        gtk_box_pack_start(GTK_BOX(form_card), balance_text, FALSE, FALSE, 0);
+        g_free(print_balance_format);
+
+        gchar *print_totals_format = g_strdup_printf("Deposits: %.2f$    Withdrawals: %.2f$    Transfers: %.2f$    Received: %.2f$    Payments: %.2f$",
+                                                     depositTotal, withdrawTotal, transferTotal, incomingTotal, paymentTotal);
+        GtkWidget *totals_text = gtk_label_new(print_totals_format);
+        GtkStyleContext *totals_context = gtk_widget_get_style_context(totals_text);
+        gtk_style_context_add_provider(totals_context, GTK_STYLE_PROVIDER(content_provider), GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
+        gtk_widget_set_halign(totals_text, GTK_ALIGN_CENTER);
+        gtk_box_pack_start(GTK_BOX(form_card), totals_text, FALSE, FALSE, 0);
+        g_free(print_totals_format);
+    }
+
     g_object_unref(content_provider);
 
     // Close button integrated in the form card
@@ -1435,6 +1770,7 @@ void show_all_transactions_interface(GtkWidget *widget, gpointer data) {
 // GtkWidget *widget - isn't used inside the function but is required from previous gtk function call
 // gpointer data - provides the window from which this menu was opened to hide it
 void show_edit_account_interface(GtkWidget *widget, gpointer data){
+    Account* currentAccount = current_account();
 
     if (currentAccount == NULL || app == NULL) {
         show_error("No account logged in!");
@@ -1744,8 +2080,11 @@ void show_edit_account_interface(GtkWidget *widget, gpointer data){
 
 // Create new window with all account options after the user is logged.
 void show_account_interface() {
+    Account* currentAccount = current_account();
 
     GtkWidget *your_account_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    account_window = your_account_window;
+    g_object_add_weak_pointer(G_OBJECT(your_account_window), (gpointer *)&account_window);
     gtk_window_set_default_icon_from_file("images/bank_icon.png", NULL);
     gtk_window_set_title(GTK_WINDOW(your_account_window), "GentlixBank - Application");
     gtk_window_set_default_size(GTK_WINDOW(your_account_window), 800, 1000);
@@ -1793,7 +2132,10 @@ void show_account_interface() {
     // Subtitle below title - Account balance
     gchar *balance_text;
     if (currentAccount != NULL) {
-        balance_text = g_strdup_printf("Account balance: %.2f$", getAccountBalance(currentAccount));
+        lockAccount(currentAccount);
+        float balance = getAccountBalance(currentAccount);
+        unlockAccount(currentAccount);
+        balance_text = g_strdup_printf("Account balance: %.2f$", balance);
     } else {
         balance_text = g_strdup("Account balance: 0.00$");
     }
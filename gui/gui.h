@@ -7,15 +7,19 @@ void activate_main_menu(GtkApplication *app, gpointer data);
 void close_window(GtkWidget *widget, gpointer data);
 void show_window(GtkWidget *widget, gpointer data);
 void show_error(gchar *message);
+gboolean expire_idle_sessions(gpointer data);
 void handleErrorCode(int errorCode);
 void add_to_balance(GtkWidget *widget, gpointer data);
 void withdraw_from_balance(GtkWidget *widget, gpointer data);
 void make_a_payment(GtkWidget *widget, gpointer data);
 void make_a_transaction(GtkWidget *widget, gpointer data);
+void finish_transaction(int resultCode, gpointer data);
+void filter_transactions_by_period(GtkWidget *widget, gpointer data);
 void logout_from_an_account();
 void delete_an_account(GtkWidget *widget, gpointer data);
 void edit_an_account(GtkWidget *widget, gpointer data);
 void login_to_an_account(GtkWidget *widget, gpointer data);
+void finish_login(int resultCode, gpointer data);
 void create_an_account(GtkWidget *widget, gpointer data);
 void show_new_transaction_interface(GtkWidget *widget, gpointer data);
 void show_all_transactions_interface(GtkWidget *widget, gpointer data);
@@ -1,8 +1,185 @@
+#include <stdio.h>
 #include <gtk/gtk.h>
 #include "services/services.h"
 #include "gui/gui.h"
 #include "repository/repository.h"
 
+// Move the closed periods older than the last three months of every account to the segment files on disk.
+// They are paged back in through a bounded cache when the history is read again. Compressing and writing the
+// segments runs as a bulk request on the dispatcher, one run at a time, so the interface never waits for the disk.
+static gint spill_job_stop = 0;
+static gint spill_job_running = 0;
+
+static gchar* history_directory() {
+    return g_build_filename(g_get_user_cache_dir(), "GentlixBank", "history", NULL);
+}
+
+// Segment files only make sense to the accounts that wrote them, the ones left by a run that crashed are removed
+static void clear_spilled_history() {
+    gchar* directory = history_directory();
+    GDir* entries = g_dir_open(directory, 0, NULL);
+
+    if (entries != NULL) {
+        const gchar* name;
+        while ((name = g_dir_read_name(entries)) != NULL) {
+            if (!g_str_has_suffix(name, ".seg"))
+                continue;
+            gchar* path = g_build_filename(directory, name, NULL);
+            remove(path);
+            g_free(path);
+        }
+        g_dir_close(entries);
+    }
+
+    g_free(directory);
+}
+
+static int run_spill_job(gpointer data) {
+    RepositoryFormat* database = data;
+    gchar* directory = history_directory();
+    int spilledSegments = 0;
+
+    if (g_mkdir_with_parents(directory, 0700) == 0) {
+        for (int i = 0; i < getRepositorySize(database) && !g_atomic_int_get(&spill_job_stop); i++) {
+            Account* account = getAccountByIndex(database, i);
+            int result = spillColdHistory(account, directory, 3);
+            if (result > 0)
+                spilledSegments += result;
+            releaseAccount(account);
+        }
+    }
+    g_atomic_int_set(&spill_job_running, 0);
+
+    g_free(directory);
+    return spilledSegments;
+}
+
+static gboolean spill_cold_history(gpointer data) {
+    GtkApplication* application = data;
+
+    if (!g_atomic_int_compare_and_exchange(&spill_job_running, 0, 1))
+        return G_SOURCE_CONTINUE;
+
+    // A full queue leaves the spill to the next minute
+    if (submitServiceRequest(g_object_get_data(G_OBJECT(application), "dispatcher"), SERVICE_PRIORITY_BULK, run_spill_job,
+                             g_object_get_data(G_OBJECT(application), "database"), NULL, NULL, NULL) != 1)
+        g_atomic_int_set(&spill_job_running, 0);
+    return G_SOURCE_CONTINUE;
+}
+
+// Pay the standing orders due up to today, the ones missed while the application was closed included.
+static gboolean run_scheduled_payments(gpointer data) {
+    GtkApplication* application = data;
+    GDateTime* now = g_date_time_new_now_local();
+    PackedDate today = packDate(createDate((short)g_date_time_get_day_of_month(now), (short)g_date_time_get_month(now),
+                                           (short)g_date_time_get_year(now)));
+    g_date_time_unref(now);
+
+    runDuePayments(g_object_get_data(G_OBJECT(application), "scheduler"), g_object_get_data(G_OBJECT(application), "database"), today);
+    return G_SOURCE_CONTINUE;
+}
+
+// Monthly interest and fees, dated the first day of the month. The job runs as a bulk request on the dispatcher,
+// one run at a time, and is submitted again every hour until a run of the month visits every account listed when
+// it started. A run skips the accounts already posted and goes on from the cursor in the cache directory when
+// closing the application cut the last run short.
+typedef struct {
+    RepositoryFormat* database;
+    PackedDate postingDate;
+} InterestJobRequest;
+
+static gint interest_job_stop = 0;
+static gint interest_job_running = 0;
+static gint interest_job_done_date = 0; // Posting date of the latest complete run, set by the worker
+
+static int run_interest_job(gpointer data) {
+    InterestJobRequest* request = data;
+    gchar* directory = g_build_filename(g_get_user_cache_dir(), "GentlixBank", NULL);
+    gchar* cursorPath = g_build_filename(directory, "interest-cursor", NULL);
+    InterestJobOptions options = {0, g_mkdir_with_parents(directory, 0700) == 0 ? cursorPath : NULL, &interest_job_stop};
+
+    int result = runInterestJob(request->database, request->postingDate, &options, NULL);
+    if (result == 1)
+        g_atomic_int_set(&interest_job_done_date, (gint)request->postingDate);
+    g_atomic_int_set(&interest_job_running, 0);
+
+    g_free(cursorPath);
+    g_free(directory);
+    return result;
+}
+
+static gboolean post_monthly_interest(gpointer data) {
+    GtkApplication* application = data;
+    GDateTime* now = g_date_time_new_now_local();
+    PackedDate postingDate = packDate(createDate(1, (short)g_date_time_get_month(now), (short)g_date_time_get_year(now)));
+    g_date_time_unref(now);
+
+    if ((PackedDate)g_atomic_int_get(&interest_job_done_date) == postingDate ||
+        !g_atomic_int_compare_and_exchange(&interest_job_running, 0, 1))
+        return G_SOURCE_CONTINUE;
+
+    InterestJobRequest* request = g_new(InterestJobRequest, 1);
+    request->database = g_object_get_data(G_OBJECT(application), "database");
+    request->postingDate = postingDate;
+
+    // A full queue leaves the month to the next try
+    if (submitServiceRequest(g_object_get_data(G_OBJECT(application), "dispatcher"), SERVICE_PRIORITY_BULK, run_interest_job,
+                             request, g_free, NULL, NULL) != 1) {
+        g_free(request);
+        g_atomic_int_set(&interest_job_running, 0);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+// Statements of the month that just ended, written to the data directory by a bulk request on the dispatcher.
+// Like the interest job, the request is submitted every hour until a run of the month wrote every statement. After
+// a restart the month is written once more, over the files of the previous run.
+typedef struct {
+    RepositoryFormat* database;
+    short year, month;
+} StatementsJobRequest;
+
+static gint statements_job_running = 0;
+static gint statements_job_done_month = 0; // year * 12 + month - 1 of the latest complete run, set by the worker
+
+static int run_statements_job(gpointer data) {
+    StatementsJobRequest* request = data;
+    gchar* directory = g_build_filename(g_get_user_data_dir(), "GentlixBank", "statements", NULL);
+    StatementRunSummary summary;
+
+    int result = generateMonthlyStatements(request->database, request->year, request->month, directory, 0, &summary);
+    if (result >= 0 && summary.statementsFailed == 0)
+        g_atomic_int_set(&statements_job_done_month, request->year * 12 + request->month - 1);
+    g_atomic_int_set(&statements_job_running, 0);
+
+    g_free(directory);
+    return result;
+}
+
+static gboolean write_monthly_statements(gpointer data) {
+    GtkApplication* application = data;
+    GDateTime* now = g_date_time_new_now_local();
+    gint endedMonth = g_date_time_get_year(now) * 12 + g_date_time_get_month(now) - 2;
+    g_date_time_unref(now);
+
+    if (g_atomic_int_get(&statements_job_done_month) == endedMonth ||
+        !g_atomic_int_compare_and_exchange(&statements_job_running, 0, 1))
+        return G_SOURCE_CONTINUE;
+
+    StatementsJobRequest* request = g_new(StatementsJobRequest, 1);
+    request->database = g_object_get_data(G_OBJECT(application), "database");
+    request->year = (short)(endedMonth / 12);
+    request->month = (short)(endedMonth % 12 + 1);
+
+    // A full queue leaves the month to the next try
+    if (submitServiceRequest(g_object_get_data(G_OBJECT(application), "dispatcher"), SERVICE_PRIORITY_BULK, run_statements_job,
+                             request, g_free, NULL, NULL) != 1) {
+        g_free(request);
+        g_atomic_int_set(&statements_job_running, 0);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
 // Create the GTK Application, activate the main window for it and return the run status.
 int main(int argc, char *argv[]) {
 
@@ -10,12 +187,37 @@ int main(int argc, char *argv[]) {
     int applicationStatus;
 
     RepositoryFormat* database = createRepository();
+    clear_spilled_history();
+    // Services run on these workers so the interface never waits for them, a full queue is reported to the user
+    ServiceDispatcher* dispatcher = createServiceDispatcher(0, 256, DISPATCH_REJECT_WHEN_FULL);
+    // The user is logged out after fifteen minutes without using the account
+    SessionTable* sessions = createSessionTable(15 * 60);
+    PaymentScheduler* scheduler = createPaymentScheduler();
+    // Wrong passwords in a row lock the tag out for a while, see throttle.c
+    LoginLimiter* loginLimiter = createLoginLimiter(getRepositorySize(database), 20);
 
     mainApplication = gtk_application_new("com.bank.GentlixBank", G_APPLICATION_FLAGS_NONE);
     g_object_set_data(G_OBJECT(mainApplication), "database", database);
+    g_object_set_data(G_OBJECT(mainApplication), "dispatcher", dispatcher);
+    g_object_set_data(G_OBJECT(mainApplication), "sessions", sessions);
+    g_object_set_data(G_OBJECT(mainApplication), "scheduler", scheduler);
+    g_object_set_data(G_OBJECT(mainApplication), "loginLimiter", loginLimiter);
     g_signal_connect(mainApplication, "activate", G_CALLBACK(activate_main_menu), NULL);
+    g_timeout_add_seconds(60, spill_cold_history, mainApplication);
+    g_timeout_add_seconds(1, expire_idle_sessions, sessions);
+    g_timeout_add_seconds(60, run_scheduled_payments, mainApplication);
+    g_timeout_add_seconds(60 * 60, post_monthly_interest, mainApplication);
+    g_timeout_add_seconds(60 * 60, write_monthly_statements, mainApplication);
     applicationStatus = g_application_run(G_APPLICATION(mainApplication), argc, argv);
     g_object_unref(mainApplication);
+    g_atomic_int_set(&interest_job_stop, 1);
+    g_atomic_int_set(&spill_job_stop, 1);
+    destroyServiceDispatcher(dispatcher);
+    destroySessionTable(sessions);
+    destroyPaymentScheduler(scheduler);
+    destroyLoginLimiter(loginLimiter);
+    // Last, once the workers are gone, the accounts it frees remove their segment files from the cache directory
+    destroyRepository(database);
 
     return applicationStatus;
 }
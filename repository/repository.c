@@ -2,6 +2,29 @@
 #include <stdlib.h>
 #include <string.h>
 
+// The lookup helpers take const repositories, the lock itself still has to be written to
+static void lockRepositoryForReading(const RepositoryFormat* receivedRepository) {
+    g_rw_lock_reader_lock((GRWLock*)&receivedRepository->lock);
+}
+
+static void unlockRepositoryForReading(const RepositoryFormat* receivedRepository) {
+    g_rw_lock_reader_unlock((GRWLock*)&receivedRepository->lock);
+}
+
+// Expects the caller to hold the repository lock
+static Account* searchAccountByTag(const RepositoryFormat* receivedRepository, const char* userTag) {
+    for (int i = 0; i < receivedRepository->numberOfElements; i++) {
+        if (receivedRepository->accounts[i] == NULL) continue;
+
+        const char* accountTag = getAccountTag(receivedRepository->accounts[i]);
+        if (accountTag != NULL && strcmp(accountTag, userTag) == 0) {
+            return receivedRepository->accounts[i];
+        }
+    }
+
+    return NULL;
+}
+
 RepositoryFormat* createRepository(){
 
     int defaultCapacity = 20;
@@ -19,6 +42,9 @@ RepositoryFormat* createRepository(){
         return NULL;
     }
 
+    newRepository->ibanIndex = g_hash_table_new(g_str_hash, g_str_equal);
+    g_rw_lock_init(&newRepository->lock);
+
     return newRepository;
 }
 
@@ -27,11 +53,12 @@ int destroyRepository(RepositoryFormat* receivedRepository){
     if(receivedRepository == NULL)
         return -21;
 
-    for(int i=0; i<receivedRepository->numberOfElements; i++) {
-        destroyAccount(receivedRepository->accounts[i]);
-        free(receivedRepository->accounts[i]);
-    }
+    // The repository gives back its references, accounts still held elsewhere are freed by their last holder
+    for(int i=0; i<receivedRepository->numberOfElements; i++)
+        releaseAccount(receivedRepository->accounts[i]);
 
+    g_hash_table_destroy(receivedRepository->ibanIndex);
+    g_rw_lock_clear(&receivedRepository->lock);
     free(receivedRepository->accounts);
     free(receivedRepository);
 
@@ -46,16 +73,24 @@ int resizeRepository(RepositoryFormat* receivedRepository, int newCapacity){
     if(newCapacity <= 0)
         return -32;
 
-    if (newCapacity < receivedRepository->numberOfElements) return -33;
+    g_rw_lock_writer_lock(&receivedRepository->lock);
+
+    if (newCapacity < receivedRepository->numberOfElements) {
+        g_rw_lock_writer_unlock(&receivedRepository->lock);
+        return -33;
+    }
 
     Account** increasedSizeAccounts = realloc(receivedRepository->accounts, newCapacity * sizeof(Account*));
 
-    if(increasedSizeAccounts == NULL)
+    if(increasedSizeAccounts == NULL) {
+        g_rw_lock_writer_unlock(&receivedRepository->lock);
         return -34;
+    }
 
     receivedRepository->accounts = increasedSizeAccounts;
     receivedRepository->capacity = newCapacity;
 
+    g_rw_lock_writer_unlock(&receivedRepository->lock);
     return 1;
 }
 
@@ -67,11 +102,25 @@ int addAccountToRepository(RepositoryFormat* receivedRepository, Account* newAcc
     if (newAccount == NULL)
         return -42;
 
+    g_rw_lock_writer_lock(&receivedRepository->lock);
+
+    // Checked again under the lock, two registrations of the same tag may both have passed the check before it
+    if (searchAccountByTag(receivedRepository, getAccountTag(newAccount)) != NULL) {
+        g_rw_lock_writer_unlock(&receivedRepository->lock);
+        return -44;
+    }
+
+    if (getAccountIban(newAccount) != NULL && g_hash_table_contains(receivedRepository->ibanIndex, getAccountIban(newAccount))) {
+        g_rw_lock_writer_unlock(&receivedRepository->lock);
+        return -45;
+    }
+
     if (receivedRepository->numberOfElements >= receivedRepository->capacity) {
         int newCapacity = receivedRepository->capacity * 2;
         Account** newAccounts = (Account**)realloc(receivedRepository->accounts, newCapacity * sizeof(Account*));
 
         if (newAccounts == NULL) {
+            g_rw_lock_writer_unlock(&receivedRepository->lock);
             return -43;
         }
 
@@ -82,6 +131,10 @@ int addAccountToRepository(RepositoryFormat* receivedRepository, Account* newAcc
     receivedRepository->accounts[receivedRepository->numberOfElements] = newAccount;
     receivedRepository->numberOfElements++;
 
+    if (getAccountIban(newAccount) != NULL)
+        g_hash_table_insert(receivedRepository->ibanIndex, (gpointer)getAccountIban(newAccount), newAccount);
+
+    g_rw_lock_writer_unlock(&receivedRepository->lock);
     return 1;
 }
 
@@ -95,6 +148,8 @@ int removeAccountFromRepository(RepositoryFormat* receivedRepository, const char
 
     int indexToRemove = -1;
 
+    g_rw_lock_writer_lock(&receivedRepository->lock);
+
     for (int i = 0; i < receivedRepository->numberOfElements; i++) {
         if (receivedRepository->accounts[i] == NULL) continue;
         
@@ -105,11 +160,14 @@ int removeAccountFromRepository(RepositoryFormat* receivedRepository, const char
         }
     }
 
-    if (indexToRemove == -1)
+    if (indexToRemove == -1) {
+        g_rw_lock_writer_unlock(&receivedRepository->lock);
         return -53;
+    }
 
-    // destroyAccount already calls free(account) internally, so we don't need to free it again
-    destroyAccount(receivedRepository->accounts[indexToRemove]);
+    Account* removedAccount = receivedRepository->accounts[indexToRemove];
+    if (getAccountIban(removedAccount) != NULL)
+        g_hash_table_remove(receivedRepository->ibanIndex, getAccountIban(removedAccount));
     receivedRepository->accounts[indexToRemove] = NULL;  // Set to NULL for safety
 
     for (int i = indexToRemove; i < receivedRepository->numberOfElements - 1; i++) {
@@ -119,6 +177,11 @@ int removeAccountFromRepository(RepositoryFormat* receivedRepository, const char
     receivedRepository->accounts[receivedRepository->numberOfElements - 1] = NULL;  // Clear the last element
     receivedRepository->numberOfElements--;
 
+    g_rw_lock_writer_unlock(&receivedRepository->lock);
+
+    // Lookups can't find it anymore, holders of an older pointer find it closed and the last of them frees it
+    closeAccount(removedAccount);
+    releaseAccount(removedAccount);
     return 1;
 }
 
@@ -130,16 +193,11 @@ Account* getAccountByTag(const RepositoryFormat* receivedRepository, const char*
     if (userTag == NULL)
         return NULL;
 
-    for (int i = 0; i < receivedRepository->numberOfElements; i++) {
-        if (receivedRepository->accounts[i] == NULL) continue;
-        
-        const char* accountTag = getAccountTag(receivedRepository->accounts[i]);
-        if (accountTag != NULL && strcmp(accountTag, userTag) == 0) {
-            return receivedRepository->accounts[i];
-        }
-    }
+    lockRepositoryForReading(receivedRepository);
+    Account* account = retainAccount(searchAccountByTag(receivedRepository, userTag));
+    unlockRepositoryForReading(receivedRepository);
 
-    return NULL;
+    return account;
 }
 
 int updateAccountDetails(RepositoryFormat* receivedRepository, const char* userTag,
@@ -152,18 +210,23 @@ int updateAccountDetails(RepositoryFormat* receivedRepository, const char* userT
     if (userTag == NULL)
         return -62;
 
-    Account* userAccount = getAccountByTag(receivedRepository, userTag);
+    lockRepositoryForReading(receivedRepository);
+    Account* userAccount = searchAccountByTag(receivedRepository, userTag);
 
     if (userAccount == NULL) {
+        unlockRepositoryForReading(receivedRepository);
         return -63;
     }
 
+    lockAccount(userAccount);
     if (newBalance >= 0) setAccountBalance(userAccount, newBalance);
     if (newFirstName != NULL) setAccountFirstName(userAccount, newFirstName);
     if (newSecondName != NULL) setAccountSecondName(userAccount, newSecondName);
     if (newPassword != NULL) setAccountPassword(userAccount, newPassword);
     if (newPhoneNumber != NULL) setAccountPhoneNumber(userAccount, newPhoneNumber);
+    unlockAccount(userAccount);
 
+    unlockRepositoryForReading(receivedRepository);
     return 1;
 }
 
@@ -188,19 +251,20 @@ int isRepositoryFull(const RepositoryFormat* receivedRepository) {
 int accountTagUsedRepo(const RepositoryFormat* receivedRepository, const char *checked_tag){
     if (receivedRepository == NULL || checked_tag == NULL)
         return 0;
-    
-    for(int index = 0; index < receivedRepository->numberOfElements; index++) {
-        const char* accountTag = getAccountTag(receivedRepository->accounts[index]);
-        if (accountTag != NULL && strcmp(checked_tag, accountTag) == 0)
-            return 1;
-    }
-    return 0;
+
+    lockRepositoryForReading(receivedRepository);
+    int used = searchAccountByTag(receivedRepository, checked_tag) != NULL;
+    unlockRepositoryForReading(receivedRepository);
+
+    return used;
 }
 
 Account* loginRepository(RepositoryFormat* repository, const char* username, const char* password) {
     if (repository == NULL || username == NULL || password == NULL)
         return NULL;
 
+    lockRepositoryForReading(repository);
+
     for (int i = 0; i < repository->numberOfElements; i++) {
         Account* account = repository->accounts[i];
         if (account == NULL) continue;
@@ -210,10 +274,13 @@ Account* loginRepository(RepositoryFormat* repository, const char* username, con
         
         if (accountTag != NULL && accountPassword != NULL &&
             strcmp(accountTag, username) == 0 && strcmp(accountPassword, password) == 0) {
+            retainAccount(account);
+            unlockRepositoryForReading(repository);
             return account; // Credentials match
         }
     }
 
+    unlockRepositoryForReading(repository);
     return NULL; // No matching account found
 }
 
@@ -221,16 +288,9 @@ int ibanUsedInRepository(const RepositoryFormat* repository, const char* iban) {
     if (repository == NULL || iban == NULL)
         return 0;
 
-    for (int i = 0; i < repository->numberOfElements; i++) {
-        if (repository->accounts[i] == NULL) continue;
-        
-        const char* accountIban = getAccountIban(repository->accounts[i]);
-        if (accountIban != NULL && strcmp(accountIban, iban) == 0) {
-            return 1;
-        }
-    }
-
-    return 0;
+    Account* account = findAccountByIban(repository, iban);
+    releaseAccount(account);
+    return account != NULL;
 }
 
 int getRepositoryCapacity(const RepositoryFormat* receivedRepository) {
@@ -243,41 +303,65 @@ Account* getAccountByIndex(const RepositoryFormat* receivedRepository, int index
     if (receivedRepository == NULL)
         return NULL;
     
-    if (index < 0 || index >= receivedRepository->numberOfElements)
+    lockRepositoryForReading(receivedRepository);
+
+    Account* account = NULL;
+    if (index >= 0 && index < receivedRepository->numberOfElements)
+        account = retainAccount(receivedRepository->accounts[index]);
+
+    unlockRepositoryForReading(receivedRepository);
+    return account;
+}
+
+// The accounts listed at one moment, every one held for the caller. Removing an account afterwards doesn't shift
+// the array, the caller releases the accounts and frees it.
+Account** getRepositorySnapshot(const RepositoryFormat* receivedRepository, int* accountsNumber) {
+    if (receivedRepository == NULL || accountsNumber == NULL)
         return NULL;
-    
-    return receivedRepository->accounts[index];
+
+    lockRepositoryForReading(receivedRepository);
+
+    Account** accounts = malloc((receivedRepository->numberOfElements + 1) * sizeof(Account*));
+    if (accounts != NULL) {
+        for (int i = 0; i < receivedRepository->numberOfElements; i++)
+            accounts[i] = retainAccount(receivedRepository->accounts[i]);
+        *accountsNumber = receivedRepository->numberOfElements;
+    }
+
+    unlockRepositoryForReading(receivedRepository);
+    return accounts;
 }
 
 Account* findAccountByIban(const RepositoryFormat* receivedRepository, const char* iban) {
     if (receivedRepository == NULL || iban == NULL)
         return NULL;
 
-    for (int i = 0; i < receivedRepository->numberOfElements; i++) {
-        if (receivedRepository->accounts[i] == NULL) continue;
-        
-        const char* accountIban = getAccountIban(receivedRepository->accounts[i]);
-        if (accountIban != NULL && strcmp(accountIban, iban) == 0) {
-            return receivedRepository->accounts[i];
-        }
-    }
+    lockRepositoryForReading(receivedRepository);
+    Account* account = retainAccount(g_hash_table_lookup(receivedRepository->ibanIndex, iban));
+    unlockRepositoryForReading(receivedRepository);
 
-    return NULL;
+    return account;
 }
 
 int clearRepository(RepositoryFormat* receivedRepository) {
     if (receivedRepository == NULL)
         return -1;
 
-    // Destroy all accounts
+    g_rw_lock_writer_lock(&receivedRepository->lock);
+
+    // Closed and released like a removed account, the accounts themselves go with their last holder. Account locks
+    // are always taken after the repository lock, never before it, so waiting for them here is safe.
     for (int i = 0; i < receivedRepository->numberOfElements; i++) {
         if (receivedRepository->accounts[i] != NULL) {
-            destroyAccount(receivedRepository->accounts[i]);
-            free(receivedRepository->accounts[i]);
+            closeAccount(receivedRepository->accounts[i]);
+            releaseAccount(receivedRepository->accounts[i]);
         }
     }
 
+    g_hash_table_remove_all(receivedRepository->ibanIndex);
     receivedRepository->numberOfElements = 0;
+
+    g_rw_lock_writer_unlock(&receivedRepository->lock);
     return 1;
 }
 
@@ -6,8 +6,13 @@
 typedef struct {
     int capacity, numberOfElements;
     Account** accounts;
+    GHashTable* ibanIndex; // IBAN -> Account*, keys are owned by the accounts themselves
+    GRWLock lock; // Lookups share the repository, adding or removing accounts takes it exclusively
 } RepositoryFormat;
 
+// The repository holds one reference to every account it lists. Adding an account hands the caller's reference
+// over to the repository. The lookups returning an account hold a new reference for the caller, who gives it back
+// with releaseAccount. Removing an account closes it and drops the reference of the repository.
 RepositoryFormat* createRepository();
 int destroyRepository(RepositoryFormat* receivedRepository);
 int resizeRepository(RepositoryFormat* receivedRepository, int newCapacity);
@@ -24,6 +29,7 @@ Account* loginRepository(RepositoryFormat* repository, const char* username, con
 // Additional utility functions
 int getRepositoryCapacity(const RepositoryFormat* receivedRepository);
 Account* getAccountByIndex(const RepositoryFormat* receivedRepository, int index);
+Account** getRepositorySnapshot(const RepositoryFormat* receivedRepository, int* accountsNumber);
 Account* findAccountByIban(const RepositoryFormat* receivedRepository, const char* iban);
 int clearRepository(RepositoryFormat* receivedRepository);
 
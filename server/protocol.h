@@ -0,0 +1,45 @@
+#ifndef GENTLIX_BANK_PROTOCOL_H
+#define GENTLIX_BANK_PROTOCOL_H
+
+// Binary protocol of the headless server, all integers are big endian.
+//
+// Request:  u32 length | u32 requestId | u8 operation | fields
+// Response: u32 length | u32 requestId | i32 result | i64 balance [| session token]
+//
+// length counts the bytes after itself. Request fields are strings, each sent as u16 length followed by its
+// bytes, in the order of the arguments of the matching service. The result is the code returned by the
+// service (1 on success) and balance is the balance of the logged account in cents afterwards.
+// Requests of one connection are answered in order, a client may send many of them without waiting.
+// Login and create open a session for the connection and answer with its token as a trailing string field.
+// Resume attaches another connection, or the same client after reconnecting, to an open session. Logout
+// closes the session, and sessions left idle for half an hour are closed by the server.
+// Login attempts are limited per account tag and for the whole server: an attempt over the limit gets -611 or
+// -612 without checking the password, and wrong passwords in a row make the tag wait longer and longer.
+// Deposit, withdraw, transfer and payment take an optional idempotency key as a last field. A request that
+// repeats a key the account used in the last day isn't run again, it gets the result of the first one.
+
+#define PROTOCOL_HEADER_SIZE 4
+#define PROTOCOL_MAX_FRAME_SIZE 4096
+#define PROTOCOL_RESPONSE_SIZE 20 // Whole response frame without a session token, length prefix included
+
+typedef enum {
+    PROTOCOL_LOGIN = 1,    // tag, password
+    PROTOCOL_CREATE = 2,   // tag, password, password confirm, account type, phone, first name, second name, day, month, year
+    PROTOCOL_EDIT = 3,     // current password, password, password confirm, account type, phone, first name, second name, day, month, year
+    PROTOCOL_DELETE = 4,
+    PROTOCOL_DEPOSIT = 5,  // amount, description, day, month, year[, idempotency key]
+    PROTOCOL_WITHDRAW = 6, // amount, description, day, month, year[, idempotency key]
+    PROTOCOL_TRANSFER = 7, // amount, description, receiver IBAN, day, month, year[, idempotency key]
+    PROTOCOL_PAYMENT = 8,  // amount, description, day, month, year[, idempotency key]
+    PROTOCOL_LOGOUT = 9,
+    PROTOCOL_RESUME = 10   // session token
+} ProtocolOperation;
+
+// Server side errors, the other results come from the services
+#define PROTOCOL_MALFORMED_REQUEST -501 // The fields don't match the operation
+#define PROTOCOL_UNKNOWN_OPERATION -502
+#define PROTOCOL_NOT_LOGGED_IN -503
+#define PROTOCOL_ALREADY_LOGGED_IN -504
+#define PROTOCOL_UNKNOWN_SESSION -505 // Closed or expired session
+
+#endif //GENTLIX_BANK_PROTOCOL_H
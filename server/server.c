@@ -0,0 +1,570 @@
+#define _GNU_SOURCE // accept4
+#include <glib.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "../domain/domain.h"
+#include "../repository/repository.h"
+#include "../services/services.h"
+#include "protocol.h"
+
+// Headless bank server. Every worker thread runs its own epoll loop and accepts from the shared listening
+// socket, a connection then stays on the worker that accepted it. Requests are read, answered in order and
+// the answers written back without blocking, so one worker serves many pipelined clients.
+
+#define SERVER_MAX_FIELDS 10
+#define SERVER_MAX_EVENTS 64
+#define SERVER_READ_CHUNK 16384
+#define SERVER_MAX_PENDING_OUTPUT (1 << 20) // A client that doesn't read its answers stops being read as well
+#define SERVER_SESSION_IDLE_TIMEOUT 1800 // Seconds
+#define SERVER_IDEMPOTENCY_KEYS 65536
+#define SERVER_IDEMPOTENCY_WINDOW (24 * 60 * 60) // Seconds
+#define SERVER_LOGINS_PER_SECOND 200
+
+typedef struct {
+    int fd;
+    char session[SESSION_TOKEN_SIZE]; // Token of the session the connection uses, empty when logged out
+    unsigned char* input;
+    size_t inputSize, inputCapacity;
+    unsigned char* output;
+    size_t outputStart, outputSize, outputCapacity;
+    short readingPaused;
+} Connection;
+
+typedef struct {
+    RepositoryFormat* repository;
+    SessionTable* sessions;
+    IdempotencyCache* idempotencyKeys;
+    LoginLimiter* loginLimiter;
+    int listenFd;
+    short expiresSessions; // Set on one worker, it closes the idle sessions between events
+    GThread* thread;
+} ServerWorker;
+
+static volatile sig_atomic_t serverStopping = 0;
+
+static void stop_server(int signalNumber) {
+    (void)signalNumber;
+    serverStopping = 1;
+}
+
+static guint32 read_u32(const unsigned char* data) {
+    return ((guint32)data[0] << 24) | ((guint32)data[1] << 16) | ((guint32)data[2] << 8) | (guint32)data[3];
+}
+
+static void write_u32(unsigned char* data, guint32 value) {
+    data[0] = (unsigned char)(value >> 24);
+    data[1] = (unsigned char)(value >> 16);
+    data[2] = (unsigned char)(value >> 8);
+    data[3] = (unsigned char)value;
+}
+
+static int reserve_buffer(unsigned char** buffer, size_t* capacity, size_t neededSize) {
+    if (neededSize <= *capacity)
+        return 1;
+
+    size_t newCapacity = *capacity > 0 ? *capacity : 4096;
+    while (newCapacity < neededSize)
+        newCapacity *= 2;
+
+    unsigned char* newBuffer = realloc(*buffer, newCapacity);
+    if (newBuffer == NULL)
+        return 0;
+
+    *buffer = newBuffer;
+    *capacity = newCapacity;
+    return 1;
+}
+
+// Copies the request fields to storage as NUL terminated strings, which takes no more room than the frame
+// itself. Returns the number of fields or -1 when the frame is malformed.
+static int parse_fields(unsigned char* data, size_t size, char** fields, char* storage) {
+    int fieldsNumber = 0;
+    size_t position = 0;
+
+    while (position < size) {
+        if (fieldsNumber == SERVER_MAX_FIELDS || size - position < 2)
+            return -1;
+
+        size_t length = ((size_t)data[position] << 8) | data[position + 1];
+        position += 2;
+        if (length > size - position)
+            return -1;
+
+        memcpy(storage, data + position, length);
+        storage[length] = '\0';
+        fields[fieldsNumber++] = storage;
+        storage += length + 1;
+        position += length;
+    }
+
+    return fieldsNumber;
+}
+
+static int run_transaction(RepositoryFormat* repository, Account* account, int operation, char** fields) {
+    switch (operation) {
+        case PROTOCOL_DEPOSIT:
+            return depositService(account, fields[0], fields[1], fields[2], fields[3], fields[4]);
+        case PROTOCOL_WITHDRAW:
+            return withdrawService(account, fields[0], fields[1], fields[2], fields[3], fields[4]);
+        case PROTOCOL_TRANSFER:
+            return transferService(repository, account, fields[0], fields[1], fields[2], fields[3], fields[4], fields[5]);
+        default:
+            return paymentService(account, fields[0], fields[1], fields[2], fields[3], fields[4]);
+    }
+}
+
+// Runs one request, account is set to the account of the session afterwards, held until the answer is queued
+static int run_operation(ServerWorker* worker, Connection* connection, int operation, char** fields, int fieldsNumber, Account** account) {
+    static const int expectedFields[] = {0, 2, 10, 10, 0, 5, 5, 6, 5, 0, 1};
+    RepositoryFormat* repository = worker->repository;
+
+    *account = NULL;
+    if (operation < PROTOCOL_LOGIN || operation > PROTOCOL_RESUME)
+        return PROTOCOL_UNKNOWN_OPERATION;
+
+    const char* idempotencyKey = NULL;
+    if (operation >= PROTOCOL_DEPOSIT && operation <= PROTOCOL_PAYMENT && fieldsNumber == expectedFields[operation] + 1)
+        idempotencyKey = fields[--fieldsNumber];
+
+    if (fieldsNumber != expectedFields[operation])
+        return PROTOCOL_MALFORMED_REQUEST;
+
+    if (connection->session[0] != '\0') {
+        *account = getSessionAccount(worker->sessions, connection->session);
+        if (*account == NULL) {
+            connection->session[0] = '\0';
+            return PROTOCOL_UNKNOWN_SESSION; // Expired since the last request
+        }
+    }
+
+    if (operation == PROTOCOL_LOGIN || operation == PROTOCOL_CREATE || operation == PROTOCOL_RESUME) {
+        if (*account != NULL)
+            return PROTOCOL_ALREADY_LOGGED_IN;
+    } else if (*account == NULL) {
+        return PROTOCOL_NOT_LOGGED_IN;
+    }
+
+    int result;
+    switch (operation) {
+        case PROTOCOL_LOGIN:
+            result = loginServiceThrottled(worker->loginLimiter, repository, fields[0], fields[1], account);
+            break;
+        case PROTOCOL_CREATE:
+            result = createAccountService(repository, fields[0], fields[1], fields[2], fields[3], fields[4], fields[5],
+                                          fields[6], fields[7], fields[8], fields[9], account);
+            break;
+        case PROTOCOL_RESUME:
+            *account = getSessionAccount(worker->sessions, fields[0]);
+            if (*account == NULL)
+                return PROTOCOL_UNKNOWN_SESSION;
+            g_strlcpy(connection->session, fields[0], SESSION_TOKEN_SIZE);
+            return 1;
+        case PROTOCOL_EDIT:
+            return editAccountService(account, fields[0], fields[1], fields[2], fields[3], fields[4],
+                                      fields[5], fields[6], fields[7], fields[8], fields[9]);
+        case PROTOCOL_DELETE: {
+            // Every session of the account goes first, so no other client picks it up again
+            Account* deletedAccount = *account;
+            closeAccountSessions(worker->sessions, deletedAccount);
+            connection->session[0] = '\0';
+            result = deleteAccountService(repository, account);
+            if (result == 1)
+                releaseAccount(deletedAccount); // Freed here unless a request of another client still holds it
+            return result;
+        }
+        case PROTOCOL_DEPOSIT:
+        case PROTOCOL_WITHDRAW:
+        case PROTOCOL_TRANSFER:
+        case PROTOCOL_PAYMENT:
+            if (idempotencyKey == NULL)
+                return run_transaction(repository, *account, operation, fields);
+
+            // A retry waits for the first request with its key, or gets its result, and doesn't run again
+            int status = beginIdempotentRequest(worker->idempotencyKeys, *account, idempotencyKey, &result);
+            if (status != 1)
+                return status == 0 ? result : status;
+            result = run_transaction(repository, *account, operation, fields);
+            finishIdempotentRequest(worker->idempotencyKeys, *account, idempotencyKey, result);
+            return result;
+        default:
+            closeSession(worker->sessions, connection->session); // Logout
+            connection->session[0] = '\0';
+            releaseAccount(*account);
+            *account = NULL;
+            return 1;
+    }
+
+    // Login and create open a new session for the connection
+    if (result == 1) {
+        result = openSession(worker->sessions, *account, connection->session);
+        if (result != 1) {
+            releaseAccount(*account);
+            *account = NULL;
+        }
+    }
+    return result;
+}
+
+// The session token follows the balance in the answers that log a connection in
+static int queue_response(Connection* connection, guint32 requestId, int result, const Account* account, short withSession) {
+    size_t responseSize = PROTOCOL_RESPONSE_SIZE + (withSession ? 2 + SESSION_TOKEN_SIZE - 1 : 0);
+    if (!reserve_buffer(&connection->output, &connection->outputCapacity, connection->outputSize + responseSize))
+        return 0;
+
+    gint64 balance = 0;
+    if (account != NULL) {
+        float accountBalance = getAccountBalance(account);
+        balance = (gint64)(accountBalance * 100.0 + (accountBalance >= 0 ? 0.5 : -0.5));
+    }
+
+    unsigned char* frame = connection->output + connection->outputSize;
+    write_u32(frame, (guint32)(responseSize - PROTOCOL_HEADER_SIZE));
+    write_u32(frame + 4, requestId);
+    write_u32(frame + 8, (guint32)result);
+    write_u32(frame + 12, (guint32)((guint64)balance >> 32));
+    write_u32(frame + 16, (guint32)balance);
+    if (withSession) {
+        frame[20] = 0;
+        frame[21] = SESSION_TOKEN_SIZE - 1;
+        memcpy(frame + 22, connection->session, SESSION_TOKEN_SIZE - 1);
+    }
+    connection->outputSize += responseSize;
+
+    return 1;
+}
+
+// Answers every complete frame of the input buffer, returns 0 when the connection has to be dropped
+static int process_input(ServerWorker* worker, Connection* connection) {
+    char* fields[SERVER_MAX_FIELDS];
+    char storage[PROTOCOL_MAX_FRAME_SIZE];
+    size_t position = 0;
+
+    while (connection->inputSize - position >= PROTOCOL_HEADER_SIZE) {
+        size_t frameSize = read_u32(connection->input + position);
+        if (frameSize < 5 || frameSize > PROTOCOL_MAX_FRAME_SIZE)
+            return 0; // Not speaking the protocol
+        if (connection->inputSize - position < PROTOCOL_HEADER_SIZE + frameSize)
+            break;
+
+        unsigned char* frame = connection->input + position + PROTOCOL_HEADER_SIZE;
+        guint32 requestId = read_u32(frame);
+        int operation = frame[4];
+        Account* account = NULL;
+        int fieldsNumber = parse_fields(frame + 5, frameSize - 5, fields, storage);
+        int result = fieldsNumber < 0 ? PROTOCOL_MALFORMED_REQUEST
+                                      : run_operation(worker, connection, operation, fields, fieldsNumber, &account);
+
+        short withSession = result == 1 && (operation == PROTOCOL_LOGIN || operation == PROTOCOL_CREATE || operation == PROTOCOL_RESUME);
+        short queued = queue_response(connection, requestId, result, account, withSession);
+        releaseAccount(account);
+        if (!queued)
+            return 0;
+        position += PROTOCOL_HEADER_SIZE + frameSize;
+    }
+
+    memmove(connection->input, connection->input + position, connection->inputSize - position);
+    connection->inputSize -= position;
+    return 1;
+}
+
+static int flush_output(Connection* connection) {
+    while (connection->outputStart < connection->outputSize) {
+        ssize_t written = send(connection->fd, connection->output + connection->outputStart,
+                               connection->outputSize - connection->outputStart, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        connection->outputStart += (size_t)written;
+    }
+
+    if (connection->outputStart == connection->outputSize) {
+        connection->outputStart = 0;
+        connection->outputSize = 0;
+    }
+    return 1;
+}
+
+static int read_input(ServerWorker* worker, Connection* connection) {
+    while (TRUE) {
+        if (!reserve_buffer(&connection->input, &connection->inputCapacity, connection->inputSize + SERVER_READ_CHUNK))
+            return 0;
+
+        ssize_t received = recv(connection->fd, connection->input + connection->inputSize, SERVER_READ_CHUNK, 0);
+        if (received == 0)
+            return 0; // Closed by the client
+        if (received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+
+        connection->inputSize += (size_t)received;
+        if (!process_input(worker, connection))
+            return 0;
+        if (connection->outputSize - connection->outputStart > SERVER_MAX_PENDING_OUTPUT)
+            return 1; // Let the client read before taking more requests
+    }
+}
+
+// Waits for output room only while answers are pending, and stops reading while too many are
+static void update_interest(int epollFd, Connection* connection) {
+    size_t pendingOutput = connection->outputSize - connection->outputStart;
+    short pauseReading = pendingOutput > SERVER_MAX_PENDING_OUTPUT;
+
+    struct epoll_event event;
+    event.events = (pauseReading ? 0 : EPOLLIN) | (pendingOutput > 0 ? EPOLLOUT : 0) | EPOLLRDHUP;
+    event.data.ptr = connection;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, connection->fd, &event);
+    connection->readingPaused = pauseReading;
+}
+
+static void close_connection(int epollFd, Connection* connection) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    free(connection->input);
+    free(connection->output);
+    free(connection);
+}
+
+static void accept_connections(int epollFd, int listenFd) {
+    while (TRUE) {
+        int clientFd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientFd < 0)
+            return; // EAGAIN once the backlog is empty, or another worker took the client
+
+        Connection* connection = calloc(1, sizeof(Connection));
+        if (connection == NULL) {
+            close(clientFd);
+            continue;
+        }
+        connection->fd = clientFd;
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.ptr = connection;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientFd, &event) != 0) {
+            close(clientFd);
+            free(connection);
+        }
+    }
+}
+
+static gpointer run_server_worker(gpointer data) {
+    ServerWorker* worker = data;
+    struct epoll_event events[SERVER_MAX_EVENTS];
+
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0)
+        return NULL;
+
+    // Exclusive, so a new client wakes one worker instead of all of them
+    struct epoll_event listenEvent;
+    listenEvent.events = EPOLLIN | EPOLLEXCLUSIVE;
+    listenEvent.data.ptr = NULL;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, worker->listenFd, &listenEvent);
+
+    while (!serverStopping) {
+        int eventsNumber = epoll_wait(epollFd, events, SERVER_MAX_EVENTS, 500);
+        if (worker->expiresSessions)
+            expireIdleSessions(worker->sessions);
+
+        for (int i = 0; i < eventsNumber; i++) {
+            Connection* connection = events[i].data.ptr;
+            if (connection == NULL) {
+                accept_connections(epollFd, worker->listenFd);
+                continue;
+            }
+
+            int alive = !(events[i].events & EPOLLERR);
+            if (alive && (events[i].events & EPOLLOUT))
+                alive = flush_output(connection);
+            if (alive && (events[i].events & EPOLLIN))
+                alive = read_input(worker, connection) && flush_output(connection);
+            if (alive && (events[i].events & EPOLLRDHUP) && !(events[i].events & EPOLLIN))
+                alive = 0;
+
+            if (!alive)
+                close_connection(epollFd, connection);
+            else
+                update_interest(epollFd, connection);
+        }
+    }
+
+    // Connections still open when stopping are simply dropped with the epoll instance
+    close(epollFd);
+    return NULL;
+}
+
+static int open_listening_socket(const char* socketPath) {
+    struct sockaddr_un address;
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+        return -1;
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd < 0)
+        return -1;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketPath);
+    unlink(socketPath);
+
+    if (bind(listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listenFd, SOMAXCONN) != 0) {
+        close(listenFd);
+        return -1;
+    }
+
+    return listenFd;
+}
+
+// Hot spot benchmark instead of serving: 64 accounts, a quarter of the transactions on the same one. Transfers
+// unless another kind is named. The velocity rules are turned off, the run measures the locking and the history,
+// not the limits.
+static const char* const benchmarkKinds[] = {
+    [TRANSACTION_DEPOSIT] = "deposit",
+    [TRANSACTION_WITHDRAW] = "withdraw",
+    [TRANSACTION_TRANSFER] = "transfer",
+    [TRANSACTION_PAYMENT] = "payment",
+};
+
+static int run_transfer_benchmark(int workersNumber, const char* kindName) {
+    TransactionKind kind = TRANSACTION_KINDS;
+    for (size_t i = 0; i < G_N_ELEMENTS(benchmarkKinds); i++) {
+        if (strcmp(benchmarkKinds[i], kindName) == 0)
+            kind = (TransactionKind)i;
+    }
+    if (kind == TRANSACTION_KINDS) {
+        fprintf(stderr, "Unknown benchmark kind %s, expected deposit, withdraw, transfer or payment\n", kindName);
+        return 1;
+    }
+
+    VelocityRules noLimits = {0};
+    setVelocityRules(VELOCITY_RULES_SINGLE, &noLimits);
+
+    TransferBenchmarkOptions options = {workersNumber, 64, 100000, 25, kind};
+    TransferBenchmarkSummary summary;
+    int result = runTransferBenchmark(&options, &summary);
+    if (result != 1) {
+        fprintf(stderr, "Transfer benchmark failed: %d\n", result);
+        return 1;
+    }
+
+    printf("%d workers, %d accounts, %d%% on the hot account: %d %s (%d failed) in %.3f s, %.0f/s\n", options.workersNumber,
+           options.accountsNumber, options.hotSpotPercent, summary.transfersDone, kindName, summary.transfersFailed,
+           summary.elapsedMicroseconds / (double)G_USEC_PER_SEC, summary.transfersPerSecond);
+    return 0;
+}
+
+// Archive benchmark instead of serving: a year of history on 1000 accounts by default, the last three months kept
+// resident.
+// Bytes per archived transaction are reported before and after the compression.
+static int run_archive_benchmark(int accountsNumber) {
+    VelocityRules noLimits = {0};
+    setVelocityRules(VELOCITY_RULES_SINGLE, &noLimits);
+
+    ArchiveBenchmarkOptions options = {accountsNumber, 12, 20, 3};
+    ArchiveBenchmarkSummary summary;
+    int result = runArchiveBenchmark(&options, &summary);
+    if (result != 1) {
+        fprintf(stderr, "Archive benchmark failed: %d\n", result);
+        return 1;
+    }
+
+    printf("%d accounts, %d transactions, %d archived in %.3f s\n", options.accountsNumber, summary.transactionsNumber,
+           summary.archivedTransactions, summary.elapsedMicroseconds / (double)G_USEC_PER_SEC);
+    printf("before: %zu bytes, %.1f bytes/transaction\nafter:  %zu bytes, %.1f bytes/transaction\n", summary.rawBytes,
+           summary.rawBytesPerTransaction, summary.compressedBytes, summary.compressedBytesPerTransaction);
+    return 0;
+}
+
+// Usage: Gentlix_Bank_Server [socket path] [workers]
+//        Gentlix_Bank_Server --transfer-benchmark [workers] [deposit|withdraw|transfer|payment]
+//        Gentlix_Bank_Server --archive-benchmark [accounts]
+int main(int argc, char *argv[]) {
+
+    if (argc > 1 && strcmp(argv[1], "--transfer-benchmark") == 0) {
+        int benchmarkWorkers = argc > 2 ? atoi(argv[2]) : (int)g_get_num_processors();
+        return run_transfer_benchmark(benchmarkWorkers > 0 ? benchmarkWorkers : 1, argc > 3 ? argv[3] : "transfer");
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--archive-benchmark") == 0) {
+        int benchmarkAccounts = argc > 2 ? atoi(argv[2]) : 1000;
+        return run_archive_benchmark(benchmarkAccounts >= 2 ? benchmarkAccounts : 2);
+    }
+
+    gchar* socketPath = argc > 1 ? g_strdup(argv[1]) : g_build_filename(g_get_user_runtime_dir(), "gentlix-bank.sock", NULL);
+    int workersNumber = argc > 2 ? atoi(argv[2]) : (int)g_get_num_processors();
+    if (workersNumber <= 0)
+        workersNumber = 1;
+
+    int listenFd = open_listening_socket(socketPath);
+    if (listenFd < 0) {
+        fprintf(stderr, "Can't listen on %s: %s\n", socketPath, strerror(errno));
+        g_free(socketPath);
+        return 1;
+    }
+
+    struct sigaction stopAction;
+    memset(&stopAction, 0, sizeof(stopAction));
+    stopAction.sa_handler = stop_server;
+    sigaction(SIGINT, &stopAction, NULL);
+    sigaction(SIGTERM, &stopAction, NULL);
+
+    RepositoryFormat* database = createRepository();
+    SessionTable* sessions = createSessionTable(SERVER_SESSION_IDLE_TIMEOUT);
+    // The keys of the last day are kept on disk, so retries across a restart aren't applied twice
+    gchar* stateDirectory = g_build_filename(g_get_user_data_dir(), "GentlixBank", NULL);
+    gchar* journalPath = g_build_filename(stateDirectory, "idempotency-keys", NULL);
+    if (g_mkdir_with_parents(stateDirectory, 0700) != 0)
+        fprintf(stderr, "Can't create %s, idempotency keys are kept in memory only\n", stateDirectory);
+    IdempotencyCache* idempotencyKeys = createIdempotencyCache(SERVER_IDEMPOTENCY_KEYS, SERVER_IDEMPOTENCY_WINDOW, journalPath);
+    g_free(journalPath);
+    g_free(stateDirectory);
+    LoginLimiter* loginLimiter = createLoginLimiter(getRepositorySize(database), SERVER_LOGINS_PER_SECOND);
+
+    ServerWorker* workers = calloc(workersNumber, sizeof(ServerWorker));
+    if (database == NULL || sessions == NULL || idempotencyKeys == NULL || loginLimiter == NULL || workers == NULL) {
+        fprintf(stderr, "Not enough memory to start the server\n");
+        close(listenFd);
+        g_free(socketPath);
+        return 1;
+    }
+
+    printf("Gentlix Bank server listening on %s with %d workers\n", socketPath, workersNumber);
+    for (int i = 0; i < workersNumber; i++) {
+        workers[i].repository = database;
+        workers[i].sessions = sessions;
+        workers[i].idempotencyKeys = idempotencyKeys;
+        workers[i].loginLimiter = loginLimiter;
+        workers[i].expiresSessions = i == 0;
+        workers[i].listenFd = listenFd;
+        workers[i].thread = g_thread_new("server-worker", run_server_worker, &workers[i]);
+    }
+
+    for (int i = 0; i < workersNumber; i++)
+        g_thread_join(workers[i].thread);
+
+    close(listenFd);
+    unlink(socketPath);
+    g_free(socketPath);
+    free(workers);
+    destroySessionTable(sessions);
+    destroyIdempotencyCache(idempotencyKeys);
+    destroyLoginLimiter(loginLimiter);
+    destroyRepository(database);
+
+    return 0;
+}
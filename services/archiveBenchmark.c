@@ -0,0 +1,150 @@
+#include "services.h"
+#include <stdlib.h>
+
+////////////////////
+//
+//  Archive benchmark
+//
+////////////////////
+
+// Measures how much memory archiving closed periods saves. The run builds a repository of its own and gives
+// every account a history of the given months: a salary at the start of every month, then payments, withdrawals
+// and transfers to the next account spread over the month, with amounts drawn at random. The closed periods of
+// every account are then archived, keeping the last openMonths resident, and the size of the archived
+// transactions is compared before and after their compression.
+//
+// The history goes through the velocity checks like any other, so a run building many transactions turns the
+// rules off first.
+
+#define ARCHIVE_BENCHMARK_SALARY (2500 * MONEY_CENTS)
+
+typedef struct {
+    TransactionKind kind;
+    const char* description;
+} ArchiveBenchmarkEntry;
+
+// Drawn in turn for the transactions after the salary
+static const ArchiveBenchmarkEntry archiveBenchmarkEntries[] = {
+    {TRANSACTION_PAYMENT,  "Groceries"},
+    {TRANSACTION_PAYMENT,  "Utilities"},
+    {TRANSACTION_WITHDRAW, "Cash"},
+    {TRANSACTION_TRANSFER, "Rent share"},
+    {TRANSACTION_PAYMENT,  "Restaurant"},
+};
+
+// Xorshift, the same generator as the transfer benchmark
+static guint32 nextArchiveBenchmarkRandom(guint32* state) {
+    guint32 value = *state;
+    value ^= value << 13;
+    value ^= value >> 17;
+    value ^= value << 5;
+    *state = value;
+    return value;
+}
+
+// Tags have to be letters only, the index is written in base 26
+static void formatArchiveBenchmarkTag(int index, char* tag) {
+    int length = 0;
+    tag[length++] = 'a';
+    do {
+        tag[length++] = (char)('a' + index % 26);
+        index /= 26;
+    } while (index > 0);
+    tag[length] = '\0';
+}
+
+// Day after day for all the accounts, so a transfer never lands before the latest transaction of the receiver
+static int buildArchiveBenchmarkHistory(RepositoryFormat* repository, Account** accounts, const ArchiveBenchmarkOptions* options,
+                                        int* transactionsNumber) {
+    guint32 seed = 2463534242u;
+
+    for (int month = 0; month < options->months; month++) {
+        short year = (short)(2024 + month / 12);
+        for (int i = 0; i < options->accountsNumber; i++) {
+            if (transactionServiceTyped(repository, accounts[i], TRANSACTION_DEPOSIT, ARCHIVE_BENCHMARK_SALARY, "Salary", NULL,
+                                        packDate(createDate(1, (short)(month % 12 + 1), year))) != 1)
+                return 0;
+            (*transactionsNumber)++;
+        }
+
+        for (int k = 1; k < options->transactionsPerMonth; k++) {
+            const ArchiveBenchmarkEntry* entry = &archiveBenchmarkEntries[k % G_N_ELEMENTS(archiveBenchmarkEntries)];
+            PackedDate date = packDate(createDate((short)(1 + k * 27 / options->transactionsPerMonth), (short)(month % 12 + 1), year));
+
+            for (int i = 0; i < options->accountsNumber; i++) {
+                MoneyAmount amount = MONEY_CENTS + nextArchiveBenchmarkRandom(&seed) % (40 * MONEY_CENTS);
+                const char* receiverIban = entry->kind == TRANSACTION_TRANSFER
+                                               ? getAccountIban(accounts[(i + 1) % options->accountsNumber])
+                                               : NULL;
+
+                // A transfer also books the credit on the receiver
+                if (transactionServiceTyped(repository, accounts[i], entry->kind, amount, entry->description, receiverIban, date) != 1)
+                    return 0;
+                *transactionsNumber += receiverIban != NULL ? 2 : 1;
+            }
+        }
+    }
+
+    return 1;
+}
+
+int runArchiveBenchmark(const ArchiveBenchmarkOptions* options, ArchiveBenchmarkSummary* summary) {
+    if (options == NULL || options->accountsNumber < 2 || options->months <= 0 || options->transactionsPerMonth <= 0 ||
+        options->openMonths < 0)
+        return -651; // Invalid benchmark options
+
+    RepositoryFormat* repository = createRepository();
+    Account** accounts = calloc(options->accountsNumber, sizeof(Account*));
+    ArchiveBenchmarkSummary result = {0};
+
+    int resultCode = 1;
+    if (repository == NULL || accounts == NULL)
+        resultCode = -652; // Memory allocation failed
+
+    for (int i = 0; resultCode == 1 && i < options->accountsNumber; i++) {
+        char tag[16];
+        formatArchiveBenchmarkTag(i, tag);
+        if (createAccountService(repository, tag, "benchmark", "benchmark", "checking", "0", "Benchmark", "Account", "1", "1",
+                                 "1990", &accounts[i]) != 1)
+            resultCode = -653; // The accounts of the benchmark can't be opened
+    }
+
+    if (resultCode == 1 && !buildArchiveBenchmarkHistory(repository, accounts, options, &result.transactionsNumber))
+        resultCode = -654; // The history of the benchmark can't be built
+
+    if (resultCode == 1) {
+        gint64 startTime = g_get_monotonic_time();
+        for (int i = 0; i < options->accountsNumber; i++)
+            archiveClosedPeriods(accounts[i], options->openMonths);
+        result.elapsedMicroseconds = g_get_monotonic_time() - startTime;
+
+        for (int i = 0; i < options->accountsNumber; i++) {
+            size_t rawBytes, compressedBytes;
+            result.archivedTransactions += getAccountArchiveStatistics(accounts[i], &rawBytes, &compressedBytes);
+            result.rawBytes += rawBytes;
+            result.compressedBytes += compressedBytes;
+        }
+        if (result.archivedTransactions > 0) {
+            result.rawBytesPerTransaction = (double)result.rawBytes / result.archivedTransactions;
+            result.compressedBytesPerTransaction = (double)result.compressedBytes / result.archivedTransactions;
+        }
+    }
+
+    if (summary != NULL)
+        *summary = result;
+
+    // Deleted rather than only released, so their transactions leave the index shared with the rest of the bank
+    for (int i = 0; accounts != NULL && i < options->accountsNumber; i++) {
+        Account* account = accounts[i];
+        if (account == NULL)
+            continue;
+        Account* deletedAccount = account;
+        deleteAccountService(repository, &deletedAccount);
+        releaseAccount(account);
+    }
+    free(accounts);
+    if (repository != NULL)
+        destroyRepository(repository);
+
+    return resultCode;
+}
@@ -0,0 +1,219 @@
+#include "services.h"
+#include <stdlib.h>
+#include <string.h>
+
+////////////////////
+//
+//  Asynchronous services
+//
+////////////////////
+
+// Every service has a variant that runs it on the service dispatcher and reports the result back on the main
+// context of the thread that made the call, so GTK handlers return at once and update the interface from the
+// callback. The string arguments are copied and the account of the call is held until the callback ran, so it
+// may be deleted meanwhile; account slots and batch arrays belong to the caller and have to stay valid until the
+// callback runs. A call that can't be queued returns its error code and its callback is never invoked.
+
+#define ASYNC_SERVICE_MAX_ARGUMENTS 10
+
+typedef struct AsyncServiceCall AsyncServiceCall;
+typedef int (*AsyncServiceRunner)(AsyncServiceCall* call);
+
+struct AsyncServiceCall {
+    AsyncServiceRunner runner;
+    RepositoryFormat* repository;
+    Account* account;
+    Account** accountSlot; // Filled by the services that log in or change the logged account
+    LoginLimiter* loginLimiter;
+    gchar* arguments[ASYNC_SERVICE_MAX_ARGUMENTS];
+    const TransactionOperation* operations;
+    int operationsNumber;
+    int* results;
+    int result;
+    ServiceCallback callback;
+    gpointer userData;
+    GMainContext* context;
+};
+
+static int runLoginService(AsyncServiceCall* call) {
+    return loginServiceThrottled(call->loginLimiter, call->repository, call->arguments[0], call->arguments[1], call->accountSlot);
+}
+
+static int runCreateAccountService(AsyncServiceCall* call) {
+    gchar** arguments = call->arguments;
+    return createAccountService(call->repository, arguments[0], arguments[1], arguments[2], arguments[3], arguments[4],
+                                arguments[5], arguments[6], arguments[7], arguments[8], arguments[9], call->accountSlot);
+}
+
+static int runDeleteAccountService(AsyncServiceCall* call) {
+    return deleteAccountService(call->repository, call->accountSlot);
+}
+
+static int runEditAccountService(AsyncServiceCall* call) {
+    gchar** arguments = call->arguments;
+    return editAccountService(call->accountSlot, arguments[0], arguments[1], arguments[2], arguments[3], arguments[4],
+                              arguments[5], arguments[6], arguments[7], arguments[8], arguments[9]);
+}
+
+static int runDepositService(AsyncServiceCall* call) {
+    gchar** arguments = call->arguments;
+    return depositService(call->account, arguments[0], arguments[1], arguments[2], arguments[3], arguments[4]);
+}
+
+static int runWithdrawService(AsyncServiceCall* call) {
+    gchar** arguments = call->arguments;
+    return withdrawService(call->account, arguments[0], arguments[1], arguments[2], arguments[3], arguments[4]);
+}
+
+static int runTransferService(AsyncServiceCall* call) {
+    gchar** arguments = call->arguments;
+    return transferService(call->repository, call->account, arguments[0], arguments[1], arguments[2], arguments[3], arguments[4], arguments[5]);
+}
+
+static int runPaymentService(AsyncServiceCall* call) {
+    gchar** arguments = call->arguments;
+    return paymentService(call->account, arguments[0], arguments[1], arguments[2], arguments[3], arguments[4]);
+}
+
+static int runBatchTransactionService(AsyncServiceCall* call) {
+    return batchTransactionService(call->repository, call->operations, call->operationsNumber, call->results);
+}
+
+static AsyncServiceCall* createAsyncServiceCall(AsyncServiceRunner runner, RepositoryFormat* repository, Account* account,
+                                                Account** accountSlot, const char* const* arguments, int argumentsNumber) {
+    AsyncServiceCall* call = calloc(1, sizeof(AsyncServiceCall));
+    if (call == NULL)
+        return NULL;
+
+    call->runner = runner;
+    call->repository = repository;
+    call->account = retainAccount(account);
+    call->accountSlot = accountSlot;
+    for (int i = 0; i < argumentsNumber; i++)
+        call->arguments[i] = g_strdup(arguments[i]);
+
+    return call;
+}
+
+static void destroyAsyncServiceCall(gpointer data) {
+    AsyncServiceCall* call = data;
+
+    for (int i = 0; i < ASYNC_SERVICE_MAX_ARGUMENTS; i++)
+        g_free(call->arguments[i]);
+    releaseAccount(call->account);
+    if (call->context != NULL)
+        g_main_context_unref(call->context);
+
+    free(call);
+}
+
+static int runAsyncServiceCall(gpointer data) {
+    AsyncServiceCall* call = data;
+    return call->runner(call);
+}
+
+// Runs on the main context of the caller
+static gboolean deliverAsyncServiceResult(gpointer data) {
+    AsyncServiceCall* call = data;
+
+    if (call->callback != NULL)
+        call->callback(call->result, call->userData);
+
+    return G_SOURCE_REMOVE;
+}
+
+// Runs on the dispatcher worker, the result travels back to the caller's main context
+static void finishAsyncServiceCall(int result, gpointer data) {
+    AsyncServiceCall* call = data;
+    call->result = result;
+    g_main_context_invoke_full(call->context, G_PRIORITY_DEFAULT, deliverAsyncServiceResult, call, destroyAsyncServiceCall);
+}
+
+static int submitAsyncServiceCall(ServiceDispatcher* dispatcher, ServicePriority priority, AsyncServiceCall* call,
+                                  ServiceCallback callback, gpointer userData) {
+    if (call == NULL)
+        return -465; // Memory allocation failed
+
+    call->callback = callback;
+    call->userData = userData;
+    call->context = g_main_context_ref_thread_default();
+
+    int result = submitServiceRequest(dispatcher, priority, runAsyncServiceCall, call, NULL, finishAsyncServiceCall, call);
+    if (result != 1)
+        destroyAsyncServiceCall(call);
+
+    return result;
+}
+
+int loginServiceAsync(ServiceDispatcher* dispatcher, LoginLimiter* limiter, RepositoryFormat* repository, const char* username, const char* password,
+                      Account** loggedUser, ServiceCallback callback, gpointer userData) {
+    const char* arguments[] = {username, password};
+    AsyncServiceCall* call = createAsyncServiceCall(runLoginService, repository, NULL, loggedUser, arguments, G_N_ELEMENTS(arguments));
+    if (call != NULL)
+        call->loginLimiter = limiter;
+    return submitAsyncServiceCall(dispatcher, SERVICE_PRIORITY_INTERACTIVE, call, callback, userData);
+}
+
+int createAccountServiceAsync(ServiceDispatcher* dispatcher, RepositoryFormat* repository, const char* accountTag, const char* password,
+                              const char* passwordConfirm, const char* accountType, const char* phoneNumber, const char* firstName,
+                              const char* secondName, const char* day, const char* month, const char* year, Account** loggedAccount,
+                              ServiceCallback callback, gpointer userData) {
+    const char* arguments[] = {accountTag, password, passwordConfirm, accountType, phoneNumber, firstName, secondName, day, month, year};
+    AsyncServiceCall* call = createAsyncServiceCall(runCreateAccountService, repository, NULL, loggedAccount, arguments, G_N_ELEMENTS(arguments));
+    return submitAsyncServiceCall(dispatcher, SERVICE_PRIORITY_INTERACTIVE, call, callback, userData);
+}
+
+int deleteAccountServiceAsync(ServiceDispatcher* dispatcher, RepositoryFormat* repository, Account** loggedAccount,
+                              ServiceCallback callback, gpointer userData) {
+    AsyncServiceCall* call = createAsyncServiceCall(runDeleteAccountService, repository, NULL, loggedAccount, NULL, 0);
+    return submitAsyncServiceCall(dispatcher, SERVICE_PRIORITY_INTERACTIVE, call, callback, userData);
+}
+
+int editAccountServiceAsync(ServiceDispatcher* dispatcher, Account** loggedAccount, const char* currentPassword, const char* password,
+                            const char* passwordConfirm, const char* accountType, const char* phoneNumber, const char* firstName,
+                            const char* secondName, const char* day, const char* month, const char* year,
+                            ServiceCallback callback, gpointer userData) {
+    const char* arguments[] = {currentPassword, password, passwordConfirm, accountType, phoneNumber, firstName, secondName, day, month, year};
+    AsyncServiceCall* call = createAsyncServiceCall(runEditAccountService, NULL, NULL, loggedAccount, arguments, G_N_ELEMENTS(arguments));
+    return submitAsyncServiceCall(dispatcher, SERVICE_PRIORITY_INTERACTIVE, call, callback, userData);
+}
+
+int depositServiceAsync(ServiceDispatcher* dispatcher, Account* account, const char* amount, const char* description,
+                        const char* day, const char* month, const char* year, ServiceCallback callback, gpointer userData) {
+    const char* arguments[] = {amount, description, day, month, year};
+    AsyncServiceCall* call = createAsyncServiceCall(runDepositService, NULL, account, NULL, arguments, G_N_ELEMENTS(arguments));
+    return submitAsyncServiceCall(dispatcher, SERVICE_PRIORITY_INTERACTIVE, call, callback, userData);
+}
+
+int withdrawServiceAsync(ServiceDispatcher* dispatcher, Account* account, const char* amount, const char* description,
+                         const char* day, const char* month, const char* year, ServiceCallback callback, gpointer userData) {
+    const char* arguments[] = {amount, description, day, month, year};
+    AsyncServiceCall* call = createAsyncServiceCall(runWithdrawService, NULL, account, NULL, arguments, G_N_ELEMENTS(arguments));
+    return submitAsyncServiceCall(dispatcher, SERVICE_PRIORITY_INTERACTIVE, call, callback, userData);
+}
+
+int transferServiceAsync(ServiceDispatcher* dispatcher, RepositoryFormat* repository, Account* account, const char* amount,
+                         const char* description, const char* receiverIBAN, const char* day, const char* month, const char* year,
+                         ServiceCallback callback, gpointer userData) {
+    const char* arguments[] = {amount, description, receiverIBAN, day, month, year};
+    AsyncServiceCall* call = createAsyncServiceCall(runTransferService, repository, account, NULL, arguments, G_N_ELEMENTS(arguments));
+    return submitAsyncServiceCall(dispatcher, SERVICE_PRIORITY_INTERACTIVE, call, callback, userData);
+}
+
+int paymentServiceAsync(ServiceDispatcher* dispatcher, Account* account, const char* amount, const char* description,
+                        const char* day, const char* month, const char* year, ServiceCallback callback, gpointer userData) {
+    const char* arguments[] = {amount, description, day, month, year};
+    AsyncServiceCall* call = createAsyncServiceCall(runPaymentService, NULL, account, NULL, arguments, G_N_ELEMENTS(arguments));
+    return submitAsyncServiceCall(dispatcher, SERVICE_PRIORITY_INTERACTIVE, call, callback, userData);
+}
+
+int batchTransactionServiceAsync(ServiceDispatcher* dispatcher, RepositoryFormat* repository, const TransactionOperation* operations,
+                                 int operationsNumber, int* results, ServiceCallback callback, gpointer userData) {
+    AsyncServiceCall* call = createAsyncServiceCall(runBatchTransactionService, repository, NULL, NULL, NULL, 0);
+    if (call != NULL) {
+        call->operations = operations;
+        call->operationsNumber = operationsNumber;
+        call->results = results;
+    }
+    return submitAsyncServiceCall(dispatcher, SERVICE_PRIORITY_BULK, call, callback, userData);
+}
@@ -0,0 +1,422 @@
+#include "services.h"
+#include <stdlib.h>
+#include <string.h>
+
+////////////////////
+//
+//  Service dispatcher
+//
+////////////////////
+
+// Any number of threads submit service calls to a bounded queue, a pool of workers runs them and reports
+// every result through the callback of the request. The queue is a ring of sequenced cells: producers and
+// consumers each claim a position with one compare-and-swap, so none of them waits on a lock while the ring
+// is neither empty nor full. Idle workers and producers blocked on a full ring sleep on a condition.
+//
+// Every priority class has its own ring. Workers pick the class to serve by weight, so when all classes are
+// busy interactive requests get most of the turns and bulk ones still make progress. A class with nothing
+// queued gives its turn to the others, and bulk requests never occupy every worker at once: the pool always
+// has at least two workers, one of which only the other classes can use.
+
+// Turns out of DISPATCH_WEIGHTS_TOTAL given to each class, in ServicePriority order
+static const int dispatchWeights[SERVICE_PRIORITY_CLASSES] = {8, 4, 1};
+#define DISPATCH_WEIGHTS_TOTAL 13
+
+typedef struct {
+    ServiceFunction function;
+    gpointer data;
+    GDestroyNotify destroyData;
+    ServiceCallback callback;
+    gpointer userData;
+    ServicePriority priority;
+    gint64 submitTime; // Monotonic, used for the queue latency of the class
+} ServiceRequest;
+
+typedef struct {
+    gint sequence; // Position this cell expects next, tells producers and consumers whose turn it is
+    ServiceRequest* request;
+} DispatchCell;
+
+typedef struct {
+    DispatchCell* cells;
+    guint capacity; // Power of two
+    _Alignas(CACHE_LINE_SIZE) gint enqueuePosition;
+    _Alignas(CACHE_LINE_SIZE) gint dequeuePosition;
+} DispatchQueue;
+
+typedef struct {
+    gint queueDepth;
+    GMutex lock; // Guards the counters below, taken once per finished request
+    guint64 completedRequests;
+    gint64 totalWaitMicroseconds;
+    gint64 maxWaitMicroseconds;
+    gint64 totalRunMicroseconds;
+} DispatchClassStatistics;
+
+struct ServiceDispatcher {
+    DispatchQueue queues[SERVICE_PRIORITY_CLASSES];
+    DispatchClassStatistics statistics[SERVICE_PRIORITY_CLASSES];
+    DispatchBackpressure backpressure;
+    gint turn; // Position in the weighted schedule, advanced by every worker looking for a request
+    gint runningBulkRequests;
+    int maxBulkWorkers;
+    GThread** workers;
+    int workersNumber;
+    gint running;
+    gint sleepingWorkers;
+    gint blockedProducers;
+    GMutex sleepLock;
+    GCond notEmpty;
+    GCond notFull;
+};
+
+static int initDispatchQueue(DispatchQueue* queue, int capacity) {
+    guint roundedCapacity = 1;
+    while (roundedCapacity < (guint)capacity)
+        roundedCapacity <<= 1;
+
+    queue->cells = malloc(roundedCapacity * sizeof(DispatchCell));
+    if (queue->cells == NULL)
+        return 0;
+
+    for (guint i = 0; i < roundedCapacity; i++) {
+        queue->cells[i].sequence = (gint)i;
+        queue->cells[i].request = NULL;
+    }
+    queue->capacity = roundedCapacity;
+    queue->enqueuePosition = 0;
+    queue->dequeuePosition = 0;
+
+    return 1;
+}
+
+static gboolean pushDispatchQueue(DispatchQueue* queue, ServiceRequest* request) {
+    guint position = (guint)g_atomic_int_get(&queue->enqueuePosition);
+
+    while (TRUE) {
+        DispatchCell* cell = &queue->cells[position & (queue->capacity - 1)];
+        gint difference = (gint)((guint)g_atomic_int_get(&cell->sequence) - position);
+
+        if (difference == 0) {
+            if (g_atomic_int_compare_and_exchange(&queue->enqueuePosition, (gint)position, (gint)(position + 1))) {
+                cell->request = request;
+                g_atomic_int_set(&cell->sequence, (gint)(position + 1)); // Hands the cell to the consumers
+                return TRUE;
+            }
+        } else if (difference < 0) {
+            return FALSE; // The cell still holds a request from the previous lap, the ring is full
+        }
+
+        position = (guint)g_atomic_int_get(&queue->enqueuePosition);
+    }
+}
+
+static ServiceRequest* popDispatchQueue(DispatchQueue* queue) {
+    guint position = (guint)g_atomic_int_get(&queue->dequeuePosition);
+
+    while (TRUE) {
+        DispatchCell* cell = &queue->cells[position & (queue->capacity - 1)];
+        gint difference = (gint)((guint)g_atomic_int_get(&cell->sequence) - (position + 1));
+
+        if (difference == 0) {
+            if (g_atomic_int_compare_and_exchange(&queue->dequeuePosition, (gint)position, (gint)(position + 1))) {
+                ServiceRequest* request = cell->request;
+                g_atomic_int_set(&cell->sequence, (gint)(position + queue->capacity)); // Free for the next lap
+                return request;
+            }
+        } else if (difference < 0) {
+            return NULL; // Nothing was published in this cell yet, the ring is empty
+        }
+
+        position = (guint)g_atomic_int_get(&queue->dequeuePosition);
+    }
+}
+
+// Takes a request from the class whose turn it is, or from the most urgent class with work when that one
+// is empty. Bulk requests are skipped while they already run on every worker they may use.
+static ServiceRequest* takeServiceRequest(ServiceDispatcher* dispatcher, gboolean limitBulk) {
+    int turn = (int)((guint)g_atomic_int_add(&dispatcher->turn, 1) % DISPATCH_WEIGHTS_TOTAL);
+    int preferredClass = 0;
+    while (turn >= dispatchWeights[preferredClass]) {
+        turn -= dispatchWeights[preferredClass];
+        preferredClass++;
+    }
+
+    for (int attempt = -1; attempt < SERVICE_PRIORITY_CLASSES; attempt++) {
+        int priorityClass = attempt < 0 ? preferredClass : attempt;
+        if (attempt == preferredClass)
+            continue;
+
+        if (priorityClass == SERVICE_PRIORITY_BULK && limitBulk) {
+            if (g_atomic_int_add(&dispatcher->runningBulkRequests, 1) >= dispatcher->maxBulkWorkers) {
+                g_atomic_int_add(&dispatcher->runningBulkRequests, -1);
+                continue;
+            }
+        }
+
+        ServiceRequest* request = popDispatchQueue(&dispatcher->queues[priorityClass]);
+        if (request != NULL) {
+            g_atomic_int_add(&dispatcher->statistics[priorityClass].queueDepth, -1);
+            return request;
+        }
+
+        if (priorityClass == SERVICE_PRIORITY_BULK && limitBulk)
+            g_atomic_int_add(&dispatcher->runningBulkRequests, -1);
+    }
+
+    return NULL;
+}
+
+static void runServiceRequest(ServiceDispatcher* dispatcher, ServiceRequest* request, gboolean countedAsBulk) {
+    gint64 startTime = g_get_monotonic_time();
+    int result = request->function(request->data);
+    gint64 endTime = g_get_monotonic_time();
+
+    if (request->callback != NULL)
+        request->callback(result, request->userData);
+    if (request->destroyData != NULL)
+        request->destroyData(request->data);
+
+    DispatchClassStatistics* statistics = &dispatcher->statistics[request->priority];
+    gint64 waitTime = startTime - request->submitTime;
+    g_mutex_lock(&statistics->lock);
+    statistics->completedRequests++;
+    statistics->totalWaitMicroseconds += waitTime;
+    statistics->totalRunMicroseconds += endTime - startTime;
+    if (waitTime > statistics->maxWaitMicroseconds)
+        statistics->maxWaitMicroseconds = waitTime;
+    g_mutex_unlock(&statistics->lock);
+
+    if (countedAsBulk) {
+        g_atomic_int_add(&dispatcher->runningBulkRequests, -1);
+        // Queued bulk requests may have been left for this slot, a sleeping worker can take the next one
+        if (g_atomic_int_get(&dispatcher->sleepingWorkers) > 0) {
+            g_mutex_lock(&dispatcher->sleepLock);
+            g_cond_signal(&dispatcher->notEmpty);
+            g_mutex_unlock(&dispatcher->sleepLock);
+        }
+    }
+
+    free(request);
+}
+
+// Wakes the producers waiting for room, they may wait on different classes. The check is cheap when nobody waits.
+static void releaseBlockedProducers(ServiceDispatcher* dispatcher) {
+    if (g_atomic_int_get(&dispatcher->blockedProducers) == 0)
+        return;
+
+    g_mutex_lock(&dispatcher->sleepLock);
+    g_cond_broadcast(&dispatcher->notFull);
+    g_mutex_unlock(&dispatcher->sleepLock);
+}
+
+static gpointer runDispatcherWorker(gpointer data) {
+    ServiceDispatcher* dispatcher = data;
+
+    while (TRUE) {
+        ServiceRequest* request = takeServiceRequest(dispatcher, TRUE);
+        if (request != NULL) {
+            releaseBlockedProducers(dispatcher);
+            runServiceRequest(dispatcher, request, request->priority == SERVICE_PRIORITY_BULK);
+            continue;
+        }
+
+        // Registered as sleeping before the last look at the queue, so a producer publishing in between
+        // sees the sleeper and signals it
+        g_mutex_lock(&dispatcher->sleepLock);
+        g_atomic_int_inc(&dispatcher->sleepingWorkers);
+        request = takeServiceRequest(dispatcher, TRUE);
+        if (request == NULL && g_atomic_int_get(&dispatcher->running))
+            g_cond_wait(&dispatcher->notEmpty, &dispatcher->sleepLock);
+        g_atomic_int_add(&dispatcher->sleepingWorkers, -1);
+        g_mutex_unlock(&dispatcher->sleepLock);
+
+        if (request != NULL) {
+            releaseBlockedProducers(dispatcher);
+            runServiceRequest(dispatcher, request, request->priority == SERVICE_PRIORITY_BULK);
+        } else if (!g_atomic_int_get(&dispatcher->running)) {
+            // Stopped, the queues are drained before the worker leaves
+            while ((request = takeServiceRequest(dispatcher, FALSE)) != NULL)
+                runServiceRequest(dispatcher, request, FALSE);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+ServiceDispatcher* createServiceDispatcher(int workersNumber, int queueCapacity, DispatchBackpressure backpressure) {
+    if (workersNumber <= 0)
+        workersNumber = (int)g_get_num_processors();
+    // A single worker running a bulk job would leave the user waiting for it, so one more is started
+    workersNumber = MAX(workersNumber, 2);
+
+    if (queueCapacity <= 0)
+        return NULL;
+
+    // The queue positions are aligned to their own cache lines
+    ServiceDispatcher* dispatcher = allocateCacheAligned(sizeof(ServiceDispatcher));
+    if (dispatcher == NULL)
+        return NULL;
+
+    int initializedQueues = 0;
+    while (initializedQueues < SERVICE_PRIORITY_CLASSES && initDispatchQueue(&dispatcher->queues[initializedQueues], queueCapacity))
+        initializedQueues++;
+
+    dispatcher->workers = malloc(workersNumber * sizeof(GThread*));
+    if (dispatcher->workers == NULL || initializedQueues < SERVICE_PRIORITY_CLASSES) {
+        for (int i = 0; i < initializedQueues; i++)
+            free(dispatcher->queues[i].cells);
+        free(dispatcher->workers);
+        freeCacheAligned(dispatcher);
+        return NULL;
+    }
+
+    for (int i = 0; i < SERVICE_PRIORITY_CLASSES; i++) {
+        DispatchClassStatistics* statistics = &dispatcher->statistics[i];
+        statistics->queueDepth = 0;
+        statistics->completedRequests = 0;
+        statistics->totalWaitMicroseconds = 0;
+        statistics->maxWaitMicroseconds = 0;
+        statistics->totalRunMicroseconds = 0;
+        g_mutex_init(&statistics->lock);
+    }
+
+    dispatcher->backpressure = backpressure;
+    dispatcher->workersNumber = workersNumber;
+    dispatcher->turn = 0;
+    dispatcher->runningBulkRequests = 0;
+    dispatcher->maxBulkWorkers = workersNumber - 1; // One worker stays free for the other classes
+    dispatcher->running = 1;
+    dispatcher->sleepingWorkers = 0;
+    dispatcher->blockedProducers = 0;
+    g_mutex_init(&dispatcher->sleepLock);
+    g_cond_init(&dispatcher->notEmpty);
+    g_cond_init(&dispatcher->notFull);
+
+    for (int i = 0; i < workersNumber; i++)
+        dispatcher->workers[i] = g_thread_new("service-worker", runDispatcherWorker, dispatcher);
+
+    return dispatcher;
+}
+
+void destroyServiceDispatcher(ServiceDispatcher* dispatcher) {
+    if (dispatcher == NULL)
+        return;
+
+    // Requests already queued still run, new ones and blocked producers are turned away
+    g_mutex_lock(&dispatcher->sleepLock);
+    g_atomic_int_set(&dispatcher->running, 0);
+    g_cond_broadcast(&dispatcher->notEmpty);
+    g_cond_broadcast(&dispatcher->notFull);
+    g_mutex_unlock(&dispatcher->sleepLock);
+
+    for (int i = 0; i < dispatcher->workersNumber; i++)
+        g_thread_join(dispatcher->workers[i]);
+
+    // A producer that passed the running check just before the stop may have queued after the workers left
+    ServiceRequest* request;
+    while ((request = takeServiceRequest(dispatcher, FALSE)) != NULL)
+        runServiceRequest(dispatcher, request, FALSE);
+
+    for (int i = 0; i < SERVICE_PRIORITY_CLASSES; i++) {
+        g_mutex_clear(&dispatcher->statistics[i].lock);
+        free(dispatcher->queues[i].cells);
+    }
+    g_cond_clear(&dispatcher->notFull);
+    g_cond_clear(&dispatcher->notEmpty);
+    g_mutex_clear(&dispatcher->sleepLock);
+    free(dispatcher->workers);
+    freeCacheAligned(dispatcher);
+}
+
+int submitServiceRequest(ServiceDispatcher* dispatcher, ServicePriority priority, ServiceFunction function, gpointer data,
+                         GDestroyNotify destroyData, ServiceCallback callback, gpointer userData) {
+    if (dispatcher == NULL)
+        return -461; // Invalid dispatcher
+
+    if (function == NULL)
+        return -462; // Missing service function
+
+    if (priority < SERVICE_PRIORITY_INTERACTIVE || priority > SERVICE_PRIORITY_BULK)
+        return -466; // Unknown priority class
+
+    if (!g_atomic_int_get(&dispatcher->running))
+        return -464; // The dispatcher is stopped
+
+    ServiceRequest* request = malloc(sizeof(ServiceRequest));
+    if (request == NULL)
+        return -465; // Memory allocation failed
+
+    request->function = function;
+    request->data = data;
+    request->destroyData = destroyData;
+    request->callback = callback;
+    request->userData = userData;
+    request->priority = priority;
+    request->submitTime = g_get_monotonic_time();
+
+    // Counted before the push, a worker may take the request as soon as it is published
+    DispatchQueue* queue = &dispatcher->queues[priority];
+    g_atomic_int_inc(&dispatcher->statistics[priority].queueDepth);
+
+    while (!pushDispatchQueue(queue, request)) {
+        if (dispatcher->backpressure == DISPATCH_REJECT_WHEN_FULL) {
+            g_atomic_int_add(&dispatcher->statistics[priority].queueDepth, -1);
+            free(request);
+            return -463; // The queue is full, try again later
+        }
+
+        // Same registration order as the workers, a worker freeing a cell meanwhile sees the waiting producer
+        g_mutex_lock(&dispatcher->sleepLock);
+        g_atomic_int_inc(&dispatcher->blockedProducers);
+        gboolean queued = pushDispatchQueue(queue, request);
+        if (!queued && g_atomic_int_get(&dispatcher->running))
+            g_cond_wait(&dispatcher->notFull, &dispatcher->sleepLock);
+        g_atomic_int_add(&dispatcher->blockedProducers, -1);
+        g_mutex_unlock(&dispatcher->sleepLock);
+
+        if (queued)
+            break;
+        if (!g_atomic_int_get(&dispatcher->running)) {
+            g_atomic_int_add(&dispatcher->statistics[priority].queueDepth, -1);
+            free(request);
+            return -464; // The dispatcher is stopped
+        }
+    }
+
+    if (g_atomic_int_get(&dispatcher->sleepingWorkers) > 0) {
+        g_mutex_lock(&dispatcher->sleepLock);
+        g_cond_signal(&dispatcher->notEmpty);
+        g_mutex_unlock(&dispatcher->sleepLock);
+    }
+
+    return 1;
+}
+
+int getServiceDispatcherMetrics(ServiceDispatcher* dispatcher, ServicePriority priority, DispatchClassMetrics* metrics) {
+    if (dispatcher == NULL)
+        return -461; // Invalid dispatcher
+
+    if (priority < SERVICE_PRIORITY_INTERACTIVE || priority > SERVICE_PRIORITY_BULK)
+        return -466; // Unknown priority class
+
+    if (metrics == NULL)
+        return -467; // Missing metrics output
+
+    DispatchClassStatistics* statistics = &dispatcher->statistics[priority];
+    metrics->queueDepth = g_atomic_int_get(&statistics->queueDepth);
+
+    g_mutex_lock(&statistics->lock);
+    metrics->completedRequests = statistics->completedRequests;
+    metrics->maxWaitMicroseconds = statistics->maxWaitMicroseconds;
+    metrics->averageWaitMicroseconds = 0;
+    metrics->averageRunMicroseconds = 0;
+    if (statistics->completedRequests > 0) {
+        metrics->averageWaitMicroseconds = statistics->totalWaitMicroseconds / (gint64)statistics->completedRequests;
+        metrics->averageRunMicroseconds = statistics->totalRunMicroseconds / (gint64)statistics->completedRequests;
+    }
+    g_mutex_unlock(&statistics->lock);
+
+    return 1;
+}
@@ -0,0 +1,340 @@
+#include "services.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+////////////////////
+//
+//  Idempotency keys
+//
+////////////////////
+
+// A client may name a transaction request with a key of its own and send it again after a timeout or a
+// reconnect: the first request with a key runs, the others get its result back without running. Keys belong
+// to the account they were used on, two accounts may use the same one. The cache remembers the keys of a time
+// window in a hash set, bounded by a ring in arrival order, so the oldest key is the one forgotten first.
+// A duplicate that arrives while the first request still runs waits for its result.
+//
+// Finished keys are appended to a journal, loaded again when the cache is created, so a restart doesn't
+// open a window for double applied retries. Every record is
+//   u8 nameLength | name | i32 result | i64 storedAt
+// in the byte order of the machine, the file is only read back by the process that wrote it. The journal is
+// rewritten with the keys still in the window when it reached twice the capacity of the cache.
+
+#define IDEMPOTENCY_NAME_SIZE 128 // IBAN, separator and key
+
+typedef struct {
+    char name[IDEMPOTENCY_NAME_SIZE]; // IBAN of the account, '/' and the key, so keys are per account
+    int result;
+    gint64 storedAt;                  // Wall clock microseconds, still meaningful after a restart
+    short pending;                    // The first request with the key is still running
+} IdempotencyEntry;
+
+struct IdempotencyCache {
+    GMutex lock;
+    GCond finished;
+    GHashTable* entries;        // Name -> IdempotencyEntry, the key is the name stored in the entry
+    IdempotencyEntry** order;   // Ring in arrival order
+    int first, entriesNumber, capacity;
+    gint64 window;              // Microseconds
+    gchar* journalPath;
+    FILE* journal;
+    int journalRecords;
+};
+
+static int buildIdempotencyName(const Account* account, const char* key, char* name) {
+    if (key == NULL || key[0] == '\0')
+        return 0;
+
+    size_t keyLength = strlen(key);
+    if (keyLength > IDEMPOTENCY_KEY_MAX_LENGTH)
+        return 0;
+
+    const char* iban = getAccountIban(account);
+    size_t ibanLength = iban != NULL ? strlen(iban) : 0;
+    if (ibanLength + 1 + keyLength >= IDEMPOTENCY_NAME_SIZE)
+        return 0;
+
+    memcpy(name, iban, ibanLength);
+    name[ibanLength] = '/';
+    memcpy(name + ibanLength + 1, key, keyLength + 1);
+    return 1;
+}
+
+static int writeIdempotencyRecord(FILE* journal, const IdempotencyEntry* entry) {
+    guint8 nameLength = (guint8)strlen(entry->name);
+
+    return fwrite(&nameLength, sizeof(nameLength), 1, journal) == 1 &&
+           fwrite(entry->name, 1, nameLength, journal) == nameLength &&
+           fwrite(&entry->result, sizeof(entry->result), 1, journal) == 1 &&
+           fwrite(&entry->storedAt, sizeof(entry->storedAt), 1, journal) == 1;
+}
+
+static int readIdempotencyRecord(FILE* journal, IdempotencyEntry* entry) {
+    guint8 nameLength;
+
+    if (fread(&nameLength, sizeof(nameLength), 1, journal) != 1 || nameLength >= IDEMPOTENCY_NAME_SIZE ||
+        fread(entry->name, 1, nameLength, journal) != nameLength ||
+        fread(&entry->result, sizeof(entry->result), 1, journal) != 1 ||
+        fread(&entry->storedAt, sizeof(entry->storedAt), 1, journal) != 1)
+        return 0;
+
+    entry->name[nameLength] = '\0';
+    entry->pending = 0;
+    return 1;
+}
+
+// The entry at the head of the ring leaves the cache, expects the caller to hold the lock
+static void forgetOldestEntry(IdempotencyCache* cache) {
+    IdempotencyEntry* entry = cache->order[cache->first];
+
+    cache->order[cache->first] = NULL;
+    cache->first = (cache->first + 1) % cache->capacity;
+    cache->entriesNumber--;
+    g_hash_table_remove(cache->entries, entry->name);
+}
+
+// Makes room for one more key: keys out of the window go first, then the oldest one when the ring is full.
+// A running request is never forgotten, so it can't run twice. Expects the caller to hold the lock.
+static int makeRoomForEntry(IdempotencyCache* cache, gint64 now) {
+    while (cache->entriesNumber > 0) {
+        IdempotencyEntry* oldest = cache->order[cache->first];
+        if (oldest->pending || now - oldest->storedAt < cache->window)
+            break;
+        forgetOldestEntry(cache);
+    }
+
+    if (cache->entriesNumber < cache->capacity)
+        return 1;
+
+    if (cache->order[cache->first]->pending)
+        return 0;
+
+    forgetOldestEntry(cache);
+    return 1;
+}
+
+static void insertEntry(IdempotencyCache* cache, IdempotencyEntry* entry) {
+    IdempotencyEntry* previous = g_hash_table_lookup(cache->entries, entry->name);
+    if (previous != NULL) {
+        // Only happens while loading, the journal may hold a key twice before it is rewritten
+        previous->result = entry->result;
+        free(entry);
+        return;
+    }
+
+    cache->order[(cache->first + cache->entriesNumber) % cache->capacity] = entry;
+    cache->entriesNumber++;
+    g_hash_table_insert(cache->entries, entry->name, entry);
+}
+
+// Rewrites the journal with the finished keys of the cache and leaves it open for appending. A new file
+// replaces the old one by renaming, so a crash leaves one of them whole. Expects the caller to hold the lock.
+// Put the rewritten journal in place of the old one. rename() replaces an existing file on POSIX, on Windows it
+// fails when the target exists, so the old journal goes first there. A crash between the two steps leaves only
+// the new journal, which loadIdempotencyJournal picks up.
+static int replaceIdempotencyJournal(const char* temporaryPath, const char* journalPath) {
+#ifdef _WIN32
+    remove(journalPath);
+#endif
+    return rename(temporaryPath, journalPath) == 0;
+}
+
+static int rewriteIdempotencyJournal(IdempotencyCache* cache) {
+    if (cache->journal != NULL) {
+        fclose(cache->journal);
+        cache->journal = NULL;
+    }
+
+    gchar* temporaryPath = g_strconcat(cache->journalPath, ".new", NULL);
+    FILE* journal = fopen(temporaryPath, "wb");
+    int written = journal != NULL;
+    int records = 0;
+
+    for (int i = 0; written && i < cache->entriesNumber; i++) {
+        const IdempotencyEntry* entry = cache->order[(cache->first + i) % cache->capacity];
+        if (entry->pending)
+            continue;
+        written = writeIdempotencyRecord(journal, entry);
+        records++;
+    }
+
+    if (journal != NULL && fclose(journal) != 0)
+        written = 0;
+    if (written && !replaceIdempotencyJournal(temporaryPath, cache->journalPath))
+        written = 0;
+    if (!written)
+        remove(temporaryPath);
+    g_free(temporaryPath);
+
+    cache->journal = fopen(cache->journalPath, "ab");
+    cache->journalRecords = written ? records : cache->journalRecords;
+    return written && cache->journal != NULL;
+}
+
+static void loadIdempotencyJournal(IdempotencyCache* cache) {
+    FILE* journal = fopen(cache->journalPath, "rb");
+    if (journal == NULL) {
+        // Only the new journal is left when the last rewrite stopped right after removing the old one
+        gchar* temporaryPath = g_strconcat(cache->journalPath, ".new", NULL);
+        if (replaceIdempotencyJournal(temporaryPath, cache->journalPath))
+            journal = fopen(cache->journalPath, "rb");
+        g_free(temporaryPath);
+    }
+    if (journal == NULL)
+        return;
+
+    gint64 now = g_get_real_time();
+    IdempotencyEntry record;
+
+    // A record cut short by a crash ends the journal, everything before it is kept
+    while (readIdempotencyRecord(journal, &record)) {
+        if (now - record.storedAt >= cache->window || !makeRoomForEntry(cache, now))
+            continue;
+
+        IdempotencyEntry* entry = malloc(sizeof(IdempotencyEntry));
+        if (entry == NULL)
+            break;
+        *entry = record;
+        insertEntry(cache, entry);
+    }
+
+    fclose(journal);
+}
+
+IdempotencyCache* createIdempotencyCache(int capacity, int windowSeconds, const char* journalPath) {
+    if (capacity <= 0 || windowSeconds <= 0)
+        return NULL;
+
+    IdempotencyCache* cache = calloc(1, sizeof(IdempotencyCache));
+    if (cache == NULL)
+        return NULL;
+
+    cache->order = calloc(capacity, sizeof(IdempotencyEntry*));
+    if (cache->order == NULL) {
+        free(cache);
+        return NULL;
+    }
+
+    g_mutex_init(&cache->lock);
+    g_cond_init(&cache->finished);
+    cache->entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free);
+    cache->capacity = capacity;
+    cache->window = (gint64)windowSeconds * G_USEC_PER_SEC;
+
+    if (journalPath != NULL) {
+        cache->journalPath = g_strdup(journalPath);
+        loadIdempotencyJournal(cache);
+        // Without a journal the cache still works, it just forgets the keys on restart
+        rewriteIdempotencyJournal(cache);
+    }
+
+    return cache;
+}
+
+void destroyIdempotencyCache(IdempotencyCache* cache) {
+    if (cache == NULL)
+        return;
+
+    if (cache->journal != NULL)
+        fclose(cache->journal);
+    g_free(cache->journalPath);
+    g_hash_table_destroy(cache->entries);
+    free(cache->order);
+    g_cond_clear(&cache->finished);
+    g_mutex_clear(&cache->lock);
+    free(cache);
+}
+
+int beginIdempotentRequest(IdempotencyCache* cache, const Account* account, const char* key, int* result) {
+    if (cache == NULL)
+        return -481; // Idempotency cache not initialized
+
+    if (account == NULL || result == NULL)
+        return -482; // Invalid account
+
+    char name[IDEMPOTENCY_NAME_SIZE];
+    if (!buildIdempotencyName(account, key, name))
+        return -483; // Invalid idempotency key
+
+    g_mutex_lock(&cache->lock);
+
+    IdempotencyEntry* entry = g_hash_table_lookup(cache->entries, name);
+    if (entry != NULL) {
+        // The entry can't be forgotten while it is pending, so it is still the same one when the wait ends
+        while (entry->pending)
+            g_cond_wait(&cache->finished, &cache->lock);
+
+        *result = entry->result;
+        g_mutex_unlock(&cache->lock);
+        return 0;
+    }
+
+    if (!makeRoomForEntry(cache, g_get_real_time())) {
+        g_mutex_unlock(&cache->lock);
+        return -485; // Too many requests with a key are running
+    }
+
+    entry = malloc(sizeof(IdempotencyEntry));
+    if (entry == NULL) {
+        g_mutex_unlock(&cache->lock);
+        return -484; // Memory allocation failed
+    }
+
+    strcpy(entry->name, name);
+    entry->result = 0;
+    entry->storedAt = g_get_real_time();
+    entry->pending = 1;
+    insertEntry(cache, entry);
+
+    g_mutex_unlock(&cache->lock);
+    return 1;
+}
+
+int finishIdempotentRequest(IdempotencyCache* cache, const Account* account, const char* key, int result) {
+    if (cache == NULL)
+        return -481; // Idempotency cache not initialized
+
+    if (account == NULL)
+        return -482; // Invalid account
+
+    char name[IDEMPOTENCY_NAME_SIZE];
+    if (!buildIdempotencyName(account, key, name))
+        return -483; // Invalid idempotency key
+
+    g_mutex_lock(&cache->lock);
+
+    IdempotencyEntry* entry = g_hash_table_lookup(cache->entries, name);
+    if (entry == NULL || !entry->pending) {
+        g_mutex_unlock(&cache->lock);
+        return -486; // No running request with this key
+    }
+
+    entry->result = result;
+    entry->storedAt = g_get_real_time();
+    entry->pending = 0;
+    g_cond_broadcast(&cache->finished);
+
+    if (cache->journal != NULL) {
+        if (writeIdempotencyRecord(cache->journal, entry) && fflush(cache->journal) == 0)
+            cache->journalRecords++;
+        if (cache->journalRecords >= 2 * cache->capacity)
+            rewriteIdempotencyJournal(cache);
+    }
+
+    g_mutex_unlock(&cache->lock);
+    return 1;
+}
+
+int transactionServiceIdempotent(IdempotencyCache* cache, const char* idempotencyKey, RepositoryFormat* repository, Account* account,
+                                 TransactionKind kind, MoneyAmount amount, const char* description, const char* receiverIBAN,
+                                 PackedDate date) {
+    int result;
+    int status = beginIdempotentRequest(cache, account, idempotencyKey, &result);
+    if (status != 1)
+        return status == 0 ? result : status;
+
+    result = transactionServiceTyped(repository, account, kind, amount, description, receiverIBAN, date);
+    finishIdempotentRequest(cache, account, idempotencyKey, result);
+    return result;
+}
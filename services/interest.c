@@ -0,0 +1,306 @@
+#include "services.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+////////////////////
+//
+//  Interest and fee job
+//
+////////////////////
+
+// Posts the monthly interest of savings sub-accounts and the fees of checking and credit sub-accounts. Every
+// sub-account of an account follows the terms of its own type and is posted on its own balance, the main balance
+// and its history are left alone. The job works on a snapshot of the repository taken when it starts, so an
+// account deleted meanwhile doesn't shift the others out of their chunks; a deleted account is skipped. The
+// accounts are split in chunks handed out by a work stealing pool: every worker starts with its own share of the
+// snapshot and takes chunks from its front, a worker that runs out steals the back half of the largest share left.
+//
+// The job can be stopped and run again for the same posting date. The cursor file keeps one byte per chunk,
+// set once the chunk is done, after a header naming the run:
+//   u32 magic | u32 posting date | i32 chunk size | i32 chunks number
+// Every sub-account remembers the posting date of the latest interest and fee booked on it, so a sub-account
+// already posted for that date is skipped, which covers the chunk that was interrupted halfway and accounts that
+// moved to another chunk since a previous run. One run at a time may post a date.
+
+#define INTEREST_JOB_CHUNK_SIZE 4096
+#define INTEREST_JOB_CURSOR_MAGIC 0x47424931u // "GBI1"
+
+// Terms of every account type, one row per type an account can be opened with
+typedef struct {
+    const char* accountType;
+    int annualRateBasisPoints; // Interest paid every month on the sub-account balance, a twelfth of the yearly rate
+    MoneyAmount monthlyFee;
+} AccountTypeTerms;
+
+static const AccountTypeTerms accountTypeTerms[] = {
+    {"savings",  250, 0},
+    {"checking", 0,   2 * MONEY_CENTS},
+    {"credit",   0,   5 * MONEY_CENTS},
+};
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) GMutex lock; // Taken by the owner and by thieves, shares are on lines of their own
+    int next, end;                         // Chunks left in the share, the owner takes from next, thieves from end
+} InterestJobShare;
+
+typedef struct {
+    Account** accounts;        // Snapshot of the repository, every account held until the job ends
+    PackedDate postingDate;
+    int accountsNumber, chunksNumber;
+    InterestJobShare* shares;
+    int workersNumber;
+    unsigned char* doneChunks; // Loaded from the cursor, chunks finished by a previous run
+    FILE* cursor;
+    GMutex cursorLock;         // The workers share the position of the cursor file
+    short cursorFinished;      // Every chunk is done, the cursor is removed once closed
+    const gint* stopRequested;
+    InterestJobSummary summary;
+    GMutex summaryLock;
+} InterestJob;
+
+typedef struct {
+    InterestJob* job;
+    int index;
+} InterestJobWorker;
+
+static const AccountTypeTerms* getUserAccountTerms(const UserAccounts* userAccount) {
+    const char* type = getUserAccountType(userAccount);
+    for (size_t i = 0; type != NULL && i < G_N_ELEMENTS(accountTypeTerms); i++) {
+        if (strcmp(accountTypeTerms[i].accountType, type) == 0)
+            return &accountTypeTerms[i];
+    }
+    return NULL;
+}
+
+// Rounded to the nearest cent, a balance too small to earn one gets nothing
+static MoneyAmount getUserAccountCents(const UserAccounts* userAccount) {
+    double balance = (double)getUserAccountBalance(userAccount) * MONEY_CENTS;
+    return (MoneyAmount)(balance < 0 ? balance - 0.5 : balance + 0.5);
+}
+
+static void postUserAccountTerms(InterestJob* job, UserAccounts* userAccount, InterestJobSummary* summary) {
+    const AccountTypeTerms* terms = getUserAccountTerms(userAccount);
+    if (terms == NULL)
+        return;
+
+    if (terms->annualRateBasisPoints > 0 && userAccount->interestPostedOn < job->postingDate) {
+        MoneyAmount balance = getUserAccountCents(userAccount);
+        MoneyAmount interest = balance > 0 ? (balance * terms->annualRateBasisPoints + 60000) / 120000 : 0;
+        if (interest > 0) {
+            setUserAccountBalance(userAccount, (float)((double)(balance + interest) / MONEY_CENTS));
+            summary->interestPosted++;
+            summary->interestAmount += interest;
+        }
+        userAccount->interestPostedOn = job->postingDate;
+    }
+
+    if (terms->monthlyFee > 0 && userAccount->feeChargedOn < job->postingDate) {
+        MoneyAmount balance = getUserAccountCents(userAccount);
+        if (balance >= terms->monthlyFee) {
+            setUserAccountBalance(userAccount, (float)((double)(balance - terms->monthlyFee) / MONEY_CENTS));
+            summary->feesCharged++;
+            summary->feesAmount += terms->monthlyFee;
+        } else {
+            summary->feesSkipped++; // The balance is lower than the fee, it isn't asked again for this month
+        }
+        userAccount->feeChargedOn = job->postingDate;
+    }
+}
+
+// All the sub-accounts of the account are posted under one hold of its lock
+static void postAccountTerms(InterestJob* job, Account* account, InterestJobSummary* summary) {
+    summary->accountsVisited++;
+
+    lockAccount(account);
+    for (int i = 0; !isAccountClosed(account) && i < account->userAccountsNumber; i++)
+        postUserAccountTerms(job, account->userAccounts[i], summary);
+    unlockAccount(account);
+}
+
+// Next chunk of the worker: from the front of its own share, or the back half of the largest other share
+static int takeInterestJobChunk(InterestJob* job, int workerIndex) {
+    InterestJobShare* own = &job->shares[workerIndex];
+
+    g_mutex_lock(&own->lock);
+    int chunk = own->next < own->end ? own->next++ : -1;
+    g_mutex_unlock(&own->lock);
+    if (chunk >= 0)
+        return chunk;
+
+    while (TRUE) {
+        // The sizes are read without the locks, a stale one only makes the choice of victim worse
+        int victimIndex = -1, victimLeft = 0;
+        for (int i = 0; i < job->workersNumber; i++) {
+            int left = job->shares[i].end - job->shares[i].next;
+            if (i != workerIndex && left > victimLeft) {
+                victimIndex = i;
+                victimLeft = left;
+            }
+        }
+        if (victimIndex < 0)
+            return -1;
+
+        InterestJobShare* victim = &job->shares[victimIndex];
+        int stolenStart = -1, stolenEnd = -1;
+        g_mutex_lock(&victim->lock);
+        if (victim->next < victim->end) {
+            stolenStart = victim->end - (victim->end - victim->next + 1) / 2;
+            stolenEnd = victim->end;
+            victim->end = stolenStart;
+        }
+        g_mutex_unlock(&victim->lock);
+
+        if (stolenStart < 0)
+            continue; // Emptied meanwhile, look again
+
+        g_mutex_lock(&own->lock);
+        own->next = stolenStart + 1;
+        own->end = stolenEnd;
+        g_mutex_unlock(&own->lock);
+        return stolenStart;
+    }
+}
+
+// Sets the byte of the chunk, flushed right away so a crash loses at most the chunks still running
+static int markInterestJobChunkDone(InterestJob* job, int chunk) {
+    const unsigned char done = 1;
+    g_mutex_lock(&job->cursorLock);
+    int written = fseek(job->cursor, (long)(4 * sizeof(guint32)) + chunk, SEEK_SET) == 0 &&
+                  fwrite(&done, 1, 1, job->cursor) == 1 && fflush(job->cursor) == 0;
+    g_mutex_unlock(&job->cursorLock);
+    return written;
+}
+
+static gpointer runInterestJobWorker(gpointer data) {
+    InterestJobWorker* worker = data;
+    InterestJob* job = worker->job;
+    InterestJobSummary summary = {0};
+
+    int chunk;
+    while ((job->stopRequested == NULL || !g_atomic_int_get(job->stopRequested)) &&
+           (chunk = takeInterestJobChunk(job, worker->index)) >= 0) {
+        if (job->doneChunks != NULL && job->doneChunks[chunk])
+            continue;
+
+        int first = chunk * INTEREST_JOB_CHUNK_SIZE;
+        int last = MIN(first + INTEREST_JOB_CHUNK_SIZE, job->accountsNumber);
+        for (int i = first; i < last; i++)
+            postAccountTerms(job, job->accounts[i], &summary);
+
+        summary.chunksDone++;
+        if (job->cursor != NULL && !markInterestJobChunkDone(job, chunk))
+            summary.cursorErrors++;
+    }
+
+    g_mutex_lock(&job->summaryLock);
+    job->summary.accountsVisited += summary.accountsVisited;
+    job->summary.interestPosted += summary.interestPosted;
+    job->summary.interestAmount += summary.interestAmount;
+    job->summary.feesCharged += summary.feesCharged;
+    job->summary.feesAmount += summary.feesAmount;
+    job->summary.feesSkipped += summary.feesSkipped;
+    job->summary.chunksDone += summary.chunksDone;
+    job->summary.cursorErrors += summary.cursorErrors;
+    g_mutex_unlock(&job->summaryLock);
+
+    return NULL;
+}
+
+// Opens the cursor of the run and reads the chunks a previous run of the same date finished. A cursor of another
+// run, or one that doesn't match the repository anymore, is started over.
+static int openInterestJobCursor(InterestJob* job, const char* cursorPath) {
+    guint32 header[4];
+    guint32 expectedHeader[4] = {INTEREST_JOB_CURSOR_MAGIC, job->postingDate, INTEREST_JOB_CHUNK_SIZE, (guint32)job->chunksNumber};
+    job->doneChunks = calloc(job->chunksNumber + 1, 1);
+    if (job->doneChunks == NULL)
+        return 0;
+
+    job->cursor = fopen(cursorPath, "r+b");
+    if (job->cursor != NULL && fread(header, sizeof(header), 1, job->cursor) == 1 &&
+        memcmp(header, expectedHeader, sizeof(header)) == 0 &&
+        fread(job->doneChunks, 1, job->chunksNumber, job->cursor) == (size_t)job->chunksNumber)
+        return 1;
+
+    // Missing, of another run or cut short: written again from scratch
+    if (job->cursor != NULL)
+        fclose(job->cursor);
+    memset(job->doneChunks, 0, job->chunksNumber);
+    job->cursor = fopen(cursorPath, "w+b");
+    return job->cursor != NULL && fwrite(expectedHeader, sizeof(expectedHeader), 1, job->cursor) == 1 &&
+           fwrite(job->doneChunks, 1, job->chunksNumber, job->cursor) == (size_t)job->chunksNumber && fflush(job->cursor) == 0;
+}
+
+
+int runInterestJob(RepositoryFormat* repository, PackedDate postingDate, const InterestJobOptions* options, InterestJobSummary* summary) {
+    if (repository == NULL)
+        return -571; // Invalid repository
+
+    int workersNumber = options != NULL && options->workersNumber > 0 ? options->workersNumber : (int)g_get_num_processors();
+
+    InterestJob job = {0};
+    job.accounts = getRepositorySnapshot(repository, &job.accountsNumber);
+    job.postingDate = postingDate;
+    job.chunksNumber = (job.accountsNumber + INTEREST_JOB_CHUNK_SIZE - 1) / INTEREST_JOB_CHUNK_SIZE;
+    job.workersNumber = MAX(1, MIN(workersNumber, job.chunksNumber));
+    job.stopRequested = options != NULL ? options->stopRequested : NULL;
+    g_mutex_init(&job.summaryLock);
+    g_mutex_init(&job.cursorLock);
+
+    int result = 1;
+    if (job.accounts == NULL)
+        result = -573; // Memory allocation failed
+    else if (options != NULL && options->cursorPath != NULL && !openInterestJobCursor(&job, options->cursorPath))
+        result = -572; // The cursor file can't be used
+
+    job.shares = result == 1 ? allocateCacheAligned(job.workersNumber * sizeof(InterestJobShare)) : NULL;
+    InterestJobWorker* workers = result == 1 ? calloc(job.workersNumber, sizeof(InterestJobWorker)) : NULL;
+    GThread** threads = result == 1 ? calloc(job.workersNumber, sizeof(GThread*)) : NULL;
+    if (result == 1 && (job.shares == NULL || workers == NULL || threads == NULL))
+        result = -573; // Memory allocation failed
+
+    if (result == 1) {
+        for (int i = 0; i < job.workersNumber; i++) {
+            g_mutex_init(&job.shares[i].lock);
+            job.shares[i].next = (int)((gint64)job.chunksNumber * i / job.workersNumber);
+            job.shares[i].end = (int)((gint64)job.chunksNumber * (i + 1) / job.workersNumber);
+            workers[i] = (InterestJobWorker){&job, i};
+        }
+
+        for (int i = 0; i < job.workersNumber; i++)
+            threads[i] = g_thread_new("interest-job", runInterestJobWorker, &workers[i]);
+        for (int i = 0; i < job.workersNumber; i++)
+            g_thread_join(threads[i]);
+
+        for (int i = 0; i < job.workersNumber; i++)
+            g_mutex_clear(&job.shares[i].lock);
+
+        int alreadyDone = 0;
+        for (int i = 0; job.doneChunks != NULL && i < job.chunksNumber; i++)
+            alreadyDone += job.doneChunks[i];
+
+        if (job.summary.chunksDone + alreadyDone < job.chunksNumber)
+            result = 0; // Stopped, the next run with the same date goes on from the cursor
+        else if (options != NULL && options->cursorPath != NULL)
+            job.cursorFinished = 1;
+    }
+
+    if (job.cursor != NULL)
+        fclose(job.cursor);
+    // Removed once closed, Windows doesn't delete a file that is still open
+    if (job.cursorFinished)
+        remove(options->cursorPath);
+    for (int i = 0; job.accounts != NULL && i < job.accountsNumber; i++)
+        releaseAccount(job.accounts[i]);
+    free(job.accounts);
+    free(job.doneChunks);
+    freeCacheAligned(job.shares);
+    free(workers);
+    free(threads);
+    g_mutex_clear(&job.summaryLock);
+    g_mutex_clear(&job.cursorLock);
+
+    if (summary != NULL)
+        *summary = job.summary;
+    return result;
+}
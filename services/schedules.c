@@ -0,0 +1,400 @@
+#include "services.h"
+#include <stdlib.h>
+#include <string.h>
+
+////////////////////
+//
+//  Scheduled payments
+//
+////////////////////
+
+// Standing orders from an account to one of its affiliates, paid every day, week or month. The schedules wait
+// in a min-heap ordered by their next date, so a run only looks at the top of the heap and touches the payments
+// that are due, however many schedules exist. Due payments are taken off the heap in chunks, paid as transfers
+// through the batch service and put back with their following date. A run after a pause pays every missed
+// date in order, each one dated on the day it was due, or on the latest transaction of the account when its
+// history already went past that day.
+//
+// Every payment holds its account until it is released, so a run can pay it outside the lock of the scheduler
+// while the account is being deleted. The payments of a deleted account are dropped by the next run.
+
+#define SCHEDULE_BATCH_SIZE 1024
+
+typedef struct {
+    guint64 id;
+    Account* account;      // Held by the payment
+    char* receiverIBAN;    // Copied from the affiliate when the payment was scheduled
+    char* description;
+    MoneyAmount amount;
+    ScheduleFrequency frequency;
+    short anchorDay;       // Day monthly payments fall on, the last day of shorter months
+    PackedDate nextDate;
+    int heapIndex;         // -1 while the payment is being run
+    short cancelled;       // Cancelled while it was being run, released once the run is over
+    int lastResult;        // Result of the latest payment, 0 before the first one
+} ScheduledPayment;
+
+struct PaymentScheduler {
+    GMutex lock;
+    GMutex runLock;        // Only one run at a time, the dates of an account have to stay in order
+    ScheduledPayment** heap;
+    int heapSize, heapCapacity;
+    int runningNumber;     // Payments a run took off the heap, they need their place back
+    GHashTable* payments;  // Id -> ScheduledPayment, the key is the id stored in the payment
+    guint64 lastId;
+};
+
+static void destroyScheduledPayment(ScheduledPayment* payment) {
+    if (payment == NULL)
+        return;
+
+    releaseAccount(payment->account);
+    free(payment->receiverIBAN);
+    free(payment->description);
+    free(payment);
+}
+
+// Payments due on the same day run in the order they were scheduled
+static short paymentBefore(const ScheduledPayment* first, const ScheduledPayment* second) {
+    if (first->nextDate != second->nextDate)
+        return first->nextDate < second->nextDate;
+    return first->id < second->id;
+}
+
+static void placeInHeap(PaymentScheduler* scheduler, ScheduledPayment* payment, int index) {
+    scheduler->heap[index] = payment;
+    payment->heapIndex = index;
+}
+
+static void siftUp(PaymentScheduler* scheduler, int index) {
+    ScheduledPayment* payment = scheduler->heap[index];
+
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (!paymentBefore(payment, scheduler->heap[parent]))
+            break;
+        placeInHeap(scheduler, scheduler->heap[parent], index);
+        index = parent;
+    }
+
+    placeInHeap(scheduler, payment, index);
+}
+
+static void siftDown(PaymentScheduler* scheduler, int index) {
+    ScheduledPayment* payment = scheduler->heap[index];
+
+    while (TRUE) {
+        int child = 2 * index + 1;
+        if (child >= scheduler->heapSize)
+            break;
+        if (child + 1 < scheduler->heapSize && paymentBefore(scheduler->heap[child + 1], scheduler->heap[child]))
+            child++;
+        if (!paymentBefore(scheduler->heap[child], payment))
+            break;
+        placeInHeap(scheduler, scheduler->heap[child], index);
+        index = child;
+    }
+
+    placeInHeap(scheduler, payment, index);
+}
+
+// Expects the caller to hold the lock and the heap to have room
+static void pushPayment(PaymentScheduler* scheduler, ScheduledPayment* payment) {
+    scheduler->heap[scheduler->heapSize] = payment;
+    siftUp(scheduler, scheduler->heapSize++);
+}
+
+// Takes a payment out of any place of the heap, expects the caller to hold the lock
+static void removePayment(PaymentScheduler* scheduler, ScheduledPayment* payment) {
+    int index = payment->heapIndex;
+    ScheduledPayment* last = scheduler->heap[--scheduler->heapSize];
+    payment->heapIndex = -1;
+
+    if (index == scheduler->heapSize)
+        return;
+
+    placeInHeap(scheduler, last, index);
+    if (index > 0 && paymentBefore(last, scheduler->heap[(index - 1) / 2]))
+        siftUp(scheduler, index);
+    else
+        siftDown(scheduler, index);
+}
+
+static PackedDate followingPaymentDate(const ScheduledPayment* payment) {
+    Date date = unpackDate(payment->nextDate);
+
+    if (payment->frequency == SCHEDULE_MONTHLY) {
+        if (++date.month > 12) {
+            date.month = 1;
+            date.year++;
+        }
+        date.day = MIN(payment->anchorDay, getDaysInMonth(date.month, date.year));
+        return packDate(date);
+    }
+
+    date.day += payment->frequency == SCHEDULE_WEEKLY ? 7 : 1;
+    while (date.day > getDaysInMonth(date.month, date.year)) {
+        date.day -= getDaysInMonth(date.month, date.year);
+        if (++date.month > 12) {
+            date.month = 1;
+            date.year++;
+        }
+    }
+    return packDate(date);
+}
+
+// Expects the caller to hold the lock
+static int reserveSchedulerHeap(PaymentScheduler* scheduler, int neededSize) {
+    if (neededSize <= scheduler->heapCapacity)
+        return 1;
+
+    int newCapacity = MAX(scheduler->heapCapacity * 2, neededSize + 64);
+    ScheduledPayment** newHeap = realloc(scheduler->heap, newCapacity * sizeof(ScheduledPayment*));
+    if (newHeap == NULL)
+        return 0;
+
+    scheduler->heap = newHeap;
+    scheduler->heapCapacity = newCapacity;
+    return 1;
+}
+
+PaymentScheduler* createPaymentScheduler(void) {
+    PaymentScheduler* scheduler = calloc(1, sizeof(PaymentScheduler));
+    if (scheduler == NULL)
+        return NULL;
+
+    g_mutex_init(&scheduler->lock);
+    g_mutex_init(&scheduler->runLock);
+    scheduler->payments = g_hash_table_new(g_int64_hash, g_int64_equal);
+
+    return scheduler;
+}
+
+void destroyPaymentScheduler(PaymentScheduler* scheduler) {
+    if (scheduler == NULL)
+        return;
+
+    for (int i = 0; i < scheduler->heapSize; i++)
+        destroyScheduledPayment(scheduler->heap[i]);
+
+    free(scheduler->heap);
+    g_hash_table_destroy(scheduler->payments);
+    g_mutex_clear(&scheduler->runLock);
+    g_mutex_clear(&scheduler->lock);
+    free(scheduler);
+}
+
+int schedulePayment(PaymentScheduler* scheduler, Account* account, const char* affiliateTag, MoneyAmount amount,
+                    const char* description, ScheduleFrequency frequency, PackedDate firstDate, guint64* paymentId) {
+    if (scheduler == NULL)
+        return -521; // Payment scheduler not initialized
+
+    if (account == NULL)
+        return -522; // Invalid account
+
+    if (amount <= 0 || amount > MONEY_AMOUNT_MAX)
+        return -524; // Invalid amount
+
+    if (description == NULL || strlen(description) > 99)
+        return -525; // Missing or too long description
+
+    if ((unsigned)frequency >= SCHEDULE_FREQUENCIES)
+        return -526; // Invalid frequency
+
+    ScheduledPayment* payment = calloc(1, sizeof(ScheduledPayment));
+    if (payment == NULL)
+        return -527; // Memory allocation failed
+
+    payment->account = retainAccount(account);
+    payment->description = strdup(description);
+    payment->amount = amount;
+    payment->frequency = frequency;
+    payment->anchorDay = unpackDate(firstDate).day;
+    payment->nextDate = firstDate;
+
+    // The affiliates change under the lock of the account, the IBAN is copied before it is released
+    short affiliateFound = 0;
+    lockAccount(account);
+    for (int i = 0; affiliateTag != NULL && i < account->affiliatesNumber; i++) {
+        const Affiliate* affiliate = account->affiliates[i];
+        if (strcmp(getAffiliatesTag(affiliate), affiliateTag) == 0 && getAffiliatesIban(affiliate) != NULL) {
+            payment->receiverIBAN = strdup(getAffiliatesIban(affiliate));
+            affiliateFound = 1;
+            break;
+        }
+    }
+    unlockAccount(account);
+
+    if (!affiliateFound) {
+        destroyScheduledPayment(payment);
+        return -523; // Unknown affiliate
+    }
+
+    g_mutex_lock(&scheduler->lock);
+
+    if (payment->receiverIBAN == NULL || payment->description == NULL ||
+        !reserveSchedulerHeap(scheduler, scheduler->heapSize + scheduler->runningNumber + 1)) {
+        g_mutex_unlock(&scheduler->lock);
+        destroyScheduledPayment(payment);
+        return -527; // Memory allocation failed
+    }
+
+    payment->id = ++scheduler->lastId;
+    g_hash_table_insert(scheduler->payments, &payment->id, payment);
+    pushPayment(scheduler, payment);
+
+    g_mutex_unlock(&scheduler->lock);
+
+    if (paymentId != NULL)
+        *paymentId = payment->id;
+    return 1;
+}
+
+int cancelScheduledPayment(PaymentScheduler* scheduler, guint64 paymentId) {
+    if (scheduler == NULL)
+        return -521; // Payment scheduler not initialized
+
+    g_mutex_lock(&scheduler->lock);
+
+    ScheduledPayment* payment = g_hash_table_lookup(scheduler->payments, &paymentId);
+    if (payment == NULL) {
+        g_mutex_unlock(&scheduler->lock);
+        return -528; // Unknown scheduled payment
+    }
+
+    g_hash_table_remove(scheduler->payments, &paymentId);
+    if (payment->heapIndex >= 0) {
+        removePayment(scheduler, payment);
+        destroyScheduledPayment(payment);
+    } else {
+        payment->cancelled = 1; // The run that holds it releases it
+    }
+
+    g_mutex_unlock(&scheduler->lock);
+    return 1;
+}
+
+int cancelAccountSchedules(PaymentScheduler* scheduler, const Account* account) {
+    if (scheduler == NULL)
+        return -521; // Payment scheduler not initialized
+
+    if (account == NULL)
+        return -522; // Invalid account
+
+    int cancelledPayments = 0;
+    GHashTableIter iterator;
+    gpointer value;
+
+    g_mutex_lock(&scheduler->lock);
+
+    // Only needed when an account is deleted, so the scan is fine here
+    g_hash_table_iter_init(&iterator, scheduler->payments);
+    while (g_hash_table_iter_next(&iterator, NULL, &value)) {
+        ScheduledPayment* payment = value;
+        if (payment->account != account)
+            continue;
+
+        g_hash_table_iter_remove(&iterator);
+        if (payment->heapIndex >= 0) {
+            removePayment(scheduler, payment);
+            destroyScheduledPayment(payment);
+        } else {
+            payment->cancelled = 1;
+        }
+        cancelledPayments++;
+    }
+
+    g_mutex_unlock(&scheduler->lock);
+    return cancelledPayments;
+}
+
+int getScheduledPaymentStatus(PaymentScheduler* scheduler, guint64 paymentId, PackedDate* nextDate, int* lastResult) {
+    if (scheduler == NULL)
+        return -521; // Payment scheduler not initialized
+
+    g_mutex_lock(&scheduler->lock);
+
+    const ScheduledPayment* payment = g_hash_table_lookup(scheduler->payments, &paymentId);
+    if (payment != NULL) {
+        if (nextDate != NULL)
+            *nextDate = payment->nextDate;
+        if (lastResult != NULL)
+            *lastResult = payment->lastResult;
+    }
+
+    g_mutex_unlock(&scheduler->lock);
+    return payment != NULL ? 1 : -528; // Unknown scheduled payment
+}
+
+int runDuePayments(PaymentScheduler* scheduler, RepositoryFormat* repository, PackedDate today) {
+    if (scheduler == NULL)
+        return -521; // Payment scheduler not initialized
+
+    if (repository == NULL)
+        return -529; // Invalid repository
+
+    if (!g_mutex_trylock(&scheduler->runLock))
+        return 0; // Another run is paying them
+
+    ScheduledPayment** due = malloc(SCHEDULE_BATCH_SIZE * sizeof(ScheduledPayment*));
+    TransactionOperation* operations = malloc(SCHEDULE_BATCH_SIZE * sizeof(TransactionOperation));
+    int* results = malloc(SCHEDULE_BATCH_SIZE * sizeof(int));
+    if (due == NULL || operations == NULL || results == NULL) {
+        free(due);
+        free(operations);
+        free(results);
+        g_mutex_unlock(&scheduler->runLock);
+        return -527; // Memory allocation failed
+    }
+
+    int paidNumber = 0;
+    while (TRUE) {
+        int dueNumber = 0;
+
+        g_mutex_lock(&scheduler->lock);
+        while (dueNumber < SCHEDULE_BATCH_SIZE && scheduler->heapSize > 0 && scheduler->heap[0]->nextDate <= today) {
+            due[dueNumber] = scheduler->heap[0];
+            removePayment(scheduler, due[dueNumber++]);
+        }
+        scheduler->runningNumber = dueNumber;
+        g_mutex_unlock(&scheduler->lock);
+
+        if (dueNumber == 0)
+            break;
+
+        // The payments only change under the lock, and a cancelled one stays allocated, with its account held,
+        // until the end of the run
+        for (int i = 0; i < dueNumber; i++) {
+            operations[i] = (TransactionOperation){due[i]->account, TRANSACTION_TRANSFER, (double)due[i]->amount / MONEY_CENTS,
+                                                   due[i]->description, due[i]->receiverIBAN, unpackDate(due[i]->nextDate), 1, 1};
+        }
+        batchTransactionService(repository, operations, dueNumber, results);
+
+        g_mutex_lock(&scheduler->lock);
+        for (int i = 0; i < dueNumber; i++) {
+            ScheduledPayment* payment = due[i];
+            payment->lastResult = results[i];
+            if (results[i] == 1)
+                paidNumber++;
+
+            if (payment->cancelled || results[i] == -353) {
+                if (!payment->cancelled)
+                    g_hash_table_remove(scheduler->payments, &payment->id); // The account was deleted
+                destroyScheduledPayment(payment);
+                continue;
+            }
+
+            // A payment that failed is skipped, the next one is still due on its date
+            payment->nextDate = followingPaymentDate(payment);
+            pushPayment(scheduler, payment);
+        }
+        scheduler->runningNumber = 0;
+        g_mutex_unlock(&scheduler->lock);
+    }
+
+    free(due);
+    free(operations);
+    free(results);
+    g_mutex_unlock(&scheduler->runLock);
+    return paidNumber;
+}
@@ -1,5 +1,5 @@
 #include "services.h"
-#include <gtk/gtk.h>
+#include <glib.h>
 #include <string.h>
 #include "../domain/domain.h"
 #include "../repository/repository.h"
@@ -11,6 +11,142 @@
 //
 ////////////////////
 
+// Every transaction of the resident part of a history can be found by its id: the index maps it to the account
+// and the position inside the history, which never changes since the history only grows and archiving keeps
+// positions. The entry also links the two legs of a transfer inside the bank and the entry that reversed the
+// transaction. Archiving a period drops the entries of its transactions, so the index grows with the open months
+// and not with the whole history, and a closed period can't be reversed anymore.
+// The entries are stored inline in an open addressing table with linear probing, so indexing a transaction
+// allocates nothing once the table is large enough. Removing an entry shifts the ones probed after it back into
+// the hole, so lookups never need tombstones. An entry may move whenever the table changes: pointers into it are
+// only used under the lock, between two changes.
+// The lock is taken after the account locks, never the other way around.
+typedef struct {
+    guint64 id;            // 0 for a free slot, transaction ids start at 1
+    Account* account;
+    int position;
+    guint64 counterpartId; // Other leg of a transfer between two accounts of the bank, 0 otherwise
+    guint64 reversalId;    // Entry that compensated this one, 0 while it wasn't reversed
+} TransactionIndexEntry;
+
+#define TRANSACTION_INDEX_MIN_CAPACITY 1024 // Slots, always a power of two and kept at most three quarters full
+
+static GMutex transactionIndexLock;
+static TransactionIndexEntry* transactionIndex = NULL;
+static gsize transactionIndexCapacity = 0;
+static gsize transactionIndexSize = 0;
+
+// Ids are consecutive: taken as they are, the live ones would form a single cluster that every removal walks
+// to its end, so they are mixed before taking the low bits
+static gsize getTransactionIndexSlot(guint64 transactionId) {
+    transactionId ^= transactionId >> 33;
+    transactionId *= 0xff51afd7ed558ccdULL;
+    transactionId ^= transactionId >> 33;
+    return (gsize)transactionId & (transactionIndexCapacity - 1);
+}
+
+// Expects the caller to hold transactionIndexLock
+static TransactionIndexEntry* lookupTransactionIndex(guint64 transactionId) {
+    if (transactionIndexCapacity == 0 || transactionId == 0)
+        return NULL;
+
+    for (gsize slot = getTransactionIndexSlot(transactionId); transactionIndex[slot].id != 0;
+         slot = (slot + 1) & (transactionIndexCapacity - 1)) {
+        if (transactionIndex[slot].id == transactionId)
+            return &transactionIndex[slot];
+    }
+    return NULL;
+}
+
+// Expects the caller to hold transactionIndexLock, returns the slot holding the id, free or already used by it
+static TransactionIndexEntry* claimTransactionIndexSlot(guint64 transactionId) {
+    gsize slot = getTransactionIndexSlot(transactionId);
+    while (transactionIndex[slot].id != 0 && transactionIndex[slot].id != transactionId)
+        slot = (slot + 1) & (transactionIndexCapacity - 1);
+    return &transactionIndex[slot];
+}
+
+// Expects the caller to hold transactionIndexLock
+static void growTransactionIndex() {
+    TransactionIndexEntry* oldEntries = transactionIndex;
+    gsize oldCapacity = transactionIndexCapacity;
+
+    transactionIndexCapacity = oldCapacity > 0 ? oldCapacity * 2 : TRANSACTION_INDEX_MIN_CAPACITY;
+    transactionIndex = g_new0(TransactionIndexEntry, transactionIndexCapacity);
+    for (gsize i = 0; i < oldCapacity; i++) {
+        if (oldEntries[i].id != 0)
+            *claimTransactionIndexSlot(oldEntries[i].id) = oldEntries[i];
+    }
+    g_free(oldEntries);
+}
+
+// Expects the caller to hold transactionIndexLock. The entries after the slot that would be found through it
+// move back into the hole, so the slot may hold another entry afterwards.
+static void removeTransactionIndexSlot(gsize hole) {
+    gsize mask = transactionIndexCapacity - 1;
+
+    for (gsize slot = (hole + 1) & mask; transactionIndex[slot].id != 0; slot = (slot + 1) & mask) {
+        // Stays when its home slot lies cyclically after the hole, up to where it sits
+        gsize home = getTransactionIndexSlot(transactionIndex[slot].id);
+        if (((slot - home) & mask) < ((slot - hole) & mask))
+            continue;
+        transactionIndex[hole] = transactionIndex[slot];
+        hole = slot;
+    }
+
+    memset(&transactionIndex[hole], 0, sizeof(TransactionIndexEntry));
+    transactionIndexSize--;
+}
+
+static void indexTransaction(Account* account, const Transaction* transaction, int position) {
+    guint64 transactionId = getTransactionId(transaction);
+
+    g_mutex_lock(&transactionIndexLock);
+    if ((transactionIndexSize + 1) * 4 > transactionIndexCapacity * 3)
+        growTransactionIndex();
+
+    TransactionIndexEntry* entry = claimTransactionIndexSlot(transactionId);
+    if (entry->id == 0)
+        transactionIndexSize++;
+    *entry = (TransactionIndexEntry){transactionId, account, position, 0, 0};
+    g_mutex_unlock(&transactionIndexLock);
+}
+
+static void linkTransferLegs(guint64 outgoingId, guint64 incomingId) {
+    g_mutex_lock(&transactionIndexLock);
+
+    TransactionIndexEntry* outgoingEntry = lookupTransactionIndex(outgoingId);
+    TransactionIndexEntry* incomingEntry = lookupTransactionIndex(incomingId);
+    if (outgoingEntry != NULL && incomingEntry != NULL) {
+        outgoingEntry->counterpartId = incomingEntry->id;
+        incomingEntry->counterpartId = outgoingEntry->id;
+    }
+
+    g_mutex_unlock(&transactionIndexLock);
+}
+
+// Drops the transactions of a period being archived, the caller holds the lock of their account
+static void forgetArchivedTransactions(Transaction** transactions, int transactionsNumber) {
+    g_mutex_lock(&transactionIndexLock);
+    for (int i = 0; i < transactionsNumber; i++) {
+        TransactionIndexEntry* entry = lookupTransactionIndex(getTransactionId(transactions[i]));
+        if (entry != NULL)
+            removeTransactionIndexSlot((gsize)(entry - transactionIndex));
+    }
+    g_mutex_unlock(&transactionIndexLock);
+}
+
+// Drops the transactions of an account that is being deleted. Deleting is rare, so the scan is fine here.
+// A removal may move a later entry into the slot just emptied, so the slot is looked at again.
+static void forgetAccountTransactions(const Account* account) {
+    g_mutex_lock(&transactionIndexLock);
+    for (gsize slot = 0; slot < transactionIndexCapacity; slot++) {
+        while (transactionIndex[slot].id != 0 && transactionIndex[slot].account == account)
+            removeTransactionIndexSlot(slot);
+    }
+    g_mutex_unlock(&transactionIndexLock);
+}
+
 int addTransactionForUser(Account* account, Transaction* newTransaction) {
     if (account == NULL)
         return -201; // Invalid account
@@ -18,7 +154,9 @@ int addTransactionForUser(Account* account, Transaction* newTransaction) {
     if (newTransaction == NULL)
         return -202; // Invalid transaction
 
-    if (account->transactionsNumber >= account->transactionsCapacity) {
+    // Archived transactions don't take a slot, only the resident part of the history is stored here
+    int residentTransactions = account->transactionsNumber - account->archivedTransactionsNumber;
+    if (residentTransactions >= account->transactionsCapacity) {
         int newCapacity = account->transactionsCapacity * 2 + 1;
         Transaction** newTransactions = realloc(account->transactions, newCapacity * sizeof(Transaction*));
         if (newTransactions == NULL) {
@@ -28,18 +166,44 @@ int addTransactionForUser(Account* account, Transaction* newTransaction) {
         account->transactionsCapacity = newCapacity;
     }
 
-    account->transactions[account->transactionsNumber] = newTransaction;
+    account->transactions[residentTransactions] = newTransaction;
+    indexTransaction(account, newTransaction, account->transactionsNumber);
     account->transactionsNumber++;
 
     return 1;
 }
 
+int reserveTransactionsForUser(Account* account, int additionalTransactions) {
+    if (account == NULL)
+        return -204; // Invalid account
+
+    if (additionalTransactions < 0)
+        return -205; // Invalid number of transactions
+
+    int neededCapacity = account->transactionsNumber - account->archivedTransactionsNumber + additionalTransactions;
+    if (neededCapacity <= account->transactionsCapacity)
+        return 1;
+
+    int newCapacity = account->transactionsCapacity * 2 + 1;
+    if (newCapacity < neededCapacity)
+        newCapacity = neededCapacity;
+
+    Transaction** newTransactions = realloc(account->transactions, newCapacity * sizeof(Transaction*));
+    if (newTransactions == NULL) {
+        return -206; // Memory management error
+    }
+    account->transactions = newTransactions;
+    account->transactionsCapacity = newCapacity;
+
+    return 1;
+}
+
 Transaction* getLatestTransaction(const Account* account) {
     if (account->transactionsNumber == 0) {
         return NULL;
     }
 
-    return account->transactions[account->transactionsNumber - 1];
+    return getAccountTransaction(account, account->transactionsNumber - 1);
 }
 
 int addAffiliateToAccount(Account* account, Affiliate* newAffiliate) {
@@ -172,6 +336,180 @@ int removeAnUserAccount(Account* account, const char* userAccountType) {
     return 1;
 }
 
+int recordTransactionInAggregates(Account* account, const Transaction* transaction) {
+    if (account == NULL)
+        return -261; // Invalid account
+
+    if (transaction == NULL)
+        return -262; // Invalid transaction
+
+    Date transactionDate = getTransactionDate(transaction);
+    const char* category = getTransactionCategory(transaction);
+
+    // History is ordered by date, so the month of a new transaction is always the last month of the table
+    for (int i = account->aggregatesNumber - 1; i >= 0; i--) {
+        MonthlyAggregate* aggregate = account->aggregates[i];
+        if (aggregate->year != transactionDate.year || aggregate->month != transactionDate.month)
+            break;
+        if (strcmp(getMonthlyAggregateCategory(aggregate), category) == 0) {
+            addAmountToMonthlyAggregate(aggregate, getTransactionAmount(transaction));
+            return 1;
+        }
+    }
+
+    if (account->aggregatesNumber >= account->aggregatesCapacity) {
+        int newCapacity = account->aggregatesCapacity * 2 + 1;
+        MonthlyAggregate** newAggregates = realloc(account->aggregates, newCapacity * sizeof(MonthlyAggregate*));
+        if (newAggregates == NULL) {
+            account->aggregatesOutdated = 1;
+            return -263; // Memory reallocation failed
+        }
+        account->aggregates = newAggregates;
+        account->aggregatesCapacity = newCapacity;
+    }
+
+    MonthlyAggregate* newAggregate = createMonthlyAggregate(transactionDate.year, transactionDate.month, category);
+    if (newAggregate == NULL) {
+        account->aggregatesOutdated = 1;
+        return -264; // Failed to create the aggregate
+    }
+
+    addAmountToMonthlyAggregate(newAggregate, getTransactionAmount(transaction));
+    account->aggregates[account->aggregatesNumber] = newAggregate;
+    account->aggregatesNumber++;
+
+    return 1;
+}
+
+int rebuildMonthlyAggregates(Account* account) {
+    if (account == NULL)
+        return -271; // Invalid account
+
+    for (int i = 0; i < account->aggregatesNumber; i++) {
+        destroyMonthlyAggregate(account->aggregates[i]);
+    }
+    account->aggregatesNumber = 0;
+    account->aggregatesOutdated = 1;
+
+    for (int i = 0; i < account->transactionsNumber; i++) {
+        int result = recordTransactionInAggregates(account, getAccountTransaction(account, i));
+        if (result != 1)
+            return result;
+    }
+
+    account->aggregatesOutdated = 0;
+    return 1;
+}
+
+// Expects the caller to hold the account lock
+static int compressClosedPeriods(Account* account, int openMonths) {
+    Transaction* latestTransaction = getLatestTransaction(account);
+    if (latestTransaction == NULL)
+        return 0; // Nothing to archive
+
+    // Months are counted back from the latest transaction, everything before the first open month is closed
+    Date latestDate = getTransactionDate(latestTransaction);
+    int firstOpenMonth = latestDate.year * 12 + (latestDate.month - 1) - openMonths;
+    int residentTransactions = account->transactionsNumber - account->archivedTransactionsNumber;
+
+    // Positions below are inside the resident part of the history
+    int start = 0;
+    while (start < residentTransactions) {
+        Date periodDate = getTransactionDate(account->transactions[start]);
+        if (periodDate.year * 12 + (periodDate.month - 1) >= firstOpenMonth)
+            break;
+
+        int end = start + 1;
+        while (end < residentTransactions) {
+            Date currentDate = getTransactionDate(account->transactions[end]);
+            if (currentDate.year != periodDate.year || currentDate.month != periodDate.month)
+                break;
+            end++;
+        }
+
+        if (account->segmentsNumber >= account->segmentsCapacity) {
+            int newCapacity = account->segmentsCapacity * 2 + 1;
+            TransactionSegment** newSegments = realloc(account->segments, newCapacity * sizeof(TransactionSegment*));
+            if (newSegments == NULL)
+                break; // Memory reallocation failed, keep what was archived so far
+            account->segments = newSegments;
+            account->segmentsCapacity = newCapacity;
+        }
+
+        TransactionSegment* newSegment = createTransactionSegment(&account->transactions[start], end - start,
+                                                                  account->archivedTransactionsNumber + start,
+                                                                  &account->segmentCache);
+        if (newSegment == NULL)
+            break; // Failed to compress the period, it stays resident
+
+        forgetArchivedTransactions(&account->transactions[start], end - start);
+        for (int i = start; i < end; i++)
+            destroyTransaction(account->transactions[i]);
+
+        account->segments[account->segmentsNumber] = newSegment;
+        account->segmentsNumber++;
+        start = end;
+    }
+
+    if (start == 0)
+        return 0;
+
+    // Drop the archived slots from the resident array
+    memmove(account->transactions, account->transactions + start, (residentTransactions - start) * sizeof(Transaction*));
+    account->archivedTransactionsNumber += start;
+
+    return start; // Number of transactions moved to the compressed tier
+}
+
+int archiveClosedPeriods(Account* account, int openMonths) {
+    if (account == NULL)
+        return -281; // Invalid account
+
+    if (openMonths < 0)
+        return -282; // Invalid number of months kept uncompressed
+
+    lockAccount(account);
+    int archivedTransactions = compressClosedPeriods(account, openMonths);
+    unlockAccount(account);
+
+    return archivedTransactions;
+}
+
+int spillColdHistory(Account* account, const char* directory, int openMonths) {
+    if (account == NULL)
+        return -291; // Invalid account
+
+    if (directory == NULL)
+        return -292; // Missing history directory
+
+    if (openMonths < 0)
+        return -282; // Invalid number of months kept uncompressed
+
+    lockAccount(account);
+    compressClosedPeriods(account, openMonths);
+
+    // Every account has its own segment file, named after the IBAN which never changes
+    gchar* fileName = g_strdup_printf("%s.seg", getAccountIban(account));
+    gchar* filePath = g_build_filename(directory, fileName, NULL);
+    g_free(fileName);
+
+    int spilledSegments = 0;
+    for (int i = 0; i < account->segmentsNumber; i++) {
+        if (isTransactionSegmentSpilled(account->segments[i]))
+            continue;
+        if (!spillTransactionSegment(account->segments[i], filePath)) {
+            unlockAccount(account);
+            g_free(filePath);
+            return -293; // Failed to write the segment file
+        }
+        spilledSegments++;
+    }
+
+    unlockAccount(account);
+    g_free(filePath);
+    return spilledSegments;
+}
+
 //void displayUserAccounts(Account* account) {
 //    for (int i = 0; i < account->userAccountsNumber; i++) {
 //        UserAccounts* userAccount = account->userAccounts[i];
@@ -180,6 +518,136 @@ int removeAnUserAccount(Account* account, const char* userAccountType) {
 //    }
 //}
 
+////////////////////
+//
+//  Query functions
+//
+////////////////////
+
+int findTransactionById(guint64 transactionId, Account** account, int* position) {
+    if (account == NULL || position == NULL)
+        return -491; // Unknown transaction
+
+    g_mutex_lock(&transactionIndexLock);
+    TransactionIndexEntry* entry = lookupTransactionIndex(transactionId);
+    if (entry != NULL) {
+        *account = entry->account;
+        *position = entry->position;
+    }
+    g_mutex_unlock(&transactionIndexLock);
+
+    return entry != NULL ? 1 : -491; // Unknown transaction
+}
+
+// Transactions are kept in non-decreasing date order (see validDateForTransaction), so the history
+// can be searched by date. Returns the index of the first transaction dated on or after the given date
+// (strictAfter == 0) or strictly after it (strictAfter == 1).
+static int searchTransactionByDate(const Account* account, Date searchedDate, short strictAfter) {
+    int low = 0;
+    int high = getAccountTransactionsNumber(account);
+
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        int comparison = compareDates(getTransactionDate(getAccountTransaction(account, middle)), searchedDate);
+        if (comparison < 0 || (strictAfter && comparison == 0))
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+int findTransactionsInDateRange(const Account* account, Date startDate, Date endDate, int* firstIndex, int* lastIndex) {
+    if (account == NULL)
+        return -251; // Invalid account
+
+    if (firstIndex == NULL || lastIndex == NULL)
+        return -252; // Invalid output parameters
+
+    if (compareDates(startDate, endDate) > 0)
+        return -253; // The start date is after the end date
+
+    *firstIndex = searchTransactionByDate(account, startDate, 0);
+    *lastIndex = searchTransactionByDate(account, endDate, 1);
+    if (*lastIndex < *firstIndex)
+        *lastIndex = *firstIndex;
+
+    return *lastIndex - *firstIndex; // Number of transactions in [firstIndex, lastIndex)
+}
+
+int getAccountArchiveStatistics(const Account* account, size_t* rawBytes, size_t* compressedBytes) {
+    if (account == NULL)
+        return -256; // Invalid account
+
+    if (rawBytes == NULL || compressedBytes == NULL)
+        return -257; // Invalid output parameters
+
+    *rawBytes = 0;
+    *compressedBytes = 0;
+    for (int i = 0; i < account->segmentsNumber; i++) {
+        *rawBytes += getTransactionSegmentRawSize(account->segments[i]);
+        *compressedBytes += getTransactionSegmentDataSize(account->segments[i]);
+    }
+
+    return account->archivedTransactionsNumber; // Bytes per transaction are the sizes divided by this number
+}
+
+MonthlyAggregate* getMonthlyAggregate(Account* account, short year, short month, const char* category) {
+    if (account == NULL || category == NULL)
+        return NULL;
+
+    if (account->aggregatesOutdated && rebuildMonthlyAggregates(account) != 1)
+        return NULL;
+
+    // First entry of the requested month, the table is sorted by (year, month)
+    int low = 0;
+    int high = account->aggregatesNumber;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        MonthlyAggregate* aggregate = account->aggregates[middle];
+        if (aggregate->year < year || (aggregate->year == year && aggregate->month < month))
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    for (int i = low; i < account->aggregatesNumber; i++) {
+        MonthlyAggregate* aggregate = account->aggregates[i];
+        if (aggregate->year != year || aggregate->month != month)
+            break;
+        if (strcmp(getMonthlyAggregateCategory(aggregate), category) == 0)
+            return aggregate;
+    }
+
+    return NULL; // No transaction of this category in that month
+}
+
+int getAccountBalanceAtDate(const Account* account, Date date, float* balance) {
+    if (account == NULL)
+        return -254; // Invalid account
+
+    if (balance == NULL)
+        return -255; // Invalid output parameter
+
+    // Every transaction keeps the balance right after it, so the answer is the running balance
+    // of the last transaction dated on or before the requested day
+    int transactionsBefore = searchTransactionByDate(account, date, 1);
+    if (transactionsBefore > 0) {
+        *balance = getTransactionRunningBalance(getAccountTransaction(account, transactionsBefore - 1));
+        return 1;
+    }
+
+    // Nothing happened until that day, so the balance is the one from before the first transaction
+    Transaction* firstTransaction = getAccountTransaction(account, 0);
+    if (firstTransaction != NULL)
+        *balance = getTransactionRunningBalance(firstTransaction) - getTransactionSignedAmount(firstTransaction);
+    else
+        *balance = getAccountBalance(account);
+
+    return 1;
+}
+
 ////////////////////
 //
 //  Check functions
@@ -192,43 +660,15 @@ short accountTagUsed(const RepositoryFormat* receivedRepository, const gchar *ch
 }
 
 short stringOnlyWithLetters(const gchar *checkedString) {
-    if (checkedString == NULL || *checkedString == '\0')
-        return 0;  // Empty or NULL string is invalid
-
-    size_t length = strlen(checkedString);
-    for (size_t index = 0; index < length; index++) {
-        if ((checkedString[index] < 'A' || checkedString[index] > 'z') ||
-            (checkedString[index] > 'Z' && checkedString[index] < 'a')) {
-            return 0;  // Not a letter (excluding ASCII gaps)
-        }
-    }
-    return 1;  // Valid string
+    return scanCharacterClass(checkedString, CHARACTER_CLASS_LETTER) > 0; // Empty or NULL string is invalid
 }
 
 short stringOnlyWithDigitsExtended(const gchar *checkedString) {
-    if (checkedString == NULL || *checkedString == '\0')
-        return 0;  // Empty or NULL string is invalid
-
-    for (size_t index = 0; checkedString[index] != '\0'; index++) {
-        if ((checkedString[index] < '0' || checkedString[index] > '9') &&
-            checkedString[index] != ',' && checkedString[index] != '.') {
-            return 0;  // Not a digit, period, or comma
-        }
-    }
-    return 1;  // Valid string
+    return scanCharacterClass(checkedString, CHARACTER_CLASS_DIGIT | CHARACTER_CLASS_SEPARATOR) > 0;
 }
 
-
 short stringOnlyWithDigits(const gchar *checkedString) {
-    if (checkedString == NULL || *checkedString == '\0')
-        return 0;  // Empty or NULL string is invalid
-
-    for (size_t index = 0; checkedString[index] != '\0'; index++) {
-        if (checkedString[index] < '0' || checkedString[index] > '9') {
-            return 0;  // Not a digit
-        }
-    }
-    return 1;  // Valid string
+    return scanCharacterClass(checkedString, CHARACTER_CLASS_DIGIT) > 0;
 }
 
 short differentPassword(const gchar *password1, const gchar *password2){
@@ -237,21 +677,34 @@ short differentPassword(const gchar *password1, const gchar *password2){
     return 0;
 }
 
-short validDate(const gchar *day, const gchar *month, const gchar *year){ // available date means it is valid inside the calendar
+// Reads a field made only of digits. The value stops growing past 10000, above anything a date field accepts.
+static short parseDateField(const gchar *field, int *value) {
+    if (field == NULL || *field == '\0')
+        return 0;
+
+    int result = 0;
+    for (; *field != '\0'; field++) {
+        if (*field < '0' || *field > '9')
+            return 0;
+        result = MIN(result * 10 + (*field - '0'), 10000);
+    }
 
-    if(!stringOnlyWithDigits(day))
+    *value = result;
+    return 1;
+}
+
+int parseBirthDate(const gchar *day, const gchar *month, const gchar *year, PackedDate *date) {
+    int intDay, intMonth, intYear;
+
+    if(!parseDateField(day, &intDay))
         return -121; // The day need to be a number!
 
-    else if(!stringOnlyWithDigits(month))
+    else if(!parseDateField(month, &intMonth))
         return -122; // The month need to be a number!
 
-    else if(!stringOnlyWithDigits(year))
+    else if(!parseDateField(year, &intYear))
         return -123; // The year need to be a number!
 
-    guint64 intDay = g_ascii_strtoull(day, NULL, 10); // transform a string formatted from digits to an integer
-    guint64 intMonth = g_ascii_strtoull(month, NULL, 10); // this function is from gtk input options
-    guint64 intYear = g_ascii_strtoull(year, NULL, 10);
-
     if(intYear < 1700)
         return -124; // The entered year is far too far away!
 
@@ -264,57 +717,126 @@ short validDate(const gchar *day, const gchar *month, const gchar *year){ // ava
     if(intDay < 1 || intDay > 31)
         return -127; // The day does not exist!
 
-    else if(intDay == 31 && (intMonth == 2 || intMonth == 4 || intMonth == 6 || intMonth == 9 || intMonth == 11) )
-        return -128; // The month has only 30 days!
-
-    else if(intDay == 30 && intMonth == 2)
-        return -129; // The month can have a maximum of 29 days!
-
-    else if(intDay == 29 && intMonth == 2 && intYear % 4 != 0)
+    else if(intDay > getDaysInMonth((short)intMonth, (short)intYear)) {
+        if(intDay == 31)
+            return -128; // The month has only 30 days!
+        else if(intDay == 30)
+            return -129; // The month can have a maximum of 29 days!
         return -130; // The year February has a maximum of 28 days!
+    }
 
+    if (date != NULL)
+        *date = packDate(createDate((short)intDay, (short)intMonth, (short)intYear));
     return 1;
 }
 
+short validDate(const gchar *day, const gchar *month, const gchar *year){ // available date means it is valid inside the calendar
+    return parseBirthDate(day, month, year, NULL);
+}
 
-short validDateForTransaction(const gchar *day, const gchar *month, const gchar *year, const Account* account) {
-    if (!stringOnlyWithDigits(day))
-        return -141; // The day needs to be a number!
-    else if (!stringOnlyWithDigits(month))
-        return -142; // The month needs to be a number!
-    else if (!stringOnlyWithDigits(year))
-        return -143; // The year needs to be a number!
-
-    guint64 intDay = g_ascii_strtoull(day, NULL, 10);
-    guint64 intMonth = g_ascii_strtoull(month, NULL, 10);
-    guint64 intYear = g_ascii_strtoull(year, NULL, 10);
-
-    if (intYear < 1700)
+// Calendar checks of a transaction date, and against the latest date of the account when there is one
+static int validTransactionDate(Date date, const Date* latestDate) {
+    if (date.year < 1700)
         return -144; // There were no banks this year. People kept currency hidden in their homes!
-    else if (intYear > 9999)
+    else if (date.year > 9999)
         return -145; // The year format is invalid. It must have a maximum of 4 digits!
 
-    if (intMonth < 1 || intMonth > 12)
+    if (date.month < 1 || date.month > 12)
         return -146; // This month does not exist!
 
-    if (intDay < 1 || intDay > 31)
+    if (date.day < 1 || date.day > 31)
         return -147; // This day does not exist!
-    else if (intDay == 31 && (intMonth == 2 || intMonth == 4 || intMonth == 6 || intMonth == 9 || intMonth == 11))
-        return -148; // This month has only 30 days!
-    else if (intDay == 30 && intMonth == 2)
-        return -149; // This month can have a maximum of 29 days!
-    else if (intDay == 29 && intMonth == 2 && intYear % 4 != 0)
+    else if (date.day > getDaysInMonth(date.month, date.year)) {
+        if (date.day == 31)
+            return -148; // This month has only 30 days!
+        else if (date.day == 30)
+            return -149; // This month can have a maximum of 29 days!
         return -150; // This year February has a maximum of 28 days!
+    }
+
+    if (latestDate != NULL && compareDates(date, *latestDate) < 0)
+        return -151; // The last transaction was recorded in the future.
+
+    return 1;
+}
+
+int parseTransactionDate(const gchar *day, const gchar *month, const gchar *year, PackedDate *date) {
+    int intDay, intMonth, intYear;
+
+    if (!parseDateField(day, &intDay))
+        return -141; // The day needs to be a number!
+    else if (!parseDateField(month, &intMonth))
+        return -142; // The month needs to be a number!
+    else if (!parseDateField(year, &intYear))
+        return -143; // The year needs to be a number!
+
+    Date parsedDate = createDate((short)intDay, (short)intMonth, (short)intYear);
+    int result = validTransactionDate(parsedDate, NULL);
+    if (result != 1)
+        return result;
+
+    if (date != NULL)
+        *date = packDate(parsedDate);
+    return 1;
+}
+
+short validDateForTransaction(const gchar *day, const gchar *month, const gchar *year, const Account* account) {
+    PackedDate date;
+    int result = parseTransactionDate(day, month, year, &date);
+    if (result != 1)
+        return result;
 
     Transaction* latestTransaction = getLatestTransaction(account);
-    if (latestTransaction != NULL) {
-        Date latestDate = getTransactionDate(latestTransaction);
-        if (intYear < latestDate.year ||
-            (intYear == latestDate.year && intMonth < latestDate.month) ||
-            (intYear == latestDate.year && intMonth == latestDate.month && intDay < latestDate.day))
-            return -151; // The last transaction was recorded in the future. You can't introduce now something that has already happened.
+    Date latestDate = getTransactionDate(latestTransaction);
+    return validTransactionDate(unpackDate(date), latestTransaction != NULL ? &latestDate : NULL);
+}
+
+// Reads "12", "12.5" or "12,50" in one pass, decimals past the cents are rounded
+short parseMoneyAmount(const gchar *text, MoneyAmount *amount) {
+    if (text == NULL || amount == NULL)
+        return 0;
+
+    MoneyAmount cents = 0;
+    int decimals = -1; // No separator seen yet
+    short hasDigits = 0, roundUp = 0;
+
+    for (; *text != '\0'; text++) {
+        if (*text == '.' || *text == ',') {
+            if (decimals >= 0)
+                return 0; // A second separator
+            decimals = 0;
+            continue;
+        }
+        if (*text < '0' || *text > '9')
+            return 0;
+
+        int digit = *text - '0';
+        hasDigits = 1;
+        if (decimals < 2) {
+            cents = cents * 10 + digit;
+            if (decimals >= 0)
+                decimals++;
+        } else {
+            if (decimals == 2)
+                roundUp = digit >= 5;
+            decimals++;
+        }
+
+        if (cents > MONEY_AMOUNT_MAX)
+            return 0;
     }
 
+    if (!hasDigits)
+        return 0;
+
+    for (int i = MAX(decimals, 0); i < 2; i++)
+        cents *= 10;
+    cents += roundUp;
+
+    if (cents > MONEY_AMOUNT_MAX)
+        return 0;
+
+    *amount = cents;
     return 1;
 }
 
@@ -328,16 +850,22 @@ void generateRandomIBAN(char* iban) {
     const char* country_code = "RO";
     const char* bank_id = "GLBK";
     const char* branch_id = "0001";
-    char checkDigits[2];
-    char accountNumber[12];
+    char checkDigits[3];
+    char accountNumber[13];
+
+    // g_random_int_range is safe to call from the server and dispatcher threads, rand() is not
+    for (int i = 0; i < 2; i++)
+        checkDigits[i] = (char)('0' + g_random_int_range(0, 10));
+    checkDigits[2] = '\0';
+    for (int i = 0; i < 12; i++) {
+        accountNumber[i] = (char)('0' + g_random_int_range(0, 10));
+    }
+    accountNumber[12] = '\0';
 
     strcpy(iban, country_code);
     strcat(iban, checkDigits);
     strcat(iban, bank_id);
     strcat(iban, branch_id);
-    for (int i = 0; i < 12; i++) {
-        accountNumber[i] = '0' + (rand() % 10);
-    }
     strcat(iban, accountNumber);
 }
 
@@ -357,13 +885,17 @@ int loginService(RepositoryFormat* repository, const char* username, const char*
     else if(password == NULL)
         return -303; // Missing the password for your account.
 
-    if(strlen(username) > 20)
+    // Validated and measured in one pass, -1 when it has anything else than letters
+    gssize usernameLength = scanCharacterClass(username, CHARACTER_CLASS_LETTER);
+
+    if(usernameLength > 20)
         return -304; // Imputed account tag is too long! Maximum 20 characters.
     else if(strlen(password) > 32)
         return -305; // Imputed password is too long! Maximum 32 characters.
-    else if(!stringOnlyWithLetters(username))
+    else if(usernameLength <= 0)
         return -306; // Account tag can have only letters!
 
+    // The account comes held for the caller, see loginService in services.h
     Account* foundAccount = loginRepository(repository, username, password);
     if (foundAccount == NULL) {
         return -307; // Account not found or wrong password
@@ -402,7 +934,8 @@ int createAccountService(RepositoryFormat* repository, const char* accountTag, c
     if (accountTagUsed(repository, accountTag))
         return -322; // Account tag already used
 
-    if (validDate(day, month, year) != 1) {
+    PackedDate birthday;
+    if (parseBirthDate(day, month, year, &birthday) != 1) {
         return -323; // Invalid birthday.
     }
 
@@ -419,8 +952,6 @@ int createAccountService(RepositoryFormat* repository, const char* accountTag, c
     else if(!stringOnlyWithDigits(phoneNumber))
         return -329; // Phone number can have only digits!"
 
-    Date birthday = createDate(atoi(day), atoi(month), atoi(year));
-
     char iban[30];
     char* uniqueIBAN = NULL;
     while (1) {
@@ -435,30 +966,35 @@ int createAccountService(RepositoryFormat* repository, const char* accountTag, c
         }
     }
 
-    Account* newAccount = createAccount(0.0, accountTag, firstName, secondName, password, uniqueIBAN, phoneNumber, birthday);
+    Account* newAccount = createAccount(0.0, accountTag, firstName, secondName, password, uniqueIBAN, phoneNumber, unpackDate(birthday));
     free(uniqueIBAN);
 
     if (newAccount == NULL)
         return -330; // Failed to create an account
 
-    if (addAccountToRepository(repository, newAccount) != 1) {
+    // One reference goes to the repository and one to the caller, taken first so a delete racing the
+    // registration can't free the account under it
+    retainAccount(newAccount);
+    int addResult = addAccountToRepository(repository, newAccount);
+    if (addResult != 1) {
         destroyAccount(newAccount);
-        free(newAccount);
+        if (addResult == -44)
+            return -322; // Account tag already used
         return -331; // Failed to add account to repository
     }
 
     // Create a new user account and link it to the new account
     UserAccounts* newUserAccount = createUserAccount(0.0, accountType);
     if (newUserAccount == NULL) {
-        destroyAccount(newAccount);
         removeAccountFromRepository(repository, accountTag);
+        releaseAccount(newAccount);
         return -332; // Failed to create user account
     }
 
     int resultCode = addNewUserAccount(newAccount, newUserAccount);
     if (resultCode != 1) {
-        destroyAccount(newAccount);
         removeAccountFromRepository(repository, accountTag);
+        releaseAccount(newAccount);
         destroyUserAccount(newUserAccount);
         free(newUserAccount);
         return resultCode; // Failed to add user account
@@ -475,7 +1011,14 @@ int deleteAccountService(RepositoryFormat* repository, Account** loggedAccount){
     const char* accountTag = getAccountTag(*loggedAccount);
     if (accountTag == NULL)
         return -352; // Invalid account tag
-    
+
+    // Closed first: the transactions running on it finish before, the ones locking it later give up, so no new
+    // entry can reach the index once it was cleared. The memory stays until the caller and every other holder
+    // released their references.
+    if (isAccountClosed(*loggedAccount))
+        return -353; // This account was deleted
+    closeAccount(*loggedAccount);
+    forgetAccountTransactions(*loggedAccount);
     int result = removeAccountFromRepository(repository, accountTag);
     if (result == 1) {
         *loggedAccount = NULL; // Clear the logged account pointer
@@ -489,38 +1032,38 @@ int editAccountService(Account** loggedAccount, const char* currentPassword, con
     if (loggedAccount == NULL || *loggedAccount == NULL)
         return -340; // Invalid account
     
-    if (currentPassword == NULL || strlen(currentPassword) == 0)
+    if (currentPassword == NULL || currentPassword[0] == '\0')
         return -341; // Missing current password
     
     if(differentPassword(currentPassword, getAccountPassword(*loggedAccount)))
         return -341; // The imputed password is wrong!
     
-    if (password != NULL && strlen(password) > 0) {
-        if (passwordConfirm == NULL || strlen(passwordConfirm) == 0)
+    if (password != NULL && password[0] != '\0') {
+        if (passwordConfirm == NULL || passwordConfirm[0] == '\0')
             return -342; // Missing password confirmation
         if(differentPassword(password, passwordConfirm))
             return -342; // The passwords do not match!
     }
     
-    if (accountType != NULL && strlen(accountType) > 0 && !availableAccountType(accountType))
+    if (accountType != NULL && accountType[0] != '\0' && !availableAccountType(accountType))
         return -343; // Invalid account type!\nAvailable types: savings, checking, credit.
     
-    if (firstName != NULL && strlen(firstName) > 0 && !stringOnlyWithLetters(firstName))
+    if (firstName != NULL && firstName[0] != '\0' && !stringOnlyWithLetters(firstName))
         return -344; // First name can have only letters!
     
-    if (secondName != NULL && strlen(secondName) > 0 && !stringOnlyWithLetters(secondName))
+    if (secondName != NULL && secondName[0] != '\0' && !stringOnlyWithLetters(secondName))
         return -345; // Second name can have only letters!
     
-    if (phoneNumber != NULL && strlen(phoneNumber) > 0 && !stringOnlyWithDigits(phoneNumber))
+    if (phoneNumber != NULL && phoneNumber[0] != '\0' && !stringOnlyWithDigits(phoneNumber))
         return -346; // Phone number can have only digits!
 
-    if (password != NULL && strlen(password) > 0)
+    if (password != NULL && password[0] != '\0')
         setAccountPassword(*loggedAccount, password);
-    if (phoneNumber != NULL && strlen(phoneNumber) > 0)
+    if (phoneNumber != NULL && phoneNumber[0] != '\0')
         setAccountPhoneNumber(*loggedAccount, phoneNumber);
-    if (firstName != NULL && strlen(firstName) > 0)
+    if (firstName != NULL && firstName[0] != '\0')
         setAccountFirstName(*loggedAccount, firstName);
-    if (secondName != NULL && strlen(secondName) > 0)
+    if (secondName != NULL && secondName[0] != '\0')
         setAccountSecondName(*loggedAccount, secondName);
     
     return 1;
@@ -532,182 +1075,580 @@ int editAccountService(Account** loggedAccount, const char* currentPassword, con
 //
 ////////////////////
 
-int depositService(Account* account, const char* amount, const char* description, const char* day, const char* month, const char* year) {
-    if (account == NULL)
-        return -401; // Invalid account
-    
-    if (amount == NULL || strlen(amount) == 0)
-        return -402; // Missing amount
-    
-    if (description == NULL)
-        return -403; // Missing description
-    
-    if (strlen(description) > 99)
-        return -404; // Description too long
-    
-    if (!stringOnlyWithDigitsExtended(amount))
-        return -405; // Amount is not a number
-    
-    gdouble moneyAmount = g_ascii_strtod(amount, NULL);
-    if (moneyAmount <= 0)
-        return -406; // Invalid amount
-    
-    int dateResult = validDateForTransaction(day, month, year, account);
-    if (dateResult != 1)
-        return dateResult; // Invalid date
-    
-    Date transactionDate = createDate((short)atoi(day), (short)atoi(month), (short)atoi(year));
-    
-    Transaction* newTransaction = createTransaction(moneyAmount, "main", "deposit", "", "deposit", description, transactionDate);
-    if (newTransaction == NULL)
-        return -407; // Failed to create transaction
-    
+// Appends an already created transaction and moves the balance by its signed amount. The balance and the date
+// are checked again here because the account may have changed, or been deleted, since the request was validated.
+// Expects the caller to hold the account lock.
+static int appendTransaction(Account* account, Transaction* newTransaction, int insufficientBalanceCode) {
+    float signedAmount = getTransactionSignedAmount(newTransaction);
+    Transaction* latestTransaction = getLatestTransaction(account);
+
+    if (isAccountClosed(account))
+        return -353; // This account was deleted
+    if (signedAmount < 0 && getAccountBalance(account) < -signedAmount)
+        return insufficientBalanceCode; // Insufficient balance
+    if (latestTransaction != NULL && compareDates(getTransactionDate(newTransaction), getTransactionDate(latestTransaction)) < 0)
+        return -151; // The last transaction was recorded in the future.
+
     int result = addTransactionForUser(account, newTransaction);
-    if (result != 1) {
-        destroyTransaction(newTransaction);
-        free(newTransaction);
+    if (result != 1)
         return result;
-    }
-    
-    setAccountBalance(account, getAccountBalance(account) + moneyAmount);
-    
+
+    setAccountBalance(account, getAccountBalance(account) + signedAmount);
+    setTransactionRunningBalance(newTransaction, getAccountBalance(account));
+    recordTransactionInAggregates(account, newTransaction);
+
     return 1;
 }
 
-int withdrawService(Account* account, const char* amount, const char* description, const char* day, const char* month, const char* year) {
-    if (account == NULL)
-        return -411; // Invalid account
-    
-    if (amount == NULL || strlen(amount) == 0)
-        return -412; // Missing amount
-    
-    if (description == NULL)
-        return -413; // Missing description
-    
-    if (strlen(description) > 99)
-        return -414; // Description too long
-    
-    if (!stringOnlyWithDigitsExtended(amount))
-        return -415; // Amount is not a number
-    
-    gdouble moneyAmount = g_ascii_strtod(amount, NULL);
-    if (moneyAmount <= 0)
-        return -416; // Invalid amount
-    
-    if (getAccountBalance(account) < moneyAmount)
-        return -417; // Insufficient balance
-    
-    int dateResult = validDateForTransaction(day, month, year, account);
-    if (dateResult != 1)
-        return dateResult; // Invalid date
-    
-    Date transactionDate = createDate((short)atoi(day), (short)atoi(month), (short)atoi(year));
-    
-    Transaction* newTransaction = createTransaction(moneyAmount, "main", "withdraw", "", "withdraw", description, transactionDate);
-    if (newTransaction == NULL)
-        return -418; // Failed to create transaction
-    
-    int result = addTransactionForUser(account, newTransaction);
+// Behaviour of every transaction kind, one row per TransactionKind. The services and the batch both
+// read the row instead of testing the kind, so adding a kind takes an enum value and a row here. Each kind keeps
+// its own error codes, so a batch item fails with the same code as the single service call.
+typedef struct {
+    const char* type;            // Type and category of the history entry
+    short credits;               // Adds to the balance instead of taking from it
+    short needsReceiver;         // Moves the money to another IBAN
+    short screened;              // Debits asked for by the user, checked against the velocity rules
+    short datedAtLatest;         // Booked on the latest date of the history when dated before it
+    int invalidAccountCode;
+    int missingAmountCode;
+    int missingDescriptionCode;
+    int missingReceiverCode;     // 0 when the kind has no receiver
+    int longDescriptionCode;
+    int amountNotNumberCode;
+    int invalidAmountCode;
+    int insufficientBalanceCode; // 0 when the kind credits
+    int createFailedCode;
+} TransactionTypeDescriptor;
+
+static const TransactionTypeDescriptor transactionTypeTable[TRANSACTION_KINDS] = {
+    [TRANSACTION_DEPOSIT]  = {"deposit",  1, 0, 0, 0, -401, -402, -403, 0,    -404, -405, -406, 0,    -407},
+    [TRANSACTION_WITHDRAW] = {"withdraw", 0, 0, 1, 0, -411, -412, -413, 0,    -414, -415, -416, -417, -418},
+    [TRANSACTION_TRANSFER] = {"transfer", 0, 1, 1, 0, -421, -422, -423, -424, -425, -426, -427, -428, -429},
+    [TRANSACTION_PAYMENT]  = {"payment",  0, 0, 1, 0, -431, -432, -433, 0,    -434, -435, -436, -437, -438},
+    [TRANSACTION_INTEREST] = {"interest", 1, 0, 0, 1, -541, -542, -543, 0,    -544, -545, -546, 0,    -547},
+    [TRANSACTION_FEE]      = {"fee",      0, 0, 0, 1, -551, -552, -553, 0,    -554, -555, -556, -557, -558},
+};
+
+// NULL for values outside TransactionKind
+static const TransactionTypeDescriptor* getTransactionTypeDescriptor(TransactionKind kind) {
+    if ((unsigned)kind >= TRANSACTION_KINDS)
+        return NULL;
+    return &transactionTypeTable[kind];
+}
+
+// Appends a transaction of the kind, moved to the latest date of the history first when datedAtLatest is set.
+// A debit the user asked for has to pass the velocity rules of the rule set and is counted once it is in, a
+// screenedAmount of 0 skips them. Expects the caller to hold the account lock.
+static int appendScreenedTransaction(Account* account, Transaction* newTransaction, const TransactionTypeDescriptor* type,
+                                     short datedAtLatest, VelocityRuleSet ruleSet, MoneyAmount screenedAmount,
+                                     const char* receiverIBAN) {
+    Transaction* latestTransaction = getLatestTransaction(account);
+    if (datedAtLatest && latestTransaction != NULL &&
+        compareDates(getTransactionDate(newTransaction), getTransactionDate(latestTransaction)) < 0)
+        setTransactionDate(newTransaction, getTransactionDate(latestTransaction));
+
+    int result = screenedAmount > 0 ? checkVelocityRules(account, ruleSet, screenedAmount, receiverIBAN) : 1;
+    if (result == 1)
+        result = appendTransaction(account, newTransaction, type->insufficientBalanceCode);
+    if (result == 1 && screenedAmount > 0)
+        recordVelocityDebit(account, screenedAmount, receiverIBAN);
+    return result;
+}
+
+// Locked wrapper of appendScreenedTransaction, the transaction is released when it can't be appended
+static int commitTransaction(Account* account, Transaction* newTransaction, const TransactionTypeDescriptor* type,
+                             MoneyAmount screenedAmount) {
+    lockAccount(account);
+    int result = appendScreenedTransaction(account, newTransaction, type, type->datedAtLatest, VELOCITY_RULES_SINGLE,
+                                           screenedAmount, NULL);
+    unlockAccount(account);
+
     if (result != 1) {
         destroyTransaction(newTransaction);
-        free(newTransaction);
+    }
+
+    return result;
+}
+
+// Creates the entry crediting a transfer to the receiver. It can't be dated before the latest transaction of the
+// receiver, whose history has to stay ordered, so it is booked on that date instead.
+static Transaction* createIncomingTransfer(const Account* receiver, const char* senderIBAN, double amount, const char* description, Date date) {
+    Transaction* receiverLatestTransaction = getLatestTransaction(receiver);
+    if (receiverLatestTransaction != NULL && compareDates(date, getTransactionDate(receiverLatestTransaction)) < 0)
+        date = getTransactionDate(receiverLatestTransaction);
+
+    return createTransaction(amount, "main", "incoming", senderIBAN, "incoming", description, date);
+}
+
+// Books a transfer on the sender and, when the receiving IBAN belongs to an account of this bank, the matching
+// incoming transfer on the receiver. Both accounts stay locked for the whole step and are always locked in the
+// same order, so money is never debited without being credited and opposite transfers can't deadlock.
+// A screened amount is checked against the rule set on the sender, as in appendScreenedTransaction. With
+// datedAtLatest a transfer dated before the latest transaction of the sender is booked on that date instead.
+static int bookTransfer(const TransactionTypeDescriptor* type, Account* sender, Account* receiver, double amount,
+                        const char* receiverIBAN, const char* description, Date date, short datedAtLatest,
+                        VelocityRuleSet ruleSet, MoneyAmount screenedAmount) {
+    lockAccountPair(sender, receiver);
+
+    // Checked again under the locks, another transfer may have changed the accounts since validation
+    Transaction* latestTransaction = getLatestTransaction(sender);
+    if (isAccountClosed(sender) || (receiver != NULL && isAccountClosed(receiver))) {
+        unlockAccountPair(sender, receiver);
+        return -353; // This account was deleted
+    }
+    if (getAccountBalance(sender) < amount) {
+        unlockAccountPair(sender, receiver);
+        return type->insufficientBalanceCode;
+    }
+    if (latestTransaction != NULL && compareDates(date, getTransactionDate(latestTransaction)) < 0) {
+        if (!datedAtLatest) {
+            unlockAccountPair(sender, receiver);
+            return -151; // The last transaction was recorded in the future.
+        }
+        date = getTransactionDate(latestTransaction);
+    }
+    if (screenedAmount > 0) {
+        int velocityResult = checkVelocityRules(sender, ruleSet, screenedAmount, receiverIBAN);
+        if (velocityResult != 1) {
+            unlockAccountPair(sender, receiver);
+            return velocityResult;
+        }
+    }
+
+    Transaction* outgoingTransaction = createTransaction(amount, "main", type->type, receiverIBAN, type->type, description, date);
+    Transaction* incomingTransaction = NULL;
+    if (receiver != NULL)
+        incomingTransaction = createIncomingTransfer(receiver, getAccountIban(sender), amount, description, date);
+
+    // Both histories get their slot before anything is written, a failure can't leave half a transfer behind
+    int result = 1;
+    if (outgoingTransaction == NULL || (receiver != NULL && incomingTransaction == NULL))
+        result = type->createFailedCode;
+    else if (reserveTransactionsForUser(sender, 1) != 1 || (receiver != NULL && reserveTransactionsForUser(receiver, 1) != 1))
+        result = -203; // Memory management error
+
+    if (result != 1) {
+        destroyTransaction(outgoingTransaction);
+        destroyTransaction(incomingTransaction);
+        unlockAccountPair(sender, receiver);
         return result;
     }
-    
-    setAccountBalance(account, getAccountBalance(account) - moneyAmount);
-    
+
+    addTransactionForUser(sender, outgoingTransaction);
+    setAccountBalance(sender, getAccountBalance(sender) - amount);
+    setTransactionRunningBalance(outgoingTransaction, getAccountBalance(sender));
+    recordTransactionInAggregates(sender, outgoingTransaction);
+    if (screenedAmount > 0)
+        recordVelocityDebit(sender, screenedAmount, receiverIBAN);
+
+    if (receiver != NULL) {
+        addTransactionForUser(receiver, incomingTransaction);
+        setAccountBalance(receiver, getAccountBalance(receiver) + amount);
+        setTransactionRunningBalance(incomingTransaction, getAccountBalance(receiver));
+        recordTransactionInAggregates(receiver, incomingTransaction);
+        linkTransferLegs(getTransactionId(outgoingTransaction), getTransactionId(incomingTransaction));
+    }
+
+    unlockAccountPair(sender, receiver);
     return 1;
 }
 
-int transferService(Account* account, const char* amount, const char* description, const char* receiverIBAN, const char* day, const char* month, const char* year) {
-    if (account == NULL)
-        return -421; // Invalid account
-    
-    if (amount == NULL || strlen(amount) == 0)
-        return -422; // Missing amount
-    
+// Finds the receiver among the accounts of the bank and holds it for the time of the transfer
+static int commitTransfer(const TransactionTypeDescriptor* type, RepositoryFormat* repository, Account* sender, double amount,
+                          const char* receiverIBAN, const char* description, Date date, short datedAtLatest,
+                          VelocityRuleSet ruleSet, MoneyAmount screenedAmount) {
+    Account* receiver = findAccountByIban(repository, receiverIBAN);
+    int result = receiver == sender ? -430 // You can't transfer money to your own account
+                                    : bookTransfer(type, sender, receiver, amount, receiverIBAN, description, date, datedAtLatest,
+                                                   ruleSet, screenedAmount);
+    releaseAccount(receiver);
+    return result;
+}
+
+// The one path every single transaction takes. It is inlined into each caller with a constant row of the table,
+// so the compiler drops the checks that don't apply to the kind.
+static inline int executeTransaction(const TransactionTypeDescriptor* type, RepositoryFormat* repository, Account* account,
+                                     MoneyAmount amount, const char* description, const char* receiverIBAN, Date date) {
+    if (account == NULL || (type->needsReceiver && repository == NULL))
+        return type->invalidAccountCode;
+
     if (description == NULL)
-        return -423; // Missing description
-    
-    if (receiverIBAN == NULL || strlen(receiverIBAN) == 0)
-        return -424; // Missing receiver IBAN
-    
+        return type->missingDescriptionCode;
+
+    if (type->needsReceiver && (receiverIBAN == NULL || receiverIBAN[0] == '\0'))
+        return type->missingReceiverCode;
+
     if (strlen(description) > 99)
-        return -425; // Description too long
-    
-    if (!stringOnlyWithDigitsExtended(amount))
-        return -426; // Amount is not a number
-    
-    gdouble moneyAmount = g_ascii_strtod(amount, NULL);
-    if (moneyAmount <= 0)
-        return -427; // Invalid amount
-    
-    if (getAccountBalance(account) < moneyAmount)
-        return -428; // Insufficient balance
-    
-    int dateResult = validDateForTransaction(day, month, year, account);
+        return type->longDescriptionCode;
+
+    if (amount <= 0 || amount > MONEY_AMOUNT_MAX)
+        return type->invalidAmountCode;
+
+    // The history and the balance keep floating amounts, the cents are converted once here
+    double moneyAmount = (double)amount / MONEY_CENTS;
+    if (!type->credits && getAccountBalance(account) < moneyAmount)
+        return type->insufficientBalanceCode;
+
+    // Only the date itself is checked here, the history can't be read without the lock of the account. The commit
+    // compares it with the latest transaction once the lock is held.
+    int dateResult = validTransactionDate(date, NULL);
     if (dateResult != 1)
         return dateResult; // Invalid date
-    
-    Date transactionDate = createDate((short)atoi(day), (short)atoi(month), (short)atoi(year));
-    
-    Transaction* newTransaction = createTransaction(moneyAmount, "main", "transfer", receiverIBAN, "transfer", description, transactionDate);
+
+    if (type->needsReceiver)
+        return commitTransfer(type, repository, account, moneyAmount, receiverIBAN, description, date, type->datedAtLatest,
+                              VELOCITY_RULES_SINGLE, type->screened ? amount : 0);
+
+    Transaction* newTransaction = createTransaction(moneyAmount, "main", type->type, "", type->type, description, date);
     if (newTransaction == NULL)
-        return -429; // Failed to create transaction
-    
-    int result = addTransactionForUser(account, newTransaction);
+        return type->createFailedCode;
+
+    return commitTransaction(account, newTransaction, type, type->screened ? amount : 0);
+}
+
+int transactionServiceTyped(RepositoryFormat* repository, Account* account, TransactionKind kind, MoneyAmount amount,
+                            const char* description, const char* receiverIBAN, PackedDate date) {
+    const TransactionTypeDescriptor* type = getTransactionTypeDescriptor(kind);
+    if (type == NULL)
+        return -444; // Unknown transaction kind
+
+    return executeTransaction(type, repository, account, amount, description, receiverIBAN, unpackDate(date));
+}
+
+// Parses the string arguments shared by the transaction services
+static inline int parseTransactionArguments(const TransactionTypeDescriptor* type, const Account* account, const char* amount,
+                                            const char* day, const char* month, const char* year,
+                                            MoneyAmount* moneyAmount, PackedDate* transactionDate) {
+    if (account == NULL)
+        return type->invalidAccountCode;
+
+    if (amount == NULL || amount[0] == '\0')
+        return type->missingAmountCode;
+
+    if (!parseMoneyAmount(amount, moneyAmount))
+        return type->amountNotNumberCode;
+
+    return parseTransactionDate(day, month, year, transactionDate);
+}
+
+// Defines the string service of a kind that only moves money on the account itself: parse the arguments, then
+// run the transaction path specialised for that kind
+#define DEFINE_ACCOUNT_TRANSACTION_SERVICE(serviceName, kind)                                                          \
+    int serviceName(Account* account, const char* amount, const char* description, const char* day, const char* month, \
+                    const char* year) {                                                                                \
+        const TransactionTypeDescriptor* type = &transactionTypeTable[kind];                                          \
+        MoneyAmount moneyAmount;                                                                                       \
+        PackedDate transactionDate;                                                                                    \
+        int result = parseTransactionArguments(type, account, amount, day, month, year, &moneyAmount, &transactionDate); \
+        if (result != 1)                                                                                               \
+            return result;                                                                                             \
+        return executeTransaction(type, NULL, account, moneyAmount, description, NULL, unpackDate(transactionDate));   \
+    }
+
+DEFINE_ACCOUNT_TRANSACTION_SERVICE(depositService, TRANSACTION_DEPOSIT)
+DEFINE_ACCOUNT_TRANSACTION_SERVICE(withdrawService, TRANSACTION_WITHDRAW)
+DEFINE_ACCOUNT_TRANSACTION_SERVICE(paymentService, TRANSACTION_PAYMENT)
+
+int transferService(RepositoryFormat* repository, Account* account, const char* amount, const char* description, const char* receiverIBAN, const char* day, const char* month, const char* year) {
+    const TransactionTypeDescriptor* type = &transactionTypeTable[TRANSACTION_TRANSFER];
+    MoneyAmount moneyAmount;
+    PackedDate transactionDate;
+
+    int result = parseTransactionArguments(type, account, amount, day, month, year, &moneyAmount, &transactionDate);
+    if (result != 1)
+        return result;
+
+    return executeTransaction(type, repository, account, moneyAmount, description, receiverIBAN, unpackDate(transactionDate));
+}
+
+// Entry compensating one leg of a reversed transaction: money taken in is taken back, money taken out is refunded.
+// It is dated at the latest transaction of the account when the requested date is earlier.
+static Transaction* createCompensatingTransaction(const Account* account, const Transaction* original, const char* description, Date date) {
+    Transaction* latestTransaction = getLatestTransaction(account);
+    if (latestTransaction != NULL && compareDates(date, getTransactionDate(latestTransaction)) < 0)
+        date = getTransactionDate(latestTransaction);
+
+    const char* type = getTransactionSignedAmount(original) > 0 ? "reversal" : "refund";
+    return createTransaction(getTransactionAmount(original), "main", type, getTransactionReceiverIban(original), "reversal",
+                             description, date);
+}
+
+static short isCompensatingTransaction(const Transaction* transaction) {
+    const char* type = getTransactionType(transaction);
+    return type != NULL && (strcmp(type, "reversal") == 0 || strcmp(type, "refund") == 0);
+}
+
+// Reverses the entries at the positions of the held accounts, locking both for the whole step
+static int applyReversal(Account** accounts, const int* positions, const guint64* ids, guint64 transactionId,
+                         const char* description, PackedDate date) {
+    lockAccountPair(accounts[0], accounts[1]);
+
+    Transaction* originals[2] = {getAccountTransaction(accounts[0], positions[0]), NULL};
+    if (accounts[1] != NULL)
+        originals[1] = getAccountTransaction(accounts[1], positions[1]);
+
+    int result = 1;
+    if (isAccountClosed(accounts[0]) || (accounts[1] != NULL && isAccountClosed(accounts[1])))
+        result = -353; // This account was deleted
+
+    g_mutex_lock(&transactionIndexLock);
+    TransactionIndexEntry* entry = lookupTransactionIndex(transactionId);
+    if (result == 1 && (entry == NULL || originals[0] == NULL || (accounts[1] != NULL && originals[1] == NULL)))
+        result = -491; // Unknown transaction
+    else if (result == 1 && entry->reversalId != 0)
+        result = -494; // The transaction was already reversed
+    g_mutex_unlock(&transactionIndexLock);
+
+    if (result == 1 && isCompensatingTransaction(originals[0]))
+        result = -495; // A reversal can't be reversed
+
+    // Every check is done before the first entry is written, so a transfer is never reversed on one side only
+    Transaction* compensations[2] = {NULL, NULL};
+    for (int i = 0; i < 2 && result == 1 && accounts[i] != NULL; i++) {
+        compensations[i] = createCompensatingTransaction(accounts[i], originals[i], description, unpackDate(date));
+        float signedAmount = getTransactionSignedAmount(compensations[i]);
+
+        if (compensations[i] == NULL)
+            result = -496; // Failed to create the reversal
+        else if (signedAmount < 0 && getAccountBalance(accounts[i]) < -signedAmount)
+            result = -497; // Insufficient balance to take the money back
+        else if (reserveTransactionsForUser(accounts[i], 1) != 1)
+            result = -203; // Memory management error
+    }
+
     if (result != 1) {
-        destroyTransaction(newTransaction);
-        free(newTransaction);
+        destroyTransaction(compensations[0]);
+        destroyTransaction(compensations[1]);
+        unlockAccountPair(accounts[0], accounts[1]);
         return result;
     }
-    
-    setAccountBalance(account, getAccountBalance(account) - moneyAmount);
-    
+
+    for (int i = 0; i < 2 && accounts[i] != NULL; i++)
+        appendTransaction(accounts[i], compensations[i], -497);
+
+    g_mutex_lock(&transactionIndexLock);
+    for (int i = 0; i < 2 && accounts[i] != NULL; i++) {
+        TransactionIndexEntry* reversedEntry = lookupTransactionIndex(ids[i]);
+        if (reversedEntry != NULL)
+            reversedEntry->reversalId = getTransactionId(compensations[i]);
+    }
+    g_mutex_unlock(&transactionIndexLock);
+
+    unlockAccountPair(accounts[0], accounts[1]);
     return 1;
 }
 
-int paymentService(Account* account, const char* amount, const char* description, const char* day, const char* month, const char* year) {
-    if (account == NULL)
-        return -431; // Invalid account
-    
-    if (amount == NULL || strlen(amount) == 0)
-        return -432; // Missing amount
-    
+int reverseTransactionService(guint64 transactionId, const char* description, PackedDate date) {
     if (description == NULL)
-        return -433; // Missing description
-    
+        return -492; // Missing description
+
     if (strlen(description) > 99)
-        return -434; // Description too long
-    
-    if (!stringOnlyWithDigitsExtended(amount))
-        return -435; // Amount is not a number
-    
-    gdouble moneyAmount = g_ascii_strtod(amount, NULL);
-    if (moneyAmount <= 0)
-        return -436; // Invalid amount
-    
-    if (getAccountBalance(account) < moneyAmount)
-        return -437; // Insufficient balance
-    
-    int dateResult = validDateForTransaction(day, month, year, account);
-    if (dateResult != 1)
-        return dateResult; // Invalid date
-    
-    Date transactionDate = createDate((short)atoi(day), (short)atoi(month), (short)atoi(year));
-    
-    Transaction* newTransaction = createTransaction(moneyAmount, "main", "payment", "", "payment", description, transactionDate);
-    if (newTransaction == NULL)
-        return -438; // Failed to create transaction
-    
-    int result = addTransactionForUser(account, newTransaction);
-    if (result != 1) {
-        destroyTransaction(newTransaction);
-        free(newTransaction);
-        return result;
+        return -493; // The description is too long
+
+    // Both legs of a transfer inside the bank are reversed together
+    Account* accounts[2] = {NULL, NULL};
+    int positions[2];
+    guint64 ids[2] = {transactionId, 0};
+
+    g_mutex_lock(&transactionIndexLock);
+    TransactionIndexEntry* entry = lookupTransactionIndex(transactionId);
+    TransactionIndexEntry* counterpart = entry != NULL ? lookupTransactionIndex(entry->counterpartId) : NULL;
+    // Entries are dropped before their account is released, so the accounts are still alive to be held here
+    if (entry != NULL) {
+        accounts[0] = retainAccount(entry->account);
+        positions[0] = entry->position;
     }
-    
-    setAccountBalance(account, getAccountBalance(account) - moneyAmount);
-    
-    return 1;
-}
\ No newline at end of file
+    if (counterpart != NULL) {
+        accounts[1] = retainAccount(counterpart->account);
+        positions[1] = counterpart->position;
+        ids[1] = counterpart->id;
+    }
+    // The other leg went to a closed period, reversing this one alone would create money
+    short counterpartArchived = entry != NULL && entry->counterpartId != 0 && counterpart == NULL;
+    g_mutex_unlock(&transactionIndexLock);
+
+    if (accounts[0] == NULL)
+        return -491; // Unknown transaction
+
+    if (counterpartArchived) {
+        releaseAccount(accounts[0]);
+        return -498; // The other leg of the transfer was archived, it can't be reversed anymore
+    }
+
+    int result = applyReversal(accounts, positions, ids, transactionId, description, date);
+    releaseAccount(accounts[0]);
+    releaseAccount(accounts[1]);
+    return result;
+}
+
+////////////////////
+//
+//  Batch transaction services
+//
+////////////////////
+
+typedef struct {
+    Account* account;
+    int index;
+} BatchEntry;
+
+// Orders the batch by account and keeps the submission order inside every account
+static int compareBatchEntries(const void* first, const void* second) {
+    const BatchEntry* firstEntry = first;
+    const BatchEntry* secondEntry = second;
+    if (firstEntry->account != secondEntry->account)
+        return (uintptr_t)firstEntry->account < (uintptr_t)secondEntry->account ? -1 : 1;
+    return firstEntry->index - secondEntry->index;
+}
+
+// Checks one operation against the balance and latest date the account will have when the operation runs
+static int validateBatchOperation(const TransactionOperation* operation, float balance, const Date* latestDate) {
+    const TransactionTypeDescriptor* type = &transactionTypeTable[operation->kind];
+
+    if (operation->account == NULL)
+        return type->invalidAccountCode;
+
+    if (operation->description == NULL)
+        return type->missingDescriptionCode;
+
+    if (type->needsReceiver && (operation->receiverIBAN == NULL || operation->receiverIBAN[0] == '\0'))
+        return type->missingReceiverCode;
+
+    if (strlen(operation->description) > 99)
+        return type->longDescriptionCode;
+
+    // Bounded like the parsed amounts before anything converts it to cents, written so that NaN fails too
+    if (!(operation->amount > 0 && operation->amount <= (double)MONEY_AMOUNT_MAX / MONEY_CENTS))
+        return type->invalidAmountCode;
+
+    if (!type->credits && balance < operation->amount)
+        return type->insufficientBalanceCode;
+
+    return validTransactionDate(operation->date, latestDate);
+}
+
+static short isDatedAtLatest(const TransactionOperation* operation) {
+    return transactionTypeTable[operation->kind].datedAtLatest || operation->datedAtLatest;
+}
+
+// Cents of the operation checked against the batch velocity rules, 0 for the kinds that aren't screened, for
+// operations the holder agreed to beforehand and while the batch rules are all off
+static MoneyAmount getScreenedAmount(const TransactionOperation* operation) {
+    if (!transactionTypeTable[operation->kind].screened || operation->preAuthorized || !hasVelocityRules(VELOCITY_RULES_BATCH))
+        return 0;
+    return (MoneyAmount)(operation->amount * MONEY_CENTS + 0.5);
+}
+
+int batchTransactionService(RepositoryFormat* repository, const TransactionOperation* operations, int operationsNumber, int* results) {
+    if (repository == NULL || operations == NULL || operationsNumber < 0)
+        return -441; // Invalid operations
+
+    if (results == NULL)
+        return -442; // Invalid results array
+
+    BatchEntry* entries = malloc((operationsNumber + 1) * sizeof(BatchEntry));
+    if (entries == NULL)
+        return -443; // Memory allocation failed
+
+    for (int i = 0; i < operationsNumber; i++) {
+        entries[i].account = operations[i].account;
+        entries[i].index = i;
+    }
+    qsort(entries, operationsNumber, sizeof(BatchEntry), compareBatchEntries);
+
+    int appliedOperations = 0;
+    int groupStart = 0;
+    while (groupStart < operationsNumber) {
+        Account* account = entries[groupStart].account;
+        int groupEnd = groupStart + 1;
+        while (groupEnd < operationsNumber && entries[groupEnd].account == account)
+            groupEnd++;
+
+        lockAccount(account);
+
+        if (account != NULL && isAccountClosed(account)) {
+            for (int i = groupStart; i < groupEnd; i++)
+                results[entries[i].index] = -353; // This account was deleted
+            unlockAccount(account);
+            groupStart = groupEnd;
+            continue;
+        }
+
+        // Validation pass: every operation is checked against the state left by the ones before it
+        float balance = getAccountBalance(account);
+        Transaction* latestTransaction = account != NULL ? getLatestTransaction(account) : NULL;
+        Date latestDate = getTransactionDate(latestTransaction);
+        short hasLatestDate = latestTransaction != NULL;
+        int validOperations = 0;
+
+        for (int i = groupStart; i < groupEnd; i++) {
+            const TransactionOperation* operation = &operations[entries[i].index];
+            const TransactionTypeDescriptor* type = getTransactionTypeDescriptor(operation->kind);
+            if (type == NULL) {
+                results[entries[i].index] = -444; // Unknown transaction kind
+                continue;
+            }
+
+            int result = validateBatchOperation(operation, balance, hasLatestDate && !isDatedAtLatest(operation) ? &latestDate : NULL);
+            results[entries[i].index] = result;
+            if (result != 1)
+                continue;
+
+            balance = type->credits ? (float)(balance + operation->amount) : (float)(balance - operation->amount);
+            if (!hasLatestDate || compareDates(operation->date, latestDate) > 0)
+                latestDate = operation->date;
+            hasLatestDate = 1;
+            validOperations++;
+        }
+
+        // Apply pass: one history reservation for the whole group, then only appends
+        if (validOperations > 0 && reserveTransactionsForUser(account, validOperations) != 1) {
+            for (int i = groupStart; i < groupEnd; i++)
+                if (results[entries[i].index] == 1)
+                    results[entries[i].index] = -203; // Memory management error
+            validOperations = 0;
+        }
+
+        for (int i = groupStart; i < groupEnd && validOperations > 0; i++) {
+            const TransactionOperation* operation = &operations[entries[i].index];
+            if (results[entries[i].index] != 1)
+                continue;
+
+            const TransactionTypeDescriptor* type = &transactionTypeTable[operation->kind];
+            if (type->needsReceiver) {
+                // Transfers also credit the receiver, which takes both account locks in their fixed order
+                unlockAccount(account);
+                results[entries[i].index] = commitTransfer(type, repository, account, operation->amount, operation->receiverIBAN,
+                                                           operation->description, operation->date, isDatedAtLatest(operation),
+                                                           VELOCITY_RULES_BATCH, getScreenedAmount(operation));
+                lockAccount(account);
+                if (results[entries[i].index] == 1)
+                    appliedOperations++;
+                continue;
+            }
+
+            Transaction* newTransaction = createTransaction(operation->amount, "main", type->type, "", type->type,
+                                                            operation->description, operation->date);
+            if (newTransaction == NULL) {
+                results[entries[i].index] = type->createFailedCode;
+                continue;
+            }
+
+            // The lock may have been released for a transfer, so the state is checked again on append
+            int result = appendScreenedTransaction(account, newTransaction, type, isDatedAtLatest(operation), VELOCITY_RULES_BATCH,
+                                                   getScreenedAmount(operation), NULL);
+            if (result != 1) {
+                destroyTransaction(newTransaction);
+                results[entries[i].index] = result;
+                continue;
+            }
+            appliedOperations++;
+        }
+
+        unlockAccount(account);
+        groupStart = groupEnd;
+    }
+
+    free(entries);
+    return appliedOperations; // Number of operations applied, the code of every operation is in results
+}
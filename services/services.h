@@ -1,17 +1,190 @@
 #ifndef GENTLIX_BANK_SERVICES_H
 #define GENTLIX_BANK_SERVICES_H
 
-#include <gtk/gtk.h>
+#include <glib.h>
 #include "../domain/domain.h"
 #include "../repository/repository.h"
 
+// Character classes a validated field may contain, combined as flags
+typedef enum {
+    CHARACTER_CLASS_LETTER = 1 << 0,    // ASCII letters
+    CHARACTER_CLASS_DIGIT = 1 << 1,
+    CHARACTER_CLASS_SEPARATOR = 1 << 2  // Decimal separators, ',' and '.'
+} CharacterClass;
+
+// Fixed point money amount in cents, used by the typed services
+typedef gint64 MoneyAmount;
+#define MONEY_CENTS 100
+#define MONEY_AMOUNT_MAX ((MoneyAmount)1000000000000000) // Ten trillion, in cents
+
+// Typed transaction operation, used by the batch entry point
+typedef enum {
+    TRANSACTION_DEPOSIT,
+    TRANSACTION_WITHDRAW,
+    TRANSACTION_TRANSFER,
+    TRANSACTION_PAYMENT,
+    TRANSACTION_INTEREST, // Interest and fees booked on the main balance, such as a batch of corrections
+    TRANSACTION_FEE,
+    TRANSACTION_KINDS
+} TransactionKind;
+
+typedef struct {
+    Account* account;
+    TransactionKind kind;
+    double amount;
+    const char* description;
+    const char* receiverIBAN; // Only used by transfers
+    Date date;
+    short datedAtLatest;      // Booked on the latest date of the account when dated before it, for late catch-ups
+    short preAuthorized;      // Agreed by the holder beforehand, like a standing order: not screened by the velocity rules
+} TransactionOperation;
+
+// Completion of a service run on another thread, called there with the code the service returned
+typedef void (*ServiceCallback)(int result, gpointer userData);
+
+// Service dispatcher, a bounded queue in front of the services drained by a pool of workers
+typedef struct ServiceDispatcher ServiceDispatcher;
+typedef int (*ServiceFunction)(gpointer data); // Runs one service call on a worker, returns its result code
+
+typedef enum {
+    DISPATCH_REJECT_WHEN_FULL, // submitServiceRequest fails with -463 while the queue is full
+    DISPATCH_BLOCK_WHEN_FULL   // submitServiceRequest waits for a free slot
+} DispatchBackpressure;
+
+// Priority classes of dispatched requests, scheduled by weight so bulk jobs can't hold up the user
+typedef enum {
+    SERVICE_PRIORITY_INTERACTIVE, // Calls made for the user in front of the GUI (login, deposit, ...)
+    SERVICE_PRIORITY_STANDARD,
+    SERVICE_PRIORITY_BULK,        // Long jobs such as imports or interest runs, split into many requests
+    SERVICE_PRIORITY_CLASSES
+} ServicePriority;
+
+// Logged in sessions, looked up by token on every request and closed after a while without use
+typedef struct SessionTable SessionTable;
+#define SESSION_TOKEN_SIZE 33 // 32 hex characters and the terminator
+
+// Keys clients attach to transaction requests, a key seen again in the window returns the first result
+typedef struct IdempotencyCache IdempotencyCache;
+#define IDEMPOTENCY_KEY_MAX_LENGTH 64
+
+// Login attempts allowed per account tag and for the whole bank, checked before the repository is searched
+typedef struct LoginLimiter LoginLimiter;
+
+// Standing orders to affiliates, paid through the batch service when they are due
+typedef struct PaymentScheduler PaymentScheduler;
+
+typedef enum {
+    SCHEDULE_DAILY,
+    SCHEDULE_WEEKLY,
+    SCHEDULE_MONTHLY, // On the day of the first payment, or the last day of shorter months
+    SCHEDULE_FREQUENCIES
+} ScheduleFrequency;
+
+// Interest and fee job over the whole repository, stopped by setting stopRequested and resumed from the cursor
+typedef struct {
+    int workersNumber;       // 0 for one per processor
+    const char* cursorPath;  // NULL to run without resuming
+    const gint* stopRequested;
+} InterestJobOptions;
+
+typedef struct {
+    int accountsVisited;
+    int interestPosted;
+    int feesCharged;
+    int feesSkipped;          // Balance too low for the fee
+    int chunksDone;
+    int cursorErrors;
+    MoneyAmount interestAmount;
+    MoneyAmount feesAmount;
+} InterestJobSummary;
+
+// Single service calls and batch operations are screened by rule sets of their own, so a payroll file isn't
+// held to the limits of a user at the counter
+typedef enum {
+    VELOCITY_RULES_SINGLE,
+    VELOCITY_RULES_BATCH, // All off unless set, batches are submitted by the bank
+    VELOCITY_RULE_SETS
+} VelocityRuleSet;
+
+// Limits on the debits of one account, checked by withdrawals, transfers and payments. 0 turns a limit off.
+typedef struct {
+    int maxDebitsPerHour;
+    MoneyAmount maxAmountPerHour;
+    int maxDebitsPerDay;
+    MoneyAmount maxAmountPerDay;
+    int maxNewReceiversPerDay; // IBANs the account transfers to for the first time
+} VelocityRules;
+
+// Outcome of a run of the monthly statements
+typedef struct {
+    int statementsWritten;
+    int statementsFailed;
+    int accountsDeferred;        // Busy when their turn came, written after the others
+    gint64 elapsedMicroseconds;
+    double statementsPerSecond;
+} StatementRunSummary;
+
+// Hot spot transaction benchmark, hotSpotPercent of the transactions land on the same account
+typedef struct {
+    int workersNumber;
+    int accountsNumber;
+    int transfersPerWorker;
+    int hotSpotPercent;
+    TransactionKind kind;     // Deposit, withdraw, transfer or payment
+} TransferBenchmarkOptions;
+
+typedef struct {
+    int transfersDone;
+    int transfersFailed;
+    gint64 elapsedMicroseconds;
+    double transfersPerSecond;
+} TransferBenchmarkSummary;
+
+// Archive benchmark, the closed periods of accounts with months of history are archived and measured
+typedef struct {
+    int accountsNumber;
+    int months;
+    int transactionsPerMonth;
+    int openMonths;           // Months kept resident, as in archiveClosedPeriods
+} ArchiveBenchmarkOptions;
+
+typedef struct {
+    int transactionsNumber;   // Booked while building the history, incoming transfers included
+    int archivedTransactions;
+    size_t rawBytes;          // Archived transactions as they were in memory
+    size_t compressedBytes;   // The same transactions compressed in their segments
+    double rawBytesPerTransaction;
+    double compressedBytesPerTransaction;
+    gint64 elapsedMicroseconds; // Time spent archiving
+} ArchiveBenchmarkSummary;
+
+typedef struct {
+    int queueDepth;
+    guint64 completedRequests;
+    gint64 averageWaitMicroseconds; // Time spent in the queue
+    gint64 maxWaitMicroseconds;
+    gint64 averageRunMicroseconds;  // Time spent in the service itself
+} DispatchClassMetrics;
+
 // Memory management functions
 int addTransactionForUser(Account* account, Transaction* newTransaction);
+int reserveTransactionsForUser(Account* account, int additionalTransactions);
 Transaction* getLatestTransaction(const Account* account);
 int addAffiliateToAccount(Account* account, Affiliate* newAffiliate);
 int removeAffiliateFromAccount(Account* account, const char* affiliateTag);
 int addNewUserAccount(Account* account, UserAccounts* newUserAccount);
 int removeAnUserAccount(Account* account, const char* userAccountType);
+int recordTransactionInAggregates(Account* account, const Transaction* transaction);
+int rebuildMonthlyAggregates(Account* account);
+int archiveClosedPeriods(Account* account, int openMonths);
+int spillColdHistory(Account* account, const char* directory, int openMonths);
+
+// Query functions
+int findTransactionsInDateRange(const Account* account, Date startDate, Date endDate, int* firstIndex, int* lastIndex);
+int getAccountBalanceAtDate(const Account* account, Date date, float* balance);
+MonthlyAggregate* getMonthlyAggregate(Account* account, short year, short month, const char* category);
+int findTransactionById(guint64 transactionId, Account** account, int* position);
+int getAccountArchiveStatistics(const Account* account, size_t* rawBytes, size_t* compressedBytes);
 
 // Check functions
 short accountTagUsed(const RepositoryFormat* receivedRepository, const gchar *checkedTag);
@@ -23,10 +196,19 @@ short validDate(const gchar *day, const gchar *month, const gchar *year);
 short validDateForTransaction(const gchar *day, const gchar *month, const gchar *year, const Account* account);
 short availableAccountType(const char* accountType);
 
+// Character class validation (validation.c), returns the length of the field or -1 when it has another character
+gssize scanCharacterClass(const gchar *text, int classes);
+
+// Parse functions, single pass over the text and no allocation
+short parseMoneyAmount(const gchar *text, MoneyAmount *amount);
+int parseBirthDate(const gchar *day, const gchar *month, const gchar *year, PackedDate *date);
+int parseTransactionDate(const gchar *day, const gchar *month, const gchar *year, PackedDate *date);
+
 // Utility function
 void generateRandomIBAN(char* iban);
 
-// Services functions
+// Services functions. Login and create hand back an account held for the caller, who releases it with
+// releaseAccount once done. Delete closes the account, the caller still releases its own reference.
 int loginService(RepositoryFormat* repository, const char* username, const char* password, Account** loggedUser);
 int createAccountService(RepositoryFormat* repository, const char* accountTag, const char* password, const char* passwordConfirm, const char* accountType, const char* phoneNumber,
                          const char* firstName, const char* secondName, const char* day, const char* month, const char* year, Account** loggedAccount);
@@ -37,7 +219,113 @@ int editAccountService(Account** loggedAccount, const char* currentPassword, con
 // Transaction services
 int depositService(Account* account, const char* amount, const char* description, const char* day, const char* month, const char* year);
 int withdrawService(Account* account, const char* amount, const char* description, const char* day, const char* month, const char* year);
-int transferService(Account* account, const char* amount, const char* description, const char* receiverIBAN, const char* day, const char* month, const char* year);
+int transferService(RepositoryFormat* repository, Account* account, const char* amount, const char* description, const char* receiverIBAN, const char* day, const char* month, const char* year);
 int paymentService(Account* account, const char* amount, const char* description, const char* day, const char* month, const char* year);
 
+// Appends entries compensating the transaction with this id, on both accounts for a transfer inside the bank.
+// Transactions of archived periods are no longer indexed and can't be reversed.
+int reverseTransactionService(guint64 transactionId, const char* description, PackedDate date);
+
+// Typed transaction service, the string services above parse their arguments and call it. Apart from the
+// history entries it appends it allocates nothing.
+int transactionServiceTyped(RepositoryFormat* repository, Account* account, TransactionKind kind, MoneyAmount amount,
+                            const char* description, const char* receiverIBAN, PackedDate date);
+
+// Batch transaction services
+int batchTransactionService(RepositoryFormat* repository, const TransactionOperation* operations, int operationsNumber, int* results);
+
+// Service dispatcher (dispatcher.c)
+ServiceDispatcher* createServiceDispatcher(int workersNumber, int queueCapacity, DispatchBackpressure backpressure);
+void destroyServiceDispatcher(ServiceDispatcher* dispatcher);
+int submitServiceRequest(ServiceDispatcher* dispatcher, ServicePriority priority, ServiceFunction function, gpointer data,
+                         GDestroyNotify destroyData, ServiceCallback callback, gpointer userData);
+int getServiceDispatcherMetrics(ServiceDispatcher* dispatcher, ServicePriority priority, DispatchClassMetrics* metrics);
+
+// Session table (sessions.c). A session holds its account, getSessionAccount returns it held for the caller.
+SessionTable* createSessionTable(int idleTimeoutSeconds);
+void destroySessionTable(SessionTable* table);
+int openSession(SessionTable* table, Account* account, char* token);
+Account* getSessionAccount(SessionTable* table, const char* token);
+short isSessionOpen(SessionTable* table, const char* token);
+int closeSession(SessionTable* table, const char* token);
+int closeAccountSessions(SessionTable* table, const Account* account);
+int expireIdleSessions(SessionTable* table);
+int getSessionsNumber(SessionTable* table);
+
+// Idempotency keys (idempotency.c). Begin returns 1 when the request has to run and finish has to be called
+// with its result, 0 when it already ran and result holds what it returned.
+IdempotencyCache* createIdempotencyCache(int capacity, int windowSeconds, const char* journalPath);
+void destroyIdempotencyCache(IdempotencyCache* cache);
+int beginIdempotentRequest(IdempotencyCache* cache, const Account* account, const char* key, int* result);
+int finishIdempotentRequest(IdempotencyCache* cache, const Account* account, const char* key, int result);
+int transactionServiceIdempotent(IdempotencyCache* cache, const char* idempotencyKey, RepositoryFormat* repository, Account* account,
+                                 TransactionKind kind, MoneyAmount amount, const char* description, const char* receiverIBAN,
+                                 PackedDate date);
+
+// Scheduled payments (schedules.c), a run pays everything due up to today and returns how many were paid
+PaymentScheduler* createPaymentScheduler(void);
+void destroyPaymentScheduler(PaymentScheduler* scheduler);
+int schedulePayment(PaymentScheduler* scheduler, Account* account, const char* affiliateTag, MoneyAmount amount,
+                    const char* description, ScheduleFrequency frequency, PackedDate firstDate, guint64* paymentId);
+int cancelScheduledPayment(PaymentScheduler* scheduler, guint64 paymentId);
+int cancelAccountSchedules(PaymentScheduler* scheduler, const Account* account);
+int getScheduledPaymentStatus(PaymentScheduler* scheduler, guint64 paymentId, PackedDate* nextDate, int* lastResult);
+int runDuePayments(PaymentScheduler* scheduler, RepositoryFormat* repository, PackedDate today);
+
+// Login throttling (throttle.c). Begin returns 1 when the attempt may go on, finish reports whether the
+// password was right so wrong ones in a row lock the tag out for longer and longer. The limiter is sized for
+// the accounts of the bank and grows with them.
+LoginLimiter* createLoginLimiter(int accountsNumber, int attemptsPerSecond);
+void destroyLoginLimiter(LoginLimiter* limiter);
+int beginLoginAttempt(LoginLimiter* limiter, const char* tag);
+void finishLoginAttempt(LoginLimiter* limiter, const char* tag, short succeeded);
+int loginServiceThrottled(LoginLimiter* limiter, RepositoryFormat* repository, const char* username, const char* password,
+                          Account** loggedUser);
+
+// Velocity checks (velocity.c). The rules are set once at start, before any service runs. The check and the
+// record expect the caller to hold the lock of the account, the record follows a debit that passed the check.
+void setVelocityRules(VelocityRuleSet ruleSet, const VelocityRules* rules);
+void getVelocityRules(VelocityRuleSet ruleSet, VelocityRules* rules);
+short hasVelocityRules(VelocityRuleSet ruleSet);
+int checkVelocityRules(Account* account, VelocityRuleSet ruleSet, MoneyAmount amount, const char* receiverIBAN);
+void recordVelocityDebit(Account* account, MoneyAmount amount, const char* receiverIBAN);
+
+// Interest and fee job (interest.c), returns 1 when every account was visited and 0 when it was stopped before
+int runInterestJob(RepositoryFormat* repository, PackedDate postingDate, const InterestJobOptions* options, InterestJobSummary* summary);
+
+// Monthly statements (statements.c), one file per account in the directory, returns how many were written
+int generateMonthlyStatements(RepositoryFormat* repository, short year, short month, const char* directory, int workersNumber,
+                              StatementRunSummary* summary);
+
+// Transaction benchmark (transferBenchmark.c), runs on a repository of its own and returns 1 once measured
+int runTransferBenchmark(const TransferBenchmarkOptions* options, TransferBenchmarkSummary* summary);
+
+// Archive benchmark (archiveBenchmark.c), runs on a repository of its own and returns 1 once measured
+int runArchiveBenchmark(const ArchiveBenchmarkOptions* options, ArchiveBenchmarkSummary* summary);
+
+// Asynchronous services (asyncServices.c), the callback runs on the main context of the calling thread
+int loginServiceAsync(ServiceDispatcher* dispatcher, LoginLimiter* limiter, RepositoryFormat* repository, const char* username, const char* password,
+                      Account** loggedUser, ServiceCallback callback, gpointer userData);
+int createAccountServiceAsync(ServiceDispatcher* dispatcher, RepositoryFormat* repository, const char* accountTag, const char* password,
+                              const char* passwordConfirm, const char* accountType, const char* phoneNumber, const char* firstName,
+                              const char* secondName, const char* day, const char* month, const char* year, Account** loggedAccount,
+                              ServiceCallback callback, gpointer userData);
+int deleteAccountServiceAsync(ServiceDispatcher* dispatcher, RepositoryFormat* repository, Account** loggedAccount,
+                              ServiceCallback callback, gpointer userData);
+int editAccountServiceAsync(ServiceDispatcher* dispatcher, Account** loggedAccount, const char* currentPassword, const char* password,
+                            const char* passwordConfirm, const char* accountType, const char* phoneNumber, const char* firstName,
+                            const char* secondName, const char* day, const char* month, const char* year,
+                            ServiceCallback callback, gpointer userData);
+int depositServiceAsync(ServiceDispatcher* dispatcher, Account* account, const char* amount, const char* description,
+                        const char* day, const char* month, const char* year, ServiceCallback callback, gpointer userData);
+int withdrawServiceAsync(ServiceDispatcher* dispatcher, Account* account, const char* amount, const char* description,
+                         const char* day, const char* month, const char* year, ServiceCallback callback, gpointer userData);
+int transferServiceAsync(ServiceDispatcher* dispatcher, RepositoryFormat* repository, Account* account, const char* amount,
+                         const char* description, const char* receiverIBAN, const char* day, const char* month, const char* year,
+                         ServiceCallback callback, gpointer userData);
+int paymentServiceAsync(ServiceDispatcher* dispatcher, Account* account, const char* amount, const char* description,
+                        const char* day, const char* month, const char* year, ServiceCallback callback, gpointer userData);
+int batchTransactionServiceAsync(ServiceDispatcher* dispatcher, RepositoryFormat* repository, const TransactionOperation* operations,
+                                 int operationsNumber, int* results, ServiceCallback callback, gpointer userData);
+
 #endif
@@ -0,0 +1,289 @@
+#include "services.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/random.h>
+#endif
+
+////////////////////
+//
+//  Session table
+//
+////////////////////
+
+// Logged in users are sessions named by a random token, the GUI keeps one and the server one per client login.
+// The tokens index a hash table, so every request finds its account in constant time. Idle expiry runs on a
+// timing wheel of one second slots: a session waits in the slot of the second it would expire, and using it
+// only moves its last activity forward. When the wheel reaches the slot, sessions used since then are put back
+// in the slot of their new expiry and the others are closed, so neither requests nor expiry ever scan the table.
+
+#define SESSION_WHEEL_SLOTS 1024 // Power of two, timeouts longer than this just go around the wheel again
+
+typedef struct Session Session;
+
+struct Session {
+    char token[SESSION_TOKEN_SIZE];
+    Account* account;    // Held by the session until it is closed
+    gint64 openedAt;     // Seconds on the monotonic clock
+    gint64 lastActivity;
+    guint64 requestsNumber;
+    int slot;            // Wheel slot of the expiry it was last scheduled for
+    Session* previous;   // Neighbours in the wheel slot
+    Session* next;
+};
+
+struct SessionTable {
+    GMutex lock;
+    GHashTable* sessions; // Token -> Session, the key is the token stored in the session
+    Session* wheel[SESSION_WHEEL_SLOTS];
+    gint64 wheelTime;     // Last second the wheel was turned to
+    gint64 idleTimeout;
+};
+
+// Value destructor of the table, the account is released with the session
+static void destroySession(gpointer data) {
+    Session* session = data;
+    releaseAccount(session->account);
+    free(session);
+}
+
+static gint64 sessionClock(void) {
+    return g_get_monotonic_time() / G_USEC_PER_SEC;
+}
+
+// Hex of 16 random bytes. The kernel generator is used where there is one, tokens are the only credential
+// of a session once it is opened.
+static void generateSessionToken(char* token) {
+    static const char digits[] = "0123456789abcdef";
+    guint8 bytes[(SESSION_TOKEN_SIZE - 1) / 2];
+    size_t filled = 0;
+
+#ifdef __linux__
+    while (filled < sizeof(bytes)) {
+        ssize_t received = getrandom(bytes + filled, sizeof(bytes) - filled, 0);
+        if (received <= 0)
+            break;
+        filled += (size_t)received;
+    }
+#endif
+    for (; filled < sizeof(bytes); filled++)
+        bytes[filled] = (guint8)g_random_int_range(0, 256);
+
+    for (size_t i = 0; i < sizeof(bytes); i++) {
+        token[2 * i] = digits[bytes[i] >> 4];
+        token[2 * i + 1] = digits[bytes[i] & 0x0f];
+    }
+    token[SESSION_TOKEN_SIZE - 1] = '\0';
+}
+
+// Expects the caller to hold the table lock
+static void scheduleSession(SessionTable* table, Session* session) {
+    session->slot = (int)((session->lastActivity + table->idleTimeout) & (SESSION_WHEEL_SLOTS - 1));
+
+    session->previous = NULL;
+    session->next = table->wheel[session->slot];
+    if (session->next != NULL)
+        session->next->previous = session;
+    table->wheel[session->slot] = session;
+}
+
+// Takes the session out of its wheel slot, expects the caller to hold the table lock
+static void unscheduleSession(SessionTable* table, Session* session) {
+    if (session->previous != NULL)
+        session->previous->next = session->next;
+    else
+        table->wheel[session->slot] = session->next;
+
+    if (session->next != NULL)
+        session->next->previous = session->previous;
+}
+
+SessionTable* createSessionTable(int idleTimeoutSeconds) {
+    if (idleTimeoutSeconds <= 0)
+        return NULL;
+
+    SessionTable* table = calloc(1, sizeof(SessionTable));
+    if (table == NULL)
+        return NULL;
+
+    g_mutex_init(&table->lock);
+    table->sessions = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, destroySession);
+    table->wheelTime = sessionClock();
+    table->idleTimeout = idleTimeoutSeconds;
+
+    return table;
+}
+
+void destroySessionTable(SessionTable* table) {
+    if (table == NULL)
+        return;
+
+    g_hash_table_destroy(table->sessions);
+    g_mutex_clear(&table->lock);
+    free(table);
+}
+
+int openSession(SessionTable* table, Account* account, char* token) {
+    if (table == NULL)
+        return -471; // Session table not initialized
+
+    if (account == NULL || token == NULL)
+        return -472; // Invalid account
+
+    Session* session = calloc(1, sizeof(Session));
+    if (session == NULL)
+        return -473; // Memory allocation failed
+
+    session->account = retainAccount(account);
+    session->openedAt = sessionClock();
+    session->lastActivity = session->openedAt;
+
+    g_mutex_lock(&table->lock);
+
+    do {
+        generateSessionToken(session->token);
+    } while (g_hash_table_contains(table->sessions, session->token));
+
+    g_hash_table_insert(table->sessions, session->token, session);
+    scheduleSession(table, session);
+
+    g_mutex_unlock(&table->lock);
+
+    strcpy(token, session->token);
+    return 1;
+}
+
+Account* getSessionAccount(SessionTable* table, const char* token) {
+    if (table == NULL || token == NULL)
+        return NULL;
+
+    gint64 now = sessionClock();
+    Account* account = NULL;
+
+    g_mutex_lock(&table->lock);
+
+    Session* session = g_hash_table_lookup(table->sessions, token);
+    // An idle session is closed by the next expiry run, it just can't be used anymore meanwhile
+    if (session != NULL && now - session->lastActivity < table->idleTimeout) {
+        session->lastActivity = now;
+        session->requestsNumber++;
+        account = retainAccount(session->account); // Held for the caller, the session may close meanwhile
+    }
+
+    g_mutex_unlock(&table->lock);
+    return account;
+}
+
+short isSessionOpen(SessionTable* table, const char* token) {
+    if (table == NULL || token == NULL)
+        return 0;
+
+    gint64 now = sessionClock();
+
+    g_mutex_lock(&table->lock);
+    Session* session = g_hash_table_lookup(table->sessions, token);
+    short open = session != NULL && now - session->lastActivity < table->idleTimeout;
+    g_mutex_unlock(&table->lock);
+
+    return open;
+}
+
+int closeSession(SessionTable* table, const char* token) {
+    if (table == NULL)
+        return -471; // Session table not initialized
+
+    if (token == NULL)
+        return -474; // Unknown session
+
+    g_mutex_lock(&table->lock);
+
+    Session* session = g_hash_table_lookup(table->sessions, token);
+    if (session == NULL) {
+        g_mutex_unlock(&table->lock);
+        return -474; // Unknown session
+    }
+
+    unscheduleSession(table, session);
+    g_hash_table_remove(table->sessions, token);
+
+    g_mutex_unlock(&table->lock);
+    return 1;
+}
+
+int closeAccountSessions(SessionTable* table, const Account* account) {
+    if (table == NULL)
+        return -471; // Session table not initialized
+
+    if (account == NULL)
+        return -472; // Invalid account
+
+    int closedSessions = 0;
+    GHashTableIter iterator;
+    gpointer value;
+
+    g_mutex_lock(&table->lock);
+
+    // Only needed when an account is deleted, so the scan is fine here
+    g_hash_table_iter_init(&iterator, table->sessions);
+    while (g_hash_table_iter_next(&iterator, NULL, &value)) {
+        Session* session = value;
+        if (session->account != account)
+            continue;
+
+        unscheduleSession(table, session);
+        g_hash_table_iter_remove(&iterator);
+        closedSessions++;
+    }
+
+    g_mutex_unlock(&table->lock);
+    return closedSessions;
+}
+
+int expireIdleSessions(SessionTable* table) {
+    if (table == NULL)
+        return -471; // Session table not initialized
+
+    gint64 now = sessionClock();
+    int expiredSessions = 0;
+
+    g_mutex_lock(&table->lock);
+
+    // After a whole turn every slot was visited once, a longer pause doesn't need more work than that
+    gint64 firstSecond = MAX(table->wheelTime + 1, now - SESSION_WHEEL_SLOTS + 1);
+
+    for (gint64 second = firstSecond; second <= now; second++) {
+        Session** slot = &table->wheel[second & (SESSION_WHEEL_SLOTS - 1)];
+        Session* session = *slot;
+        *slot = NULL;
+
+        while (session != NULL) {
+            Session* next = session->next;
+
+            if (now - session->lastActivity >= table->idleTimeout) {
+                g_hash_table_remove(table->sessions, session->token);
+                expiredSessions++;
+            } else {
+                scheduleSession(table, session);
+            }
+
+            session = next;
+        }
+    }
+
+    if (now > table->wheelTime)
+        table->wheelTime = now;
+
+    g_mutex_unlock(&table->lock);
+    return expiredSessions;
+}
+
+int getSessionsNumber(SessionTable* table) {
+    if (table == NULL)
+        return -471; // Session table not initialized
+
+    g_mutex_lock(&table->lock);
+    int sessionsNumber = (int)g_hash_table_size(table->sessions);
+    g_mutex_unlock(&table->lock);
+
+    return sessionsNumber;
+}
@@ -0,0 +1,293 @@
+#include "services.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+////////////////////
+//
+//  Monthly statements
+//
+////////////////////
+
+// Writes the statement of a month for every account: opening and closing balance, the transactions of the month
+// and their totals by type. The range of the month is found with two binary searches over the ordered history,
+// and every statement streams to its own file through a buffer owned by the worker.
+//
+// The run works on a snapshot of the repository taken when it starts, so an account deleted meanwhile doesn't
+// shift the others past the workers; its statement is still written, up to the deletion.
+//
+// Workers claim a few accounts at a time from a shared counter, so a large history only keeps its own worker
+// busy. An account locked by someone else is put aside instead of waited for, and the workers come back to the
+// accounts put aside once the others are done.
+//
+// A statement reaching into archived periods pages the segments in through the cache of the account, under its
+// lock, and gives them back once written: a run visits every account once, so they wouldn't be read again.
+
+#define STATEMENT_CLAIM_SIZE 16
+#define STATEMENT_BUFFER_SIZE (64 * 1024)
+#define STATEMENT_TYPES_MAX 16
+
+typedef struct {
+    const char* type;
+    int count;
+    double total;
+} StatementTypeTotal;
+
+typedef struct {
+    Account** accounts;         // Snapshot of the repository, every account held until the run ends
+    const char* directory;
+    Date firstDay, lastDay;
+    int accountsNumber;
+    gint nextAccount;
+    GMutex deferredLock;
+    Account** deferredAccounts; // Accounts that were busy when their turn came, held until they are written
+    int deferredNumber, deferredCapacity;
+    StatementRunSummary summary;
+    GMutex summaryLock;
+} StatementRun;
+
+// First position of [low, high) dated on or after the date, or strictly after it
+static int searchStatementBoundary(const Account* account, int low, int high, Date date, short strictAfter) {
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        int comparison = compareDates(getTransactionDate(getAccountTransaction(account, middle)), date);
+        if (comparison < 0 || (strictAfter && comparison == 0))
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+static float getBalanceBefore(const Account* account, int index) {
+    if (index > 0)
+        return getTransactionRunningBalance(getAccountTransaction(account, index - 1));
+
+    Transaction* firstTransaction = getAccountTransaction(account, 0);
+    if (firstTransaction != NULL)
+        return getTransactionRunningBalance(firstTransaction) - getTransactionSignedAmount(firstTransaction);
+    return getAccountBalance(account);
+}
+
+static void addToTypeTotals(StatementTypeTotal* totals, int* totalsNumber, const char* type, float amount) {
+    for (int i = 0; i < *totalsNumber; i++) {
+        if (strcmp(totals[i].type, type) == 0) {
+            totals[i].count++;
+            totals[i].total += amount;
+            return;
+        }
+    }
+
+    if (*totalsNumber < STATEMENT_TYPES_MAX)
+        totals[(*totalsNumber)++] = (StatementTypeTotal){type, 1, amount};
+}
+
+// Expects the caller to hold the lock of the account
+static int writeStatement(const StatementRun* run, Account* account, FILE* statement) {
+    int archived = getAccountArchivedTransactionsNumber(account);
+    int transactionsNumber = getAccountTransactionsNumber(account);
+
+    // When the resident history starts before the month, the archived part can't hold any of it
+    short readsArchive = archived > 0 &&
+                         (archived == transactionsNumber ||
+                          compareDates(getTransactionDate(getAccountTransaction(account, archived)), run->firstDay) >= 0);
+    int low = readsArchive ? 0 : archived;
+
+    int first = searchStatementBoundary(account, low, transactionsNumber, run->firstDay, 0);
+    int last = searchStatementBoundary(account, first, transactionsNumber, run->lastDay, 1);
+    float openingBalance = getBalanceBefore(account, first);
+    float closingBalance = last > first ? getTransactionRunningBalance(getAccountTransaction(account, last - 1)) : openingBalance;
+
+    StatementTypeTotal totals[STATEMENT_TYPES_MAX];
+    int totalsNumber = 0;
+
+    fprintf(statement, "Statement %02d/%04d\nAccount: %s\nHolder: %s %s\nOpening balance: %.2f\n\n",
+            run->firstDay.month, run->firstDay.year, getAccountIban(account), getAccountFirstName(account),
+            getAccountSecondName(account), openingBalance);
+    fputs("Date;Type;Description;Amount;Balance\n", statement);
+
+    for (int i = first; i < last; i++) {
+        const Transaction* transaction = getAccountTransaction(account, i);
+        Date date = getTransactionDate(transaction);
+        float amount = getTransactionSignedAmount(transaction);
+        fprintf(statement, "%02d/%02d/%04d;%s;%s;%.2f;%.2f\n", date.day, date.month, date.year, getTransactionType(transaction),
+                getTransactionDescription(transaction), amount, getTransactionRunningBalance(transaction));
+        addToTypeTotals(totals, &totalsNumber, getTransactionType(transaction), amount);
+    }
+
+    fputs("\nType;Transactions;Total\n", statement);
+    for (int i = 0; i < totalsNumber; i++)
+        fprintf(statement, "%s;%d;%.2f\n", totals[i].type, totals[i].count, totals[i].total);
+    fprintf(statement, "\nClosing balance: %.2f\n", closingBalance);
+
+    if (readsArchive)
+        releaseAccountArchivedHistory(account);
+
+    return last - first;
+}
+
+// Returns 1 when the statement was written, 0 when the account was busy and waitForLock wasn't set
+static int generateAccountStatement(const StatementRun* run, Account* account, char* buffer, short waitForLock) {
+    if (waitForLock)
+        lockAccount(account);
+    else if (!tryLockAccount(account))
+        return 0;
+
+    gchar* fileName = g_strdup_printf("%s-%04d-%02d.txt", getAccountIban(account), run->firstDay.year, run->firstDay.month);
+    gchar* path = g_build_filename(run->directory, fileName, NULL);
+    g_free(fileName);
+
+    int result = 1;
+    FILE* statement = fopen(path, "w");
+    if (statement == NULL) {
+        result = -583; // The statement file can't be created
+    } else {
+        setvbuf(statement, buffer, _IOFBF, STATEMENT_BUFFER_SIZE);
+        writeStatement(run, account, statement);
+        if (ferror(statement))
+            result = -584; // Writing the statement failed
+        if (fclose(statement) != 0)
+            result = -584; // Writing the statement failed
+        if (result != 1)
+            remove(path);
+    }
+
+    unlockAccount(account);
+    g_free(path);
+    return result;
+}
+
+// Takes over the reference of the worker to the account
+static void deferAccount(StatementRun* run, Account* account, int* written, int* failed, char* buffer) {
+    g_mutex_lock(&run->deferredLock);
+    if (run->deferredNumber == run->deferredCapacity) {
+        int newCapacity = run->deferredCapacity * 2 + 64;
+        Account** newAccounts = realloc(run->deferredAccounts, newCapacity * sizeof(Account*));
+        if (newAccounts == NULL) {
+            // No room to put it aside, so this one is waited for
+            g_mutex_unlock(&run->deferredLock);
+            if (generateAccountStatement(run, account, buffer, 1) == 1)
+                (*written)++;
+            else
+                (*failed)++;
+            releaseAccount(account);
+            return;
+        }
+        run->deferredAccounts = newAccounts;
+        run->deferredCapacity = newCapacity;
+    }
+    run->deferredAccounts[run->deferredNumber++] = account;
+    g_mutex_unlock(&run->deferredLock);
+}
+
+static gpointer runStatementWorker(gpointer data) {
+    StatementRun* run = data;
+    int written = 0, failed = 0, deferred = 0;
+
+    char* buffer = malloc(STATEMENT_BUFFER_SIZE);
+    if (buffer == NULL)
+        return NULL; // The other workers take its share
+
+    while (TRUE) {
+        int first = g_atomic_int_add(&run->nextAccount, STATEMENT_CLAIM_SIZE);
+        if (first >= run->accountsNumber)
+            break;
+
+        int last = MIN(first + STATEMENT_CLAIM_SIZE, run->accountsNumber);
+        for (int i = first; i < last; i++) {
+            Account* account = retainAccount(run->accounts[i]);
+            int result = generateAccountStatement(run, account, buffer, 0);
+            if (result == 0) {
+                deferred++;
+                deferAccount(run, account, &written, &failed, buffer);
+                continue;
+            }
+
+            if (result == 1)
+                written++;
+            else
+                failed++;
+            releaseAccount(account);
+        }
+    }
+
+    // Accounts put aside by any worker, including the ones still claiming
+    while (TRUE) {
+        g_mutex_lock(&run->deferredLock);
+        Account* account = run->deferredNumber > 0 ? run->deferredAccounts[--run->deferredNumber] : NULL;
+        g_mutex_unlock(&run->deferredLock);
+        if (account == NULL)
+            break;
+
+        if (generateAccountStatement(run, account, buffer, 1) == 1)
+            written++;
+        else
+            failed++;
+        releaseAccount(account);
+    }
+
+    free(buffer);
+
+    g_mutex_lock(&run->summaryLock);
+    run->summary.statementsWritten += written;
+    run->summary.statementsFailed += failed;
+    run->summary.accountsDeferred += deferred;
+    g_mutex_unlock(&run->summaryLock);
+    return NULL;
+}
+
+int generateMonthlyStatements(RepositoryFormat* repository, short year, short month, const char* directory, int workersNumber,
+                              StatementRunSummary* summary) {
+    if (repository == NULL)
+        return -581; // Invalid repository
+
+    short daysInMonth = getDaysInMonth(month, year);
+    if (daysInMonth == 0 || year < 1)
+        return -582; // Invalid month
+
+    if (directory == NULL || g_mkdir_with_parents(directory, 0700) != 0)
+        return -583; // The statement file can't be created
+
+    StatementRun run = {0};
+    run.accounts = getRepositorySnapshot(repository, &run.accountsNumber);
+    if (run.accounts == NULL)
+        return -585; // Memory allocation failed
+    run.directory = directory;
+    run.firstDay = createDate(1, month, year);
+    run.lastDay = createDate(daysInMonth, month, year);
+    g_mutex_init(&run.deferredLock);
+    g_mutex_init(&run.summaryLock);
+
+    if (workersNumber <= 0)
+        workersNumber = (int)g_get_num_processors();
+    workersNumber = MAX(1, MIN(workersNumber, (run.accountsNumber + STATEMENT_CLAIM_SIZE - 1) / STATEMENT_CLAIM_SIZE));
+
+    gint64 startTime = g_get_monotonic_time();
+    GThread** threads = calloc(workersNumber, sizeof(GThread*));
+    if (threads == NULL) {
+        runStatementWorker(&run);
+    } else {
+        for (int i = 0; i < workersNumber; i++)
+            threads[i] = g_thread_new("statements", runStatementWorker, &run);
+        for (int i = 0; i < workersNumber; i++)
+            g_thread_join(threads[i]);
+        free(threads);
+    }
+
+    run.summary.elapsedMicroseconds = g_get_monotonic_time() - startTime;
+    run.summary.statementsPerSecond = run.summary.elapsedMicroseconds > 0
+                                          ? run.summary.statementsWritten * (double)G_USEC_PER_SEC / run.summary.elapsedMicroseconds
+                                          : 0;
+
+    for (int i = 0; i < run.accountsNumber; i++)
+        releaseAccount(run.accounts[i]);
+    free(run.accounts);
+    free(run.deferredAccounts);
+    g_mutex_clear(&run.deferredLock);
+    g_mutex_clear(&run.summaryLock);
+
+    if (summary != NULL)
+        *summary = run.summary;
+    return run.summary.statementsWritten;
+}
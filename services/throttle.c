@@ -0,0 +1,308 @@
+#include "services.h"
+#include <stdlib.h>
+#include <string.h>
+
+////////////////////
+//
+//  Login throttling
+//
+////////////////////
+
+// Every login attempt takes a token from the bucket of its account tag and from a bucket shared by all the
+// logins, before the repository is searched. Both are generic cell rate buckets: the state is the time at which
+// the bucket would be full again, an attempt is let in when that time is at most a burst ahead and pushes it
+// forward by one interval. Refilling is implicit in the clock, so a bucket is one time and nothing else.
+//
+// The buckets of the tags live in a set associative table: the hash of the tag picks a set of a few entries,
+// each set on a cache line of its own and guarded by a bit lock. The hash is seeded when the limiter is created,
+// so colliding tags can't be picked from outside. A tag missing from its set takes a free entry or the one idle
+// the longest, but an entry that recorded wrong passwords is never given away until its lockout is long over:
+// cycling through throwaway tags can't wipe a lockout. A set holding only such entries makes the table grow
+// instead. The table starts with room for the accounts of the bank and grows with them too, a login that finds
+// the table at its largest and its set full is refused.
+//
+// After a few wrong passwords in a row the bucket time of the tag is pushed further ahead with every failure,
+// doubling the wait up to a limit. A successful login clears the failures.
+
+#define LOGIN_TAG_INTERVAL 1000        // Milliseconds between attempts once the burst is spent
+#define LOGIN_TAG_BURST 5
+#define LOGIN_FREE_FAILURES 3          // Wrong passwords in a row before the lockout starts
+#define LOGIN_LOCKOUT_BASE 1000        // Milliseconds, doubled with every further failure
+#define LOGIN_LOCKOUT_MAX (15 * 60 * 1000)
+#define LOGIN_FAILURES_MAX 63
+
+#define LOGIN_SET_WAYS 4
+#define LOGIN_ENTRIES_PER_ACCOUNT 2    // Room for the tags of the bank and for attempts on tags that don't exist
+#define LOGIN_MIN_SETS 256
+#define LOGIN_MAX_SETS (1 << 20)
+
+typedef struct {
+    guint64 hash; // 0 marks a free entry
+    gint64 time;  // Milliseconds since the limiter was created at which the bucket of the tag is full again
+    int failures; // Wrong passwords in a row
+} LoginTagEntry;
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) LoginTagEntry ways[LOGIN_SET_WAYS];
+} LoginTagSet;
+
+struct LoginLimiter {
+    GRWLock tableLock;    // Read by every attempt, written when the table grows
+    LoginTagSet* sets;
+    gint* setLocks;       // Bit 0 of setLocks[i] guards sets[i]
+    gint setsNumber;      // Power of two
+    guint64 seed;
+    gint64 createdAt;     // Monotonic microseconds, the tag times count milliseconds from here
+    gint globalLock;      // Bit 0 guards globalTime
+    gint64 globalTime;    // Monotonic microseconds at which the shared bucket is full again
+    gint64 globalInterval;
+    gint64 globalTolerance; // How far ahead globalTime may run, the burst of the shared bucket
+};
+
+static int getLoginSetsNumber(int accountsNumber) {
+    gint64 wanted = (gint64)MAX(accountsNumber, 0) * LOGIN_ENTRIES_PER_ACCOUNT / LOGIN_SET_WAYS;
+    int setsNumber = LOGIN_MIN_SETS;
+    while (setsNumber < wanted && setsNumber < LOGIN_MAX_SETS)
+        setsNumber <<= 1;
+    return setsNumber;
+}
+
+static int allocateLoginSets(LoginLimiter* limiter, int setsNumber) {
+    LoginTagSet* sets = allocateCacheAligned(setsNumber * sizeof(LoginTagSet));
+    gint* setLocks = calloc(setsNumber, sizeof(gint));
+    if (sets == NULL || setLocks == NULL) {
+        freeCacheAligned(sets);
+        free(setLocks);
+        return 0;
+    }
+
+    memset(sets, 0, setsNumber * sizeof(LoginTagSet));
+    limiter->sets = sets;
+    limiter->setLocks = setLocks;
+    g_atomic_int_set(&limiter->setsNumber, setsNumber);
+    return 1;
+}
+
+LoginLimiter* createLoginLimiter(int accountsNumber, int attemptsPerSecond) {
+    if (accountsNumber < 0 || attemptsPerSecond <= 0)
+        return NULL;
+
+    LoginLimiter* limiter = calloc(1, sizeof(LoginLimiter));
+    if (limiter == NULL)
+        return NULL;
+
+    if (!allocateLoginSets(limiter, getLoginSetsNumber(accountsNumber))) {
+        free(limiter);
+        return NULL;
+    }
+
+    g_rw_lock_init(&limiter->tableLock);
+    limiter->seed = ((guint64)g_random_int() << 32) | g_random_int();
+    limiter->createdAt = g_get_monotonic_time();
+    limiter->globalTime = limiter->createdAt;
+    // One second of attempts can come at once, after that they are spaced evenly
+    limiter->globalInterval = MAX(1, G_USEC_PER_SEC / attemptsPerSecond);
+    limiter->globalTolerance = limiter->globalInterval * (attemptsPerSecond - 1);
+
+    return limiter;
+}
+
+void destroyLoginLimiter(LoginLimiter* limiter) {
+    if (limiter == NULL)
+        return;
+
+    g_rw_lock_clear(&limiter->tableLock);
+    freeCacheAligned(limiter->sets);
+    free(limiter->setLocks);
+    free(limiter);
+}
+
+// FNV-1a over the tag, started from the seed of the limiter
+static guint64 hashLoginTag(const LoginLimiter* limiter, const char* tag) {
+    guint64 hash = G_GUINT64_CONSTANT(14695981039346656037) ^ limiter->seed;
+    for (const unsigned char* character = (const unsigned char*)tag; *character != '\0'; character++) {
+        hash ^= *character;
+        hash *= G_GUINT64_CONSTANT(1099511628211);
+    }
+    hash ^= hash >> 29;
+    return hash != 0 ? hash : 1; // 0 marks a free entry
+}
+
+// Wrong passwords are remembered until the lockout they caused, or would cause, is long over
+static short isLoginEntryProtected(const LoginTagEntry* entry, gint64 now) {
+    return entry->failures > 0 && now < entry->time + LOGIN_LOCKOUT_MAX;
+}
+
+// Entry of the tag in its set, claimed when missing and claim is set. Returns NULL when the tag is missing and
+// every entry of the set is protected, or when it is missing and claim isn't set. Expects the set to be locked.
+static LoginTagEntry* findLoginEntry(LoginTagSet* set, guint64 hash, gint64 now, short claim) {
+    LoginTagEntry* freeEntry = NULL;
+    LoginTagEntry* idleEntry = NULL; // The one whose bucket filled up the longest ago
+    for (int way = 0; way < LOGIN_SET_WAYS; way++) {
+        LoginTagEntry* entry = &set->ways[way];
+        if (entry->hash == hash)
+            return entry;
+        if (entry->hash == 0) {
+            if (freeEntry == NULL)
+                freeEntry = entry;
+        } else if (!isLoginEntryProtected(entry, now) && (idleEntry == NULL || entry->time < idleEntry->time)) {
+            idleEntry = entry;
+        }
+    }
+
+    LoginTagEntry* claimedEntry = freeEntry != NULL ? freeEntry : idleEntry;
+    if (!claim || claimedEntry == NULL)
+        return NULL;
+
+    *claimedEntry = (LoginTagEntry){hash, 0, 0};
+    return claimedEntry;
+}
+
+// Doubles the table until it has at least setsNumber sets. Entries of a set split between two sets of the new
+// table, so every entry finds room. Returns 0 when the table can't grow.
+static int growLoginTable(LoginLimiter* limiter, int setsNumber) {
+    g_rw_lock_writer_lock(&limiter->tableLock);
+
+    int grown = 1;
+    while (grown && limiter->setsNumber < setsNumber) {
+        LoginTagSet* oldSets = limiter->sets;
+        gint* oldSetLocks = limiter->setLocks;
+        int oldSetsNumber = limiter->setsNumber;
+
+        if (oldSetsNumber >= LOGIN_MAX_SETS || !allocateLoginSets(limiter, oldSetsNumber * 2)) {
+            grown = 0;
+            break;
+        }
+
+        for (int i = 0; i < oldSetsNumber; i++) {
+            for (int way = 0; way < LOGIN_SET_WAYS; way++) {
+                const LoginTagEntry* entry = &oldSets[i].ways[way];
+                if (entry->hash == 0)
+                    continue;
+                LoginTagSet* set = &limiter->sets[entry->hash & (guint64)(limiter->setsNumber - 1)];
+                for (int newWay = 0; newWay < LOGIN_SET_WAYS; newWay++) {
+                    if (set->ways[newWay].hash == 0) {
+                        set->ways[newWay] = *entry;
+                        break;
+                    }
+                }
+            }
+        }
+
+        freeCacheAligned(oldSets);
+        free(oldSetLocks);
+    }
+
+    g_rw_lock_writer_unlock(&limiter->tableLock);
+    return grown;
+}
+
+static gint64 getLoginClock(const LoginLimiter* limiter) {
+    return (g_get_monotonic_time() - limiter->createdAt) / 1000;
+}
+
+static int takeTagToken(LoginLimiter* limiter, guint64 hash) {
+    while (TRUE) {
+        g_rw_lock_reader_lock(&limiter->tableLock);
+        int setsNumber = limiter->setsNumber;
+        int setIndex = (int)(hash & (guint64)(setsNumber - 1));
+        gint64 now = getLoginClock(limiter);
+
+        g_bit_lock(&limiter->setLocks[setIndex], 0);
+        LoginTagEntry* entry = findLoginEntry(&limiter->sets[setIndex], hash, now, 1);
+        int result = 1;
+        if (entry == NULL)
+            result = 0; // No room for the tag in its set
+        else if (entry->time - now > LOGIN_TAG_INTERVAL * (LOGIN_TAG_BURST - 1))
+            result = -611; // Too many login attempts for this account, wait a little
+        else
+            entry->time = MAX(entry->time, now) + LOGIN_TAG_INTERVAL;
+        g_bit_unlock(&limiter->setLocks[setIndex], 0);
+        g_rw_lock_reader_unlock(&limiter->tableLock);
+
+        if (result != 0)
+            return result;
+        if (!growLoginTable(limiter, setsNumber * 2))
+            return -611; // Too many login attempts for this account, wait a little
+    }
+}
+
+static int takeGlobalToken(LoginLimiter* limiter, gint64 now) {
+    int result = 1;
+
+    g_bit_lock(&limiter->globalLock, 0);
+    if (limiter->globalTime - now > limiter->globalTolerance)
+        result = -612; // Too many logins right now, try again later
+    else
+        limiter->globalTime = MAX(limiter->globalTime, now) + limiter->globalInterval;
+    g_bit_unlock(&limiter->globalLock, 0);
+
+    return result;
+}
+
+int beginLoginAttempt(LoginLimiter* limiter, const char* tag) {
+    if (limiter == NULL)
+        return -613; // Login limiter not initialized
+
+    if (tag == NULL)
+        return -302; // Missing username input.
+
+    // The tag goes first, so a storm on one account doesn't use up the logins of everyone else
+    int result = takeTagToken(limiter, hashLoginTag(limiter, tag));
+    if (result != 1)
+        return result;
+
+    return takeGlobalToken(limiter, g_get_monotonic_time());
+}
+
+void finishLoginAttempt(LoginLimiter* limiter, const char* tag, short succeeded) {
+    if (limiter == NULL || tag == NULL)
+        return;
+
+    guint64 hash = hashLoginTag(limiter, tag);
+    while (TRUE) {
+        g_rw_lock_reader_lock(&limiter->tableLock);
+        int setsNumber = limiter->setsNumber;
+        int setIndex = (int)(hash & (guint64)(setsNumber - 1));
+        gint64 now = getLoginClock(limiter);
+
+        g_bit_lock(&limiter->setLocks[setIndex], 0);
+        // A success only has failures to clear, a tag that lost its entry meanwhile has none left
+        LoginTagEntry* entry = findLoginEntry(&limiter->sets[setIndex], hash, now, !succeeded);
+        if (entry != NULL && succeeded) {
+            entry->failures = 0;
+        } else if (entry != NULL) {
+            entry->failures = MIN(entry->failures + 1, LOGIN_FAILURES_MAX);
+            if (entry->failures > LOGIN_FREE_FAILURES) {
+                int doublings = MIN(entry->failures - LOGIN_FREE_FAILURES - 1, 20);
+                gint64 lockout = MIN((gint64)LOGIN_LOCKOUT_BASE << doublings, LOGIN_LOCKOUT_MAX);
+                // The next attempt is let in once the lockout is over, like a bucket that just spent its burst
+                entry->time = MAX(entry->time, now + LOGIN_TAG_INTERVAL * (LOGIN_TAG_BURST - 1) + lockout);
+            } else {
+                entry->time = MAX(entry->time, now);
+            }
+        }
+        g_bit_unlock(&limiter->setLocks[setIndex], 0);
+        g_rw_lock_reader_unlock(&limiter->tableLock);
+
+        if (entry != NULL || succeeded || !growLoginTable(limiter, setsNumber * 2))
+            return;
+    }
+}
+
+int loginServiceThrottled(LoginLimiter* limiter, RepositoryFormat* repository, const char* username, const char* password,
+                          Account** loggedUser) {
+    // The table follows the size of the bank, read without the lock since a stale size only delays the growth
+    if (limiter != NULL && g_atomic_int_get(&limiter->setsNumber) < getLoginSetsNumber(getRepositorySize(repository)))
+        growLoginTable(limiter, getLoginSetsNumber(getRepositorySize(repository)));
+
+    int result = beginLoginAttempt(limiter, username);
+    if (result != 1)
+        return result;
+
+    result = loginService(repository, username, password, loggedUser);
+    // Only a wrong tag or password counts as a failure, malformed input never reached the accounts
+    if (result == 1 || result == -307)
+        finishLoginAttempt(limiter, username, result == 1);
+    return result;
+}
@@ -0,0 +1,167 @@
+#include "services.h"
+#include <stdlib.h>
+
+////////////////////
+//
+//  Transfer benchmark
+//
+////////////////////
+
+// Measures how many transfers inside the bank the typed service commits per second when several threads run
+// them at once and many of them land on the same account, the way salaries or a popular merchant do. The run
+// builds a repository of its own: every account is opened with enough money for the whole run, then every
+// worker sends transfers from random accounts, to the hot account for the hot spot share of them and to
+// another random account for the rest. The hot account is drawn as a sender like the others, so its lock is
+// taken from both sides of the pair.
+//
+// Deposits, withdrawals and payments are measured the same way on a single account: the hot account for the hot
+// spot share of them and a random account for the rest. They take one account lock instead of a pair, so the run
+// of a kind against the transfers shows what the second lock and the credit of the receiver cost.
+//
+// The transfers go through the velocity checks like any other, so a run meant to measure the locking turns the
+// rules off first.
+
+#define TRANSFER_BENCHMARK_AMOUNT MONEY_CENTS
+#define TRANSFER_BENCHMARK_HOT_ACCOUNT 0
+
+typedef struct {
+    RepositoryFormat* repository;
+    Account** accounts;
+    const TransferBenchmarkOptions* options;
+    PackedDate date;
+    gint transfersDone, transfersFailed;
+} TransferBenchmark;
+
+typedef struct {
+    TransferBenchmark* benchmark;
+    guint32 seed;
+} TransferBenchmarkWorker;
+
+// Xorshift, the workers draw their accounts without sharing a generator
+static guint32 nextBenchmarkRandom(guint32* state) {
+    guint32 value = *state;
+    value ^= value << 13;
+    value ^= value >> 17;
+    value ^= value << 5;
+    *state = value;
+    return value;
+}
+
+// Tags have to be letters only, the index is written in base 26
+static void formatBenchmarkTag(int index, char* tag) {
+    int length = 0;
+    tag[length++] = 'b';
+    do {
+        tag[length++] = (char)('a' + index % 26);
+        index /= 26;
+    } while (index > 0);
+    tag[length] = '\0';
+}
+
+static gpointer runTransferBenchmarkWorker(gpointer data) {
+    TransferBenchmarkWorker* worker = data;
+    TransferBenchmark* benchmark = worker->benchmark;
+    const TransferBenchmarkOptions* options = benchmark->options;
+    int done = 0, failed = 0;
+
+    for (int i = 0; i < options->transfersPerWorker; i++) {
+        int sender = (int)(nextBenchmarkRandom(&worker->seed) % options->accountsNumber);
+        int receiver;
+        if ((int)(nextBenchmarkRandom(&worker->seed) % 100) < options->hotSpotPercent)
+            receiver = TRANSFER_BENCHMARK_HOT_ACCOUNT;
+        else
+            receiver = (int)(nextBenchmarkRandom(&worker->seed) % options->accountsNumber);
+        if (receiver == sender)
+            receiver = (sender + 1) % options->accountsNumber;
+
+        // The other kinds book on the account a transfer would have credited
+        short transfers = options->kind == TRANSACTION_TRANSFER;
+        Account* account = benchmark->accounts[transfers ? sender : receiver];
+        if (transactionServiceTyped(benchmark->repository, account, options->kind, TRANSFER_BENCHMARK_AMOUNT, "Benchmark",
+                                    transfers ? getAccountIban(benchmark->accounts[receiver]) : NULL, benchmark->date) == 1)
+            done++;
+        else
+            failed++;
+    }
+
+    g_atomic_int_add(&benchmark->transfersDone, done);
+    g_atomic_int_add(&benchmark->transfersFailed, failed);
+    return NULL;
+}
+
+static int openBenchmarkAccounts(TransferBenchmark* benchmark) {
+    const TransferBenchmarkOptions* options = benchmark->options;
+    // Enough for every debit of the run to come from the same account
+    MoneyAmount openingBalance = (MoneyAmount)options->workersNumber * options->transfersPerWorker * TRANSFER_BENCHMARK_AMOUNT;
+
+    for (int i = 0; i < options->accountsNumber; i++) {
+        char tag[16];
+        formatBenchmarkTag(i, tag);
+        if (createAccountService(benchmark->repository, tag, "benchmark", "benchmark", "checking", "0", "Benchmark", "Account",
+                                 "1", "1", "1990", &benchmark->accounts[i]) != 1)
+            return 0;
+        if (transactionServiceTyped(benchmark->repository, benchmark->accounts[i], TRANSACTION_DEPOSIT, openingBalance,
+                                    "Opening balance", NULL, benchmark->date) != 1)
+            return 0;
+    }
+
+    return 1;
+}
+
+int runTransferBenchmark(const TransferBenchmarkOptions* options, TransferBenchmarkSummary* summary) {
+    if (options == NULL || options->workersNumber <= 0 || options->accountsNumber < 2 || options->transfersPerWorker <= 0 ||
+        options->hotSpotPercent < 0 || options->hotSpotPercent > 100 ||
+        (options->kind != TRANSACTION_DEPOSIT && options->kind != TRANSACTION_WITHDRAW && options->kind != TRANSACTION_TRANSFER &&
+         options->kind != TRANSACTION_PAYMENT))
+        return -641; // Invalid benchmark options
+
+    TransferBenchmark benchmark = {0};
+    benchmark.repository = createRepository();
+    benchmark.accounts = calloc(options->accountsNumber, sizeof(Account*));
+    benchmark.options = options;
+    benchmark.date = packDate(createDate(1, 1, 2025));
+    TransferBenchmarkWorker* workers = calloc(options->workersNumber, sizeof(TransferBenchmarkWorker));
+    GThread** threads = calloc(options->workersNumber, sizeof(GThread*));
+
+    int result = 1;
+    if (benchmark.repository == NULL || benchmark.accounts == NULL || workers == NULL || threads == NULL)
+        result = -642; // Memory allocation failed
+    else if (!openBenchmarkAccounts(&benchmark))
+        result = -643; // The accounts of the benchmark can't be opened
+
+    gint64 elapsed = 0;
+    if (result == 1) {
+        gint64 startTime = g_get_monotonic_time();
+        for (int i = 0; i < options->workersNumber; i++) {
+            workers[i] = (TransferBenchmarkWorker){&benchmark, 2463534242u + 7919u * (guint32)i};
+            threads[i] = g_thread_new("transfer-benchmark", runTransferBenchmarkWorker, &workers[i]);
+        }
+        for (int i = 0; i < options->workersNumber; i++)
+            g_thread_join(threads[i]);
+        elapsed = g_get_monotonic_time() - startTime;
+    }
+
+    if (summary != NULL) {
+        summary->transfersDone = benchmark.transfersDone;
+        summary->transfersFailed = benchmark.transfersFailed;
+        summary->elapsedMicroseconds = elapsed;
+        summary->transfersPerSecond = elapsed > 0 ? benchmark.transfersDone * (double)G_USEC_PER_SEC / elapsed : 0;
+    }
+
+    // Deleted rather than only released, so their transactions leave the index shared with the rest of the bank
+    for (int i = 0; benchmark.accounts != NULL && i < options->accountsNumber; i++) {
+        Account* account = benchmark.accounts[i];
+        if (account == NULL)
+            continue;
+        Account* deletedAccount = account;
+        deleteAccountService(benchmark.repository, &deletedAccount);
+        releaseAccount(account);
+    }
+    free(benchmark.accounts);
+    free(workers);
+    free(threads);
+    if (benchmark.repository != NULL)
+        destroyRepository(benchmark.repository);
+
+    return result;
+}
@@ -0,0 +1,177 @@
+#include "services.h"
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define VALIDATION_HAS_AVX2 1
+#endif
+
+////////////////////
+//
+//  Character class validation
+//
+////////////////////
+
+// Every field of every request goes through these checks, and imports run them on every field of every record.
+// A field is validated and measured in the same pass: the vector versions test 16 or 32 bytes per step against
+// the allowed classes and look for the terminator at the same time. Loads are aligned, so a block never crosses
+// into the next page even when it reads past the end of the string; the bytes before the start and after the
+// terminator are masked out. Targets without SSE2 use the class table one byte at a time.
+
+#if !defined(__SSE2__)
+static const guint8 characterClassTable[256] = {
+    ['0'] = CHARACTER_CLASS_DIGIT, ['1'] = CHARACTER_CLASS_DIGIT, ['2'] = CHARACTER_CLASS_DIGIT,
+    ['3'] = CHARACTER_CLASS_DIGIT, ['4'] = CHARACTER_CLASS_DIGIT, ['5'] = CHARACTER_CLASS_DIGIT,
+    ['6'] = CHARACTER_CLASS_DIGIT, ['7'] = CHARACTER_CLASS_DIGIT, ['8'] = CHARACTER_CLASS_DIGIT,
+    ['9'] = CHARACTER_CLASS_DIGIT,
+    [','] = CHARACTER_CLASS_SEPARATOR, ['.'] = CHARACTER_CLASS_SEPARATOR,
+    ['A'] = CHARACTER_CLASS_LETTER, ['B'] = CHARACTER_CLASS_LETTER, ['C'] = CHARACTER_CLASS_LETTER,
+    ['D'] = CHARACTER_CLASS_LETTER, ['E'] = CHARACTER_CLASS_LETTER, ['F'] = CHARACTER_CLASS_LETTER,
+    ['G'] = CHARACTER_CLASS_LETTER, ['H'] = CHARACTER_CLASS_LETTER, ['I'] = CHARACTER_CLASS_LETTER,
+    ['J'] = CHARACTER_CLASS_LETTER, ['K'] = CHARACTER_CLASS_LETTER, ['L'] = CHARACTER_CLASS_LETTER,
+    ['M'] = CHARACTER_CLASS_LETTER, ['N'] = CHARACTER_CLASS_LETTER, ['O'] = CHARACTER_CLASS_LETTER,
+    ['P'] = CHARACTER_CLASS_LETTER, ['Q'] = CHARACTER_CLASS_LETTER, ['R'] = CHARACTER_CLASS_LETTER,
+    ['S'] = CHARACTER_CLASS_LETTER, ['T'] = CHARACTER_CLASS_LETTER, ['U'] = CHARACTER_CLASS_LETTER,
+    ['V'] = CHARACTER_CLASS_LETTER, ['W'] = CHARACTER_CLASS_LETTER, ['X'] = CHARACTER_CLASS_LETTER,
+    ['Y'] = CHARACTER_CLASS_LETTER, ['Z'] = CHARACTER_CLASS_LETTER,
+    ['a'] = CHARACTER_CLASS_LETTER, ['b'] = CHARACTER_CLASS_LETTER, ['c'] = CHARACTER_CLASS_LETTER,
+    ['d'] = CHARACTER_CLASS_LETTER, ['e'] = CHARACTER_CLASS_LETTER, ['f'] = CHARACTER_CLASS_LETTER,
+    ['g'] = CHARACTER_CLASS_LETTER, ['h'] = CHARACTER_CLASS_LETTER, ['i'] = CHARACTER_CLASS_LETTER,
+    ['j'] = CHARACTER_CLASS_LETTER, ['k'] = CHARACTER_CLASS_LETTER, ['l'] = CHARACTER_CLASS_LETTER,
+    ['m'] = CHARACTER_CLASS_LETTER, ['n'] = CHARACTER_CLASS_LETTER, ['o'] = CHARACTER_CLASS_LETTER,
+    ['p'] = CHARACTER_CLASS_LETTER, ['q'] = CHARACTER_CLASS_LETTER, ['r'] = CHARACTER_CLASS_LETTER,
+    ['s'] = CHARACTER_CLASS_LETTER, ['t'] = CHARACTER_CLASS_LETTER, ['u'] = CHARACTER_CLASS_LETTER,
+    ['v'] = CHARACTER_CLASS_LETTER, ['w'] = CHARACTER_CLASS_LETTER, ['x'] = CHARACTER_CLASS_LETTER,
+    ['y'] = CHARACTER_CLASS_LETTER, ['z'] = CHARACTER_CLASS_LETTER,
+};
+
+static gssize scanCharacterClassScalar(const gchar* text, int classes) {
+    const guint8* position = (const guint8*)text;
+
+    for (; *position != '\0'; position++) {
+        if ((characterClassTable[*position] & classes) == 0)
+            return -1;
+    }
+
+    return position - (const guint8*)text;
+}
+#endif
+
+// Reads whole aligned blocks around the string on purpose, which the address sanitizer would report
+#if defined(__SANITIZE_ADDRESS__)
+#define VALIDATION_NO_SANITIZE __attribute__((no_sanitize_address))
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define VALIDATION_NO_SANITIZE __attribute__((no_sanitize_address))
+#endif
+#endif
+#ifndef VALIDATION_NO_SANITIZE
+#define VALIDATION_NO_SANITIZE
+#endif
+
+// Finds the end of the block scan: the terminator ends the string, an allowed byte mask missing a bit before it
+// means an invalid byte. Returns 1 when the string ended, filling length or setting it to -1.
+static inline int finishBlock(const gchar* text, const guint8* block, guint32 zeroMask, guint32 invalidMask, gssize* length) {
+    if (zeroMask == 0) {
+        if (invalidMask != 0) {
+            *length = -1;
+            return 1;
+        }
+        return 0;
+    }
+
+    guint32 end = (guint32)__builtin_ctz(zeroMask);
+    *length = (invalidMask & ((1u << end) - 1)) != 0 ? -1 : (gssize)(block + end - (const guint8*)text);
+    return 1;
+}
+
+#if defined(__SSE2__)
+static VALIDATION_NO_SANITIZE gssize scanCharacterClassSse2(const gchar* text, int classes) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i caseBit = _mm_set1_epi8(0x20);
+    const __m128i beforeLetters = _mm_set1_epi8('a' - 1), afterLetters = _mm_set1_epi8('z' + 1);
+    const __m128i beforeDigits = _mm_set1_epi8('0' - 1), afterDigits = _mm_set1_epi8('9' + 1);
+    const __m128i comma = _mm_set1_epi8(','), period = _mm_set1_epi8('.');
+
+    const guint8* block = (const guint8*)((guintptr)text & ~(guintptr)15);
+    guint32 skippedMask = 0xffffu << ((const guint8*)text - block);
+    gssize length;
+
+    while (TRUE) {
+        __m128i bytes = _mm_load_si128((const __m128i*)block);
+        __m128i allowed = zero;
+
+        // Signed compares are enough: every allowed byte is below 0x80 and the others compare as negative
+        if (classes & CHARACTER_CLASS_LETTER) {
+            __m128i lower = _mm_or_si128(bytes, caseBit);
+            allowed = _mm_or_si128(allowed, _mm_and_si128(_mm_cmpgt_epi8(lower, beforeLetters), _mm_cmplt_epi8(lower, afterLetters)));
+        }
+        if (classes & CHARACTER_CLASS_DIGIT)
+            allowed = _mm_or_si128(allowed, _mm_and_si128(_mm_cmpgt_epi8(bytes, beforeDigits), _mm_cmplt_epi8(bytes, afterDigits)));
+        if (classes & CHARACTER_CLASS_SEPARATOR)
+            allowed = _mm_or_si128(allowed, _mm_or_si128(_mm_cmpeq_epi8(bytes, comma), _mm_cmpeq_epi8(bytes, period)));
+
+        guint32 zeroMask = (guint32)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, zero)) & skippedMask;
+        guint32 invalidMask = ~(guint32)_mm_movemask_epi8(allowed) & 0xffffu & skippedMask;
+        if (finishBlock(text, block, zeroMask, invalidMask, &length))
+            return length;
+
+        skippedMask = 0xffffu;
+        block += 16;
+    }
+}
+#endif
+
+#ifdef VALIDATION_HAS_AVX2
+__attribute__((target("avx2")))
+static VALIDATION_NO_SANITIZE gssize scanCharacterClassAvx2(const gchar* text, int classes) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i caseBit = _mm256_set1_epi8(0x20);
+    const __m256i beforeLetters = _mm256_set1_epi8('a' - 1), afterLetters = _mm256_set1_epi8('z' + 1);
+    const __m256i beforeDigits = _mm256_set1_epi8('0' - 1), afterDigits = _mm256_set1_epi8('9' + 1);
+    const __m256i comma = _mm256_set1_epi8(','), period = _mm256_set1_epi8('.');
+
+    const guint8* block = (const guint8*)((guintptr)text & ~(guintptr)31);
+    guint32 skippedMask = 0xffffffffu << ((const guint8*)text - block);
+    gssize length;
+
+    while (TRUE) {
+        __m256i bytes = _mm256_load_si256((const __m256i*)block);
+        __m256i allowed = zero;
+
+        if (classes & CHARACTER_CLASS_LETTER) {
+            __m256i lower = _mm256_or_si256(bytes, caseBit);
+            allowed = _mm256_or_si256(allowed, _mm256_and_si256(_mm256_cmpgt_epi8(lower, beforeLetters), _mm256_cmpgt_epi8(afterLetters, lower)));
+        }
+        if (classes & CHARACTER_CLASS_DIGIT)
+            allowed = _mm256_or_si256(allowed, _mm256_and_si256(_mm256_cmpgt_epi8(bytes, beforeDigits), _mm256_cmpgt_epi8(afterDigits, bytes)));
+        if (classes & CHARACTER_CLASS_SEPARATOR)
+            allowed = _mm256_or_si256(allowed, _mm256_or_si256(_mm256_cmpeq_epi8(bytes, comma), _mm256_cmpeq_epi8(bytes, period)));
+
+        guint32 zeroMask = (guint32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, zero)) & skippedMask;
+        guint32 invalidMask = ~(guint32)_mm256_movemask_epi8(allowed) & skippedMask;
+        if (finishBlock(text, block, zeroMask, invalidMask, &length))
+            return length;
+
+        skippedMask = 0xffffffffu;
+        block += 32;
+    }
+}
+#endif
+
+gssize scanCharacterClass(const gchar* text, int classes) {
+    if (text == NULL)
+        return -1;
+
+#ifdef VALIDATION_HAS_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        return scanCharacterClassAvx2(text, classes);
+#endif
+#if defined(__SSE2__)
+    return scanCharacterClassSse2(text, classes);
+#else
+    return scanCharacterClassScalar(text, classes);
+#endif
+}
@@ -0,0 +1,202 @@
+#include "services.h"
+#include <stdlib.h>
+#include <string.h>
+
+////////////////////
+//
+//  Velocity checks
+//
+////////////////////
+
+// Withdrawals, transfers and payments are screened against limits on how often and how much an account debits
+// in the last hour and the last day, and on how many receivers it pays for the first time in a day. Every
+// account keeps its debits in two rings of buckets, minutes for the hour and hours for the day, with the totals
+// of the window next to them. Moving the window clears the buckets it leaves behind and takes them off the
+// totals, so a check reads the totals and a debit adds to one bucket: no history is scanned.
+//
+// Receivers already paid are remembered as fingerprints in a small direct mapped table, seeded from the recent
+// history when the counters of the account are created. A receiver that lost its slot to another one counts as
+// new again, which only makes the rule stricter.
+//
+// The counters follow the wall clock rather than the dates of the transactions, which the user picks. They are
+// guarded by the lock of the account, like its balance.
+//
+// Debits made one at a time and debits of a batch are held to separate rule sets sharing the same counters. The
+// batch set is off unless the bank sets it, and standing orders skip both: the holder agreed to them beforehand.
+
+#define VELOCITY_HOUR_BUCKETS 60 // One per minute
+#define VELOCITY_DAY_BUCKETS 24  // One per hour
+#define VELOCITY_KNOWN_RECEIVERS 64
+#define VELOCITY_SEEDED_TRANSACTIONS 256
+#define VELOCITY_MINUTE ((gint64)60 * G_USEC_PER_SEC)
+#define VELOCITY_HOUR ((gint64)3600 * G_USEC_PER_SEC)
+
+typedef struct {
+    gint64 slot; // Minute or hour since the epoch counted by the bucket
+    int debits;
+    int newReceivers;
+    MoneyAmount amount;
+} VelocityBucket;
+
+typedef struct {
+    gint64 latestSlot;
+    int debits;
+    int newReceivers;
+    MoneyAmount amount;
+} VelocityTotals;
+
+typedef struct {
+    VelocityTotals hourTotals, dayTotals;
+    VelocityBucket hour[VELOCITY_HOUR_BUCKETS];
+    VelocityBucket day[VELOCITY_DAY_BUCKETS];
+    guint32 knownReceivers[VELOCITY_KNOWN_RECEIVERS];
+} VelocityCounters;
+
+// Set when the program starts, before any service runs, and only read afterwards
+static VelocityRules velocityRules[VELOCITY_RULE_SETS] = {
+    [VELOCITY_RULES_SINGLE] = {
+        .maxDebitsPerHour = 30,
+        .maxAmountPerHour = 10000 * MONEY_CENTS,
+        .maxDebitsPerDay = 200,
+        .maxAmountPerDay = 50000 * MONEY_CENTS,
+        .maxNewReceiversPerDay = 10,
+    },
+    [VELOCITY_RULES_BATCH] = {0},
+};
+
+void setVelocityRules(VelocityRuleSet ruleSet, const VelocityRules* rules) {
+    if (rules != NULL && ruleSet >= 0 && ruleSet < VELOCITY_RULE_SETS)
+        velocityRules[ruleSet] = *rules;
+}
+
+void getVelocityRules(VelocityRuleSet ruleSet, VelocityRules* rules) {
+    if (rules != NULL && ruleSet >= 0 && ruleSet < VELOCITY_RULE_SETS)
+        *rules = velocityRules[ruleSet];
+}
+
+// Whether any limit of the set is on, a set with none doesn't need to be checked nor counted
+short hasVelocityRules(VelocityRuleSet ruleSet) {
+    if (ruleSet < 0 || ruleSet >= VELOCITY_RULE_SETS)
+        return 0;
+
+    const VelocityRules* rules = &velocityRules[ruleSet];
+    return rules->maxDebitsPerHour > 0 || rules->maxAmountPerHour > 0 || rules->maxDebitsPerDay > 0 ||
+           rules->maxAmountPerDay > 0 || rules->maxNewReceiversPerDay > 0;
+}
+
+static guint32 getReceiverFingerprint(const char* receiverIBAN) {
+    guint32 fingerprint = g_str_hash(receiverIBAN);
+    return fingerprint != 0 ? fingerprint : 1; // 0 marks a free slot
+}
+
+static short isKnownReceiver(const VelocityCounters* counters, guint32 fingerprint) {
+    return counters->knownReceivers[fingerprint % VELOCITY_KNOWN_RECEIVERS] == fingerprint;
+}
+
+// Moves the window to the slot, clearing the buckets of the slots skipped on the way. A clock going back keeps
+// the window where it is.
+static void advanceWindow(VelocityTotals* totals, VelocityBucket* buckets, int bucketsNumber, gint64 slot) {
+    if (slot <= totals->latestSlot)
+        return;
+
+    if (slot - totals->latestSlot >= bucketsNumber) {
+        memset(buckets, 0, bucketsNumber * sizeof(VelocityBucket));
+        totals->debits = 0;
+        totals->newReceivers = 0;
+        totals->amount = 0;
+        totals->latestSlot = slot;
+        return;
+    }
+
+    while (totals->latestSlot < slot) {
+        totals->latestSlot++;
+        VelocityBucket* bucket = &buckets[totals->latestSlot % bucketsNumber];
+        totals->debits -= bucket->debits;
+        totals->newReceivers -= bucket->newReceivers;
+        totals->amount -= bucket->amount;
+        *bucket = (VelocityBucket){totals->latestSlot, 0, 0, 0};
+    }
+}
+
+static void addToWindow(VelocityTotals* totals, VelocityBucket* buckets, int bucketsNumber, MoneyAmount amount, int newReceivers) {
+    VelocityBucket* bucket = &buckets[totals->latestSlot % bucketsNumber];
+    bucket->debits++;
+    bucket->newReceivers += newReceivers;
+    bucket->amount += amount;
+    totals->debits++;
+    totals->newReceivers += newReceivers;
+    totals->amount += amount;
+}
+
+static VelocityCounters* getVelocityCounters(Account* account, gint64 now) {
+    if (account->velocityCounters != NULL)
+        return account->velocityCounters;
+
+    VelocityCounters* counters = calloc(1, sizeof(VelocityCounters));
+    if (counters == NULL)
+        return NULL;
+
+    counters->hourTotals.latestSlot = now / VELOCITY_MINUTE;
+    counters->dayTotals.latestSlot = now / VELOCITY_HOUR;
+
+    // Receivers of the latest transfers are known already, the older ones were paid long enough ago to count again
+    int transactionsNumber = getAccountTransactionsNumber(account);
+    int first = MAX(getAccountArchivedTransactionsNumber(account), transactionsNumber - VELOCITY_SEEDED_TRANSACTIONS);
+    for (int i = first; i < transactionsNumber; i++) {
+        const Transaction* transaction = getAccountTransaction(account, i);
+        const char* receiverIBAN = getTransactionReceiverIban(transaction);
+        if (strcmp(getTransactionType(transaction), "transfer") == 0 && receiverIBAN != NULL && receiverIBAN[0] != '\0') {
+            guint32 fingerprint = getReceiverFingerprint(receiverIBAN);
+            counters->knownReceivers[fingerprint % VELOCITY_KNOWN_RECEIVERS] = fingerprint;
+        }
+    }
+
+    account->velocityCounters = counters;
+    return counters;
+}
+
+int checkVelocityRules(Account* account, VelocityRuleSet ruleSet, MoneyAmount amount, const char* receiverIBAN) {
+    if (ruleSet < 0 || ruleSet >= VELOCITY_RULE_SETS)
+        return 1;
+
+    gint64 now = g_get_real_time();
+    VelocityCounters* counters = getVelocityCounters(account, now);
+    if (counters == NULL)
+        return -596; // Memory allocation failed
+
+    advanceWindow(&counters->hourTotals, counters->hour, VELOCITY_HOUR_BUCKETS, now / VELOCITY_MINUTE);
+    advanceWindow(&counters->dayTotals, counters->day, VELOCITY_DAY_BUCKETS, now / VELOCITY_HOUR);
+
+    const VelocityRules* rules = &velocityRules[ruleSet];
+    if (rules->maxDebitsPerHour > 0 && counters->hourTotals.debits >= rules->maxDebitsPerHour)
+        return -591; // Too many debits in the last hour
+    if (rules->maxAmountPerHour > 0 && counters->hourTotals.amount + amount > rules->maxAmountPerHour)
+        return -592; // The amount debited in the last hour would go over the limit
+    if (rules->maxDebitsPerDay > 0 && counters->dayTotals.debits >= rules->maxDebitsPerDay)
+        return -593; // Too many debits in the last day
+    if (rules->maxAmountPerDay > 0 && counters->dayTotals.amount + amount > rules->maxAmountPerDay)
+        return -594; // The amount debited in the last day would go over the limit
+
+    if (receiverIBAN != NULL && rules->maxNewReceiversPerDay > 0 &&
+        !isKnownReceiver(counters, getReceiverFingerprint(receiverIBAN)) &&
+        counters->dayTotals.newReceivers >= rules->maxNewReceiversPerDay)
+        return -595; // Too many new receivers in the last day
+
+    return 1;
+}
+
+void recordVelocityDebit(Account* account, MoneyAmount amount, const char* receiverIBAN) {
+    VelocityCounters* counters = account->velocityCounters;
+    if (counters == NULL)
+        return; // Only debits that were checked are recorded
+
+    int newReceivers = 0;
+    if (receiverIBAN != NULL) {
+        guint32 fingerprint = getReceiverFingerprint(receiverIBAN);
+        newReceivers = !isKnownReceiver(counters, fingerprint);
+        counters->knownReceivers[fingerprint % VELOCITY_KNOWN_RECEIVERS] = fingerprint;
+    }
+
+    addToWindow(&counters->hourTotals, counters->hour, VELOCITY_HOUR_BUCKETS, amount, newReceivers);
+    addToWindow(&counters->dayTotals, counters->day, VELOCITY_DAY_BUCKETS, amount, newReceivers);
+}